@@ -1,6 +1,6 @@
 #include "env.h"
-#include "equality.h"
 #include "hash_table.h"
+#include "symbol.h"
 
 #include <assert.h>
 
@@ -11,27 +11,79 @@ StaticEnv *r_alloc()
 	StaticEnv *r = mm_alloc(STATIC_ENV, sizeof(*r));
 
 	r->constants = v_empty();
+	r->constants_r = ht_empty();
 	r->primitives_r = ht_empty();
 	r->globals_r = ht_empty();
 	r->frames_r = v_empty();
+	r->boxes_r = v_empty();
+	r->scopes_r = v_empty();
+	r->assigned_r = mk_nil();
+	r->version = 0;
+	r->cache_version = 0;
+	r->code_cache_r = ht_empty();
+	r->nr_call_sites = 0;
 
 	return r;
 }
 
-void r_push_frame(StaticEnv *r, Value ns)
+void r_push_frame(StaticEnv *r, Value ns, Value boxed)
 {
 	r->frames_r = v_push(r->frames_r, list_to_vector(ns));
+	r->boxes_r = v_push(r->boxes_r, boxed);
 }
 
 void r_pop_frame(StaticEnv *r)
 {
 	r->frames_r = v_pop(r->frames_r);
+	r->boxes_r = v_pop(r->boxes_r);
 }
 
-unsigned r_add_constant(StaticEnv *r, Value v)
+void r_push_scope(StaticEnv *r)
 {
+	// Nothing else sees the scope, so it's transient throughout.
+	Vector *scope = v_transient_begin(v_empty());
+
+	scope = v_push(scope, mk_fixnum(v_size(r->frames_r)));
+	r->scopes_r = v_push(r->scopes_r, mk_ref(scope));
+}
+
+Value r_pop_scope(StaticEnv *r)
+{
+	Vector *scope = v_ref(r->scopes_r, v_size(r->scopes_r) - 1).ptr;
+	unsigned i;
+	ListBuilder lb;
+
+	lb_init(&lb);
+	for (i = 1; i < v_size(scope); i++)
+		lb_append(&lb, car(v_ref(scope, i)));
+
+	r->scopes_r = v_pop(r->scopes_r);
+	return lb_get(&lb);
+}
+
+unsigned r_push_constant(StaticEnv *r, Value v)
+{
+	unsigned index = v_size(r->constants);
+	Value existing;
+
 	r->constants = v_push(r->constants, v);
-	return v_size(r->constants) - 1;
+	if (ht_hashable(v) && !ht_lookup(r->constants_r, v, &existing))
+		r->constants_r = ht_insert(r->constants_r, v, mk_fixnum(index));
+
+	return index;
+}
+
+unsigned r_add_constant(StaticEnv *r, Value v)
+{
+	Value index;
+
+	if (!ht_hashable(v))
+		return r_push_constant(r, v);
+
+	if (ht_lookup(r->constants_r, v, &index))
+		return as_fixnum(index);
+
+	return r_push_constant(r, v);
 }
 
 Value r_constant(StaticEnv *r, unsigned index)
@@ -50,13 +102,16 @@ static void check_duplicate(StaticEnv *r, Value k)
 void r_add_prim(StaticEnv *r, Value prim)
 {
 	Primitive *p = as_ref(prim);
-	Value n = mk_ref(mk_string_from_cstr(SYMBOL, p->name));
+	Value n = mk_ref(mk_symbol_cstr(p->name));
 	Value v = mk_fixnum(v_size(r->constants));
 
 	fprintf(stderr, "adding primitive %s\n", p->name);
 	check_duplicate(r, n);
 	r->primitives_r = ht_insert(r->primitives_r, n, v);
 	r->constants = v_push(r->constants, prim);
+
+	// Symbols that were globals may now be primitives.
+	r->version++;
 }
 
 // FIXME: review all this, it's key to our semantics.  Must get this the same
@@ -64,30 +119,112 @@ void r_add_prim(StaticEnv *r, Value prim)
 Kind compute_kind(StaticEnv *r, String *sym)
 {
 	Value v;
-	unsigned nr_syms;
-	unsigned n, i, j, nr_frames = v_size(r->frames_r);
+	Kind k;
+	unsigned n;
 
 	// Local?  These can override globals and constants.
-	for (i = nr_frames; i; i--) {
-		Vector *f = v_ref(r->frames_r, i).ptr;
-		nr_syms = v_size(f);
-		for (j = 0; j < nr_syms; j++)
-			if (equalp(v_ref(f, j), mk_ref(sym)))
-				return (Kind) {KindLocal, nr_frames - i, j};
-	}
+	if (r_lookup_local(r, sym, &k))
+		return k;
 
 	// An already defined global overrides a primitive.
 	if (ht_lookup(r->globals_r, mk_ref(sym), &v))
-		return (Kind) {KindGlobal, as_fixnum(v), 0};
+		return (Kind) {KindGlobal, as_fixnum(v), 0, false};
 
 	// Primitive?
 	if (ht_lookup(r->primitives_r, mk_ref(sym), &v))
-		return (Kind) {KindConstant, as_fixnum(v), 0};
+		return (Kind) {KindConstant, as_fixnum(v), 0, false};
 
 	// Assume it's an as yet undefined global
 	n = ht_size(r->globals_r);
 	r->globals_r = ht_insert(r->globals_r, mk_ref(sym), mk_fixnum(n));
-	return (Kind) {KindGlobal, n, 0};
+	return (Kind) {KindGlobal, n, 0, false};
+}
+
+static bool memq_(String *sym, Value xs)
+{
+	for (; is_cons(xs); xs = cdr(xs))
+		if (car(xs).ptr == sym)
+			return true;
+
+	return false;
+}
+
+// Looks in the frames below nr_frames, as seen from scope i (scope -1 being
+// the top level).  Symbols are interned so we can compare pointers.
+static bool lookup_(StaticEnv *r, String *sym, unsigned nr_frames, int i, Kind *k)
+{
+	Vector *scope = NULL;
+	Value pair;
+	unsigned f, j, base = 0;
+
+	if (i >= 0) {
+		scope = v_ref(r->scopes_r, i).ptr;
+		base = as_fixnum(v_ref(scope, 0));
+	}
+
+	for (f = nr_frames; f > base; f--) {
+		Vector *names = v_ref(r->frames_r, f - 1).ptr;
+		for (j = 0; j < v_size(names); j++)
+			if (v_ref(names, j).ptr == sym) {
+				*k = (Kind) {KindLocal, nr_frames - f, j,
+					     memq_(sym, v_ref(r->boxes_r, f - 1))};
+				return true;
+			}
+	}
+
+	if (!scope)
+		return false;
+
+	for (j = 1; j < v_size(scope); j++) {
+		pair = v_ref(scope, j);
+		if (car(pair).ptr == sym) {
+			*k = (Kind) {KindClosed, j - 1, 0, !is_nil(cdr(pair))};
+			return true;
+		}
+	}
+
+	// Capture it, if the enclosing lambda can see it.
+	if (!lookup_(r, sym, base, i - 1, k))
+		return false;
+
+	pair = mk_ref(cons(mk_ref(sym), k->boxed ? mk_fixnum(1) : mk_nil()));
+	scope = v_push(scope, pair);
+	r->scopes_r = v_set(r->scopes_r, i, mk_ref(scope));
+	*k = (Kind) {KindClosed, v_size(scope) - 2, 0, k->boxed};
+	return true;
+}
+
+bool r_lookup_local(StaticEnv *r, String *sym, Kind *k)
+{
+	return lookup_(r, sym, v_size(r->frames_r), (int) v_size(r->scopes_r) - 1, k);
+}
+
+// Globals are only ever added, and a form defines those it refers to as
+// it's compiled, so recompiling it would give the same code until the
+// version changes.
+Thunk *r_cached_code(StaticEnv *r, Value sexp)
+{
+	Value t;
+
+	if (r->cache_version != r->version) {
+		r->code_cache_r = ht_empty();
+		r->cache_version = r->version;
+		return NULL;
+	}
+
+	if (v_size(r->frames_r) || !ht_hashable(sexp))
+		return NULL;
+
+	return ht_lookup(r->code_cache_r, sexp, &t) ? t.ptr : NULL;
+}
+
+void r_cache_code(StaticEnv *r, Value sexp, Thunk *t)
+{
+	if (r->cache_version != r->version || v_size(r->frames_r) ||
+	    !ht_hashable(sexp))
+		return;
+
+	r->code_cache_r = ht_insert(r->code_cache_r, sexp, mk_ref(t));
 }
 
 //----------------------------------------------------------------
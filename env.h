@@ -4,14 +4,20 @@
 #include "vm.h"
 
 //----------------------------------------------------------------
-// We classify variables into three kinds:
+// We classify variables into four kinds:
 //
 // - Local i, j;     i is the frame depth, and j is the value index.
+// - Closed i;       i is an index into the running closure's captured
+//                   values.
 // - Global i;       i is an index into a global array.
 // - Constant i;     i is an index into the constants array.
+//
+// Locals and closed variables that are both captured and assigned are
+// boxed, so the closures share them.
 
 typedef enum {
 	KindLocal,
+	KindClosed,
 	KindGlobal,
 	KindConstant
 } KindType;
@@ -19,36 +25,80 @@ typedef enum {
 typedef struct {
 	KindType t;
 	unsigned i, j;
+	bool boxed;
 
 } Kind;
 
 //----------------------------------------------------------------
 
 typedef struct {
-	// int -> value, constants includes primitives
+	// int -> value, constants includes primitives.  Only ever appended
+	// to, the vm runs from a flat copy.
 	Vector *constants;
 
+	// value -> index, so equal constants share a slot.  Primitives aren't
+	// in here.
+	HashTable *constants_r;
+
 	// name -> index
 	HashTable *primitives_r;
 	HashTable *globals_r;
 
 	// Vector of frames containing names, the compiled code will create the
-	// runtime frames.
+	// runtime frames.  boxes_r holds a list of the boxed names for each.
 	Vector *frames_r;
+	Vector *boxes_r;
+
+	// A scope for each lambda being compiled.  Element 0 is the index in
+	// frames_r of the lambda's own frame, frames below that are reached
+	// through the captured variables, which follow as (name . boxed).
+	// Variables are captured as they're first referred to.
+	Vector *scopes_r;
+
+	// Names that are assigned anywhere in the form being compiled.
+	Value assigned_r;
+
+	// Toplevel datum -> thunk.  Bumped whenever something is added that
+	// could change how an already compiled form compiles; the cache only
+	// holds thunks compiled at cache_version.
+	unsigned version;
+	unsigned cache_version;
+	HashTable *code_cache_r;
+
+	// Each regular call gets an index into the vm's call caches.
+	unsigned nr_call_sites;
 
 } StaticEnv;
 
 StaticEnv *r_alloc();
 
-// ns is a list of symbols (it gets converted to a vector)
-void r_push_frame(StaticEnv *r, Value ns);
+// ns is a list of symbols (it gets converted to a vector), boxed the list
+// of those that are boxed.
+void r_push_frame(StaticEnv *r, Value ns, Value boxed);
 void r_pop_frame(StaticEnv *r);
 
+// Returns the names the lambda captured, in order.
+void r_push_scope(StaticEnv *r);
+Value r_pop_scope(StaticEnv *r);
+
+// Returns the index of an existing equal constant if there is one.
 unsigned r_add_constant(StaticEnv *r, Value v);
+
+// Always appends, for loaders that must reproduce exact indexes.
+unsigned r_push_constant(StaticEnv *r, Value v);
+
 void r_add_prim(StaticEnv *r, Value p);
 
 Kind compute_kind(StaticEnv *r, String *sym);
 
+// Like compute_kind(), for locals and closed variables only, and without
+// defining any globals.  It does capture outer locals.
+bool r_lookup_local(StaticEnv *r, String *sym, Kind *k);
+
+// Cached thunks are keyed by the structure of the datum, not its identity.
+Thunk *r_cached_code(StaticEnv *r, Value sexp);
+void r_cache_code(StaticEnv *r, Value sexp, Thunk *t);
+
 //----------------------------------------------------------------
 
 #endif
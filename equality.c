@@ -1,14 +1,47 @@
 #include "equality.h"
+#include "cons.h"
 #include "error.h"
+#include "hash_table.h"
 #include "mm.h"
 #include "string_type.h"
+#include "vector.h"
 
 //----------------------------------------------------------------
 
+static bool list_equalp(Value lhs, Value rhs)
+{
+	while (is_cons(lhs) && is_cons(rhs)) {
+		// shared tail
+		if (lhs.ptr == rhs.ptr)
+			return true;
+
+		if (!equalp(car(lhs), car(rhs)))
+			return false;
+
+		lhs = cdr(lhs);
+		rhs = cdr(rhs);
+	}
+
+	return equalp(lhs, rhs);
+}
+
 bool equalp(Value lhs, Value rhs)
 {
-	ObjectType lt = get_type(lhs);
-	ObjectType rt = get_type(rhs);
+	ObjectType lt, rt;
+
+	// Identical values are always equal, this also catches shared
+	// structure.
+	if (lhs.ptr == rhs.ptr)
+		return true;
+
+	lt = get_type(lhs);
+	rt = get_type(rhs);
+
+	// Ropes compare equal to strings with the same contents.
+	if ((lt == ROPE && (rt == STRING || rt == ROPE)) ||
+	    (rt == ROPE && lt == STRING))
+		return string_value_len(lhs) == string_value_len(rhs) &&
+			string_eq(as_flat_string(lhs), as_flat_string(rhs));
 
 	if (lt != rt)
 		return false;
@@ -17,9 +50,32 @@ bool equalp(Value lhs, Value rhs)
 	case FIXNUM:
 		return lhs.i == rhs.i;
 
+	case INT64:
+		return as_int(lhs) == as_int(rhs);
+
+	case NIL:
+		return true;
+
 	case STRING:
+		return string_eq(lhs.ptr, rhs.ptr);
+
 	case SYMBOL:
-		return !string_cmp(lhs.ptr, rhs.ptr);
+		// interned, so the pointer check above would have caught it
+		return false;
+
+	case CONS:
+		return list_equalp(lhs, rhs);
+
+	case VECTOR:
+		return v_equalp(lhs.ptr, rhs.ptr);
+
+	case HTABLE:
+		return ht_equalp(lhs.ptr, rhs.ptr);
+
+	case PRIMITIVE:
+	case CLOSURE:
+		// identity
+		return false;
 
 	default:
 		error("equality not implemented for this type yet");
@@ -29,4 +85,3 @@ bool equalp(Value lhs, Value rhs)
 }
 
 //----------------------------------------------------------------
-
@@ -1,14 +1,22 @@
 #include "cons.h"
 #include "env.h"
+#include "hash_table.h"
+#include "primitives.h"
 #include "string_type.h"
+#include "symbol.h"
 #include "vm.h"
 
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 
 //----------------------------------------------------------------
 // Thunks
+//
+// A top level form is compiled into a single thunk, the code for each
+// subexpression is appended as it's compiled.  Forward jumps are emitted
+// with a placeholder offset, which is patched once the target is known.
 
 static Thunk *t_new(size_t size)
 {
@@ -25,8 +33,8 @@ static size_t t_size(Thunk *t)
 	return t->e - t->b;
 }
 
-// The next two functions can realloc t->b, so don't use them after doing any
-// shift operations.
+// This can realloc t->b, so refer to positions within the thunk by offset,
+// and don't use it after doing any shift operations.
 static void t_append(Thunk *t, uint8_t byte)
 {
 	if (t->e == t->alloc_e) {
@@ -41,125 +49,270 @@ static void t_append(Thunk *t, uint8_t byte)
 	*t->e++ = byte;
 }
 
-static void t_merge(Thunk *t, Thunk *rhs)
+static void t_patch16(Thunk *t, size_t offset, unsigned v)
 {
-	unsigned remaining = t->alloc_e - t->e;
-	unsigned extra = t_size(rhs);
+	if (v >= 256 * 256)
+		error("jump is too long");
 
-	if (remaining < extra) {
-		unsigned old_size = t_size(t);
-		unsigned new_size = t_size(t) + t_size(rhs) * 2;
-		t->b = mm_realloc(t->b, new_size);
-		t->e = t->b + old_size;
-		t->alloc_e = t->b + new_size;
-	}
+	t->b[offset] = v >> 8;
+	t->b[offset + 1] = v & 0xff;
+}
 
-	memcpy(t->e, rhs->b, extra);
-	t->e += extra;
+// Sets a 16 bit operand at offset to the distance from just after it to
+// the current end of the code.
+static void t_patch_here(Thunk *t, size_t offset)
+{
+	t_patch16(t, offset, t_size(t) - (offset + 2));
 }
 
 //----------------------------------------------------------------
 // Runtime environment
 
-static void push_v(Stack *s, Value v)
+// The value stack grows a chunk at a time, up to MAX_STACK_CHUNKS.  One
+// spare chunk is kept above the top, so a stack that sits on a chunk
+// boundary doesn't keep allocating and freeing.
+#define STACK_CHUNK_SIZE 1024
+#define MAX_STACK_CHUNKS 1024
+
+static StackChunk *chunk_new_(StackChunk *prev)
+{
+	StackChunk *c = malloc(sizeof(*c) + STACK_CHUNK_SIZE * sizeof(Value));
+
+	if (!c)
+		error("couldn't allocate stack");
+
+	c->prev = prev;
+	c->next = NULL;
+	return c;
+}
+
+static void stack_enter_(Stack *s, StackChunk *c)
+{
+	s->chunk = c;
+	s->b = c->values;
+	s->e = c->values + STACK_CHUNK_SIZE;
+}
+
+static void stack_init(Stack *s)
+{
+	stack_enter_(s, chunk_new_(NULL));
+	s->sp = s->b;
+	s->nr_chunks = 1;
+}
+
+static void stack_exit(Stack *s)
+{
+	StackChunk *c, *next;
+
+	while (s->chunk->prev)
+		s->chunk = s->chunk->prev;
+
+	for (c = s->chunk; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+}
+
+// Empties the stack, keeping the first chunk.
+static void stack_reset(Stack *s)
+{
+	while (s->chunk->prev)
+		s->chunk = s->chunk->prev;
+
+	stack_enter_(s, s->chunk);
+	s->sp = s->b;
+}
+
+static void stack_grow_(Stack *s)
+{
+	if (!s->chunk->next) {
+		if (s->nr_chunks == MAX_STACK_CHUNKS)
+			error("stack overflow");
+
+		s->chunk->next = chunk_new_(s->chunk);
+		s->nr_chunks++;
+	}
+
+	stack_enter_(s, s->chunk->next);
+	s->sp = s->b;
+}
+
+static void stack_shrink_(Stack *s)
+{
+	StackChunk *spare = s->chunk->next;
+
+	assert(s->chunk->prev);
+	if (spare) {
+		free(spare);
+		s->chunk->next = NULL;
+		s->nr_chunks--;
+	}
+
+	stack_enter_(s, s->chunk->prev);
+	s->sp = s->e;
+}
+
+static inline void push_v(Stack *s, Value v)
 {
-	assert(s->current < MAX_STACK);
-	s->sp[s->current++] = v;
+	if (s->sp == s->e)
+		stack_grow_(s);
+	*s->sp++ = v;
 }
 
-static Value pop_v(Stack *s)
+static inline Value pop_v(Stack *s)
 {
-	assert(s->current);
-	return s->sp[s->current--];
+	if (s->sp == s->b)
+		stack_shrink_(s);
+	return *--s->sp;
 }
 
 static void push_p(Stack *s, void *ptr)
 {
-	assert(s->current < MAX_STACK);
-	s->sp[s->current++].ptr = ptr;
+	push_v(s, mk_ref(ptr));
 }
 
 static void *pop_p(Stack *s)
 {
-	assert(s->current);
-	return s->sp[s->current--].ptr;
+	return pop_v(s).ptr;
 }
 
 static void *peek_p(Stack *s)
 {
-	assert(s->current);
-	return s->sp[s->current].ptr;
+	if (s->sp == s->b) {
+		assert(s->chunk->prev);
+		return s->chunk->prev->values[STACK_CHUNK_SIZE - 1].ptr;
+	}
+
+	return s->sp[-1].ptr;
 }
 
 //----------------------------------------------------------------
 
-static Frame *f_new(unsigned count)
+// Reserved up front, but pages are only touched as the stack deepens.
+#define FRAME_STACK_SIZE (16 * 1024 * 1024)
+
+static inline bool is_stack_frame(VM *vm, Frame *f)
 {
-	Frame *f = mm_alloc(FRAME, sizeof(*f) + count * sizeof(Value));
+	return (char *) f >= vm->frames_b && (char *) f < vm->frames_e;
+}
+
+static inline size_t f_stack_len(unsigned count)
+{
+	size_t len = sizeof(Frame) + count * sizeof(Value);
+	return (len + 7) & ~((size_t) 7);
+}
+
+static Frame *f_new_stack(VM *vm, unsigned count)
+{
+	size_t len = f_stack_len(count);
+	Frame *f = (Frame *) vm->frames_top;
+
+	if (len > vm->frames_e - vm->frames_top)
+		error("frame stack overflow");
+
+	vm->frames_top += len;
 	f->next = NULL;
+	f->nr = count;
 	return f;
 }
 
-static Value f_get(Frame *f, unsigned index)
+// Pops f, and everything allocated after it.
+static void f_pop_stack(VM *vm, Frame *f)
+{
+	if (is_stack_frame(vm, f))
+		vm->frames_top = (char *) f;
+}
+
+// Frame indexes are checked by the verifier, not here.
+static inline Value f_get(Frame *f, unsigned index)
 {
-	assert(index < f->nr);
 	return f->values[index];
 }
 
 static Value f_deep_get(Frame *f, unsigned depth, unsigned index)
 {
-	while (depth--) {
+	while (depth--)
 		f = f->next;
-		if (!f)
-			error("bad fetch");
-	}
 
 	return f_get(f, index);
 }
 
-static void f_set(Frame *f, unsigned index, Value v)
+static inline void f_set(Frame *f, unsigned index, Value v)
 {
-	assert(index < f->nr);
 	f->values[index] = v;
 }
 
 static void f_deep_set(Frame *f, unsigned depth, unsigned index, Value v)
 {
-	while (depth--) {
+	while (depth--)
 		f = f->next;
-		assert(f);
-	}
 
 	f_set(f, index, v);
 }
 
+// For dotted lambdas, the arguments after the first nr_fixed are collected
+// into a list in the last slot of a new frame.
+static Frame *f_pack_rest(VM *vm, Frame *f, unsigned nr_fixed)
+{
+	unsigned i;
+	Value rest = mk_nil();
+	Frame *r;
+
+	if (f->nr < nr_fixed)
+		error("arity error");
+
+	r = f_new_stack(vm, nr_fixed + 1);
+	for (i = 0; i < nr_fixed; i++)
+		r->values[i] = f->values[i];
+
+	for (i = f->nr; i > nr_fixed; i--)
+		rest = mk_ref(cons(f->values[i - 1], rest));
+	r->values[nr_fixed] = rest;
+
+	return r;
+}
+
 //----------------------------------------------------------------
 // Closure
 
 // We don't need to store the arity or nary status since that gets compiled
 // into the thunk; the thunk knows how to prepare the frame from the stack
 // contents.
-// FIXME: if we're doing it this way then call/cc is back on the table.
+//
+// Closures are flat, they hold copies of just the variables they use
+// rather than the environment.  Variables that are assigned as well as
+// captured are boxed in a cons, so every closure sees the assignment.
+// Frames are never captured, so they can all live on the frame stack.
 typedef struct {
 	Thunk code;
-	Frame *env;
+	unsigned nr;
+	Value values[0];
 } Closure;
 
 //----------------------------------------------------------------
 // Virtual Machine
 
 typedef enum {
-	ALLOCATE_DOTTED_FRAME,
-	ALLOCATE_FRAME,
+	ADD_FIXNUM,
+	ADD_IMM,
+	ALLOCATE_STACK_FRAME,
 	ARITY_EQ,
 	ARITY_GEQ,
 
+	BOX_ARG,
+	BOX_SET,
+
 	CALL0,
 	CALL1,
 	CALL2,
 	CALL3,
 
+	CAR,
+	CDR,
+
 	CHECKED_GLOBAL_REF,
+	CLOSURE_REF,
+	CMP,
 	CONSTANT,
 	CREATE_CLOSURE,
 
@@ -175,6 +328,7 @@ typedef enum {
 
 	FUN_INVOKE,
 	FUN_POP,
+	FUN_TAIL_INVOKE,
 
 	GLOBAL_REF,
 	GLOBAL_SET,
@@ -196,6 +350,8 @@ typedef enum {
 	SHALLOW_ARGUMENT_REF,
 	SHALLOW_ARGUMENT_SET,
 
+	UNBOX,
+
 	VALUE_POP,
 	VALUE_PUSH,
 } ByteOp;
@@ -221,64 +377,334 @@ static inline uint16_t shift16(Thunk *t)
 	return r;
 }
 
+// The interpreter only runs verified code (see verify_thunk()), so reads
+// its operands without checking.
+static inline uint8_t fetch8(Thunk *t)
+{
+	return *t->b++;
+}
+
+static inline uint16_t fetch16(Thunk *t)
+{
+	uint16_t r = t->b[0] << 8 | t->b[1];
+	t->b += 2;
+	return r;
+}
+
+// The operand of CMP.
+typedef enum {
+	CMP_LT,
+	CMP_EQ,
+} CmpOp;
+
+static inline Primitive *prim_(VM *vm, unsigned index)
+{
+	return as_ref(vm->constants[index]);
+}
+
+static inline bool is_fixnum_(Value v)
+{
+	return get_tag(v) == TAG_FIXNUM;
+}
+
+static void call_prim_(VM *vm, Primitive *p, Frame *f)
+{
+	switch (p->argc) {
+	case 0:
+		vm->val = p->prim0();
+		break;
+
+	case 1:
+		vm->val = p->prim1(f->values[0]);
+		break;
+
+	case 2:
+		vm->val = p->prim2(f->values[0], f->values[1]);
+		break;
+
+	default:
+		vm->val = p->prim3(f->values[0], f->values[1], f->values[2]);
+		break;
+	}
+	f_pop_stack(vm, f);
+}
+
+// Calls c, starting at entry.  RETURN pops the frame stack back to below
+// the arguments.
+static void enter_(VM *vm, Closure *c, unsigned char *entry, Frame *f)
+{
+	push_p(&vm->stack, vm->code.b);
+	push_p(&vm->stack, vm->code.e);
+	push_p(&vm->stack, is_stack_frame(vm, f) ? (char *) f : vm->frames_top);
+	push_p(&vm->stack, vm->closed);
+	vm->code = c->code;
+	vm->code.b = entry;
+	vm->env = NULL;
+	vm->closed = c->values;
+}
+
+// A call in tail position reuses the caller's return, and its frames, so a
+// loop written as tail recursion runs in constant space.  The frame stack
+// above the caller's base only holds frames the caller has finished with,
+// so the arguments are moved down onto it.
+static void replace_(VM *vm, Closure *c, unsigned char *entry, Frame *f)
+{
+	char *base;
+	size_t len;
+	Value *closed;
+
+	// The return goes back to our caller, with its captured values.
+	closed = pop_p(&vm->stack);
+	base = pop_p(&vm->stack);
+
+	if (is_stack_frame(vm, f)) {
+		len = f_stack_len(f->nr);
+		memmove(base, f, len);
+		f = (Frame *) base;
+		vm->frames_top = base + len;
+		vm->val = mk_ref(f);
+	}
+
+	push_p(&vm->stack, base);
+	push_p(&vm->stack, closed);
+	vm->code = c->code;
+	vm->code.b = entry;
+	vm->env = NULL;
+	vm->closed = c->values;
+}
+
+// Call sites share caches once there are more than an operand can index,
+// which costs misses but is still correct.
+#define MAX_CALL_SITES (256 * 256)
+
+// Returns true, with the entry point in *entry, if the call at site was
+// last made to the same function with as many arguments.
+static inline bool cache_hit_(VM *vm, unsigned site, Frame *f, unsigned char **entry)
+{
+	CallCache *ic;
+
+	if (site >= vm->nr_call_caches)
+		return false;
+
+	ic = vm->call_caches + site;
+	if (ic->fun != vm->fun.ptr || ic->nr != f->nr || ic->epoch != vm->epoch)
+		return false;
+
+	*entry = ic->entry;
+	return true;
+}
+
+static void cache_fill_(VM *vm, unsigned site, Frame *f, unsigned char *entry)
+{
+	CallCache *ic;
+
+	if (site < vm->nr_call_caches) {
+		ic = vm->call_caches + site;
+		ic->fun = vm->fun.ptr;
+		ic->entry = entry;
+		ic->nr = f->nr;
+		ic->epoch = vm->epoch;
+	}
+}
+
+// Checks vm->fun can be called with f, and returns where to enter it,
+// NULL for a primitive.
+static unsigned char *check_call_(VM *vm, unsigned site, Frame *f)
+{
+	Closure *c;
+	Primitive *p;
+
+	switch (get_type(vm->fun)) {
+	case CLOSURE:
+		// Only fixed arity closures start with a check that can be
+		// skipped, dotted ones always pack their rest argument.
+		c = as_ref(vm->fun);
+		if (c->code.b[0] != ARITY_EQ)
+			return c->code.b;
+
+		if (c->code.b[1] != f->nr)
+			error("arity error");
+
+		cache_fill_(vm, site, f, c->code.b + 2);
+		return c->code.b + 2;
+
+	case PRIMITIVE:
+		p = as_ref(vm->fun);
+		if (f->nr != p->argc)
+			error("arity error");
+
+		cache_fill_(vm, site, f, NULL);
+		return NULL;
+
+	default:
+		error("not a function");
+		return NULL;
+	}
+}
+
+// The frame of arguments is in vm->val.
+static void invoke_(VM *vm, unsigned site)
+{
+	Frame *f = as_ref(vm->val);
+	unsigned char *entry;
+
+	if (!cache_hit_(vm, site, f, &entry))
+		entry = check_call_(vm, site, f);
+
+	if (entry)
+		enter_(vm, as_ref(vm->fun), entry, f);
+	else
+		call_prim_(vm, as_ref(vm->fun), f);
+}
+
+// At the top level there's no caller to return to, so it's a regular call.
+static void tail_invoke_(VM *vm, unsigned site)
+{
+	Frame *f = as_ref(vm->val);
+	unsigned char *entry;
+
+	if (!cache_hit_(vm, site, f, &entry))
+		entry = check_call_(vm, site, f);
+
+	if (!entry)
+		call_prim_(vm, as_ref(vm->fun), f);
+	else if (vm->closed)
+		replace_(vm, as_ref(vm->fun), entry, f);
+	else
+		enter_(vm, as_ref(vm->fun), entry, f);
+}
+
 // Returns false if program exits
 static inline bool step(VM *vm)
 {
-	uint8_t i, j;
-	uint16_t ij;
+	Thunk *t = &vm->code;
+	unsigned i, j, n;
+	int imm;
 	Frame *f;
 	Closure *c;
 
-	switch (shift_op(vm->code)) {
-	case ALLOCATE_DOTTED_FRAME:
-		vm->val = mk_ref(f_new(shift8(vm->code) + 1));
+	switch (shift_op(t)) {
+	case ADD_FIXNUM:
+		i = fetch16(t);
+		vm->arg1 = pop_v(&vm->stack);
+		if (is_fixnum_(vm->arg1) && is_fixnum_(vm->val))
+			vm->val = mk_int((int64_t) as_fixnum(vm->arg1) + as_fixnum(vm->val));
+		else
+			vm->val = prim_(vm, i)->prim2(vm->arg1, vm->val);
+		break;
+
+	case ADD_IMM:
+		imm = (int8_t) fetch8(t);
+		i = fetch16(t);
+		if (is_fixnum_(vm->val))
+			vm->val = mk_int((int64_t) as_fixnum(vm->val) + imm);
+		else
+			vm->val = prim_(vm, i)->prim2(vm->val, mk_fixnum(imm));
 		break;
 
-	case ALLOCATE_FRAME:
-		push_p(&vm->stack, f_new(shift8(vm->code)));
+	case ALLOCATE_STACK_FRAME:
+		vm->val = mk_ref(f_new_stack(vm, fetch8(t)));
 		break;
 
 	case ARITY_EQ:
+		if (((Frame *) as_ref(vm->val))->nr != fetch8(t))
+			error("arity error");
 		break;
 
 	case ARITY_GEQ:
+		vm->val = mk_ref(f_pack_rest(vm, as_ref(vm->val), fetch8(t) - 1));
+		break;
+
+	case BOX_ARG:
+		i = fetch8(t);
+		f_set(vm->env, i, mk_ref(cons(f_get(vm->env, i), mk_nil())));
+		break;
+
+	case BOX_SET:
+		((Cons *) as_ref(vm->val))->car = pop_v(&vm->stack);
+		vm->val = ((Cons *) as_ref(vm->val))->car;
 		break;
 
 	case CALL0:
+		vm->val = prim_(vm, fetch16(t))->prim0();
 		break;
 
 	case CALL1:
+		vm->val = prim_(vm, fetch16(t))->prim1(vm->val);
 		break;
 
 	case CALL2:
-		shift16(vm->code);
+		vm->arg1 = pop_v(&vm->stack);
+		vm->val = prim_(vm, fetch16(t))->prim2(vm->arg1, vm->val);
 		break;
 
 	case CALL3:
+		vm->arg2 = pop_v(&vm->stack);
+		vm->arg1 = pop_v(&vm->stack);
+		vm->val = prim_(vm, fetch16(t))->prim3(vm->arg1, vm->arg2, vm->val);
+		break;
+
+	case CAR:
+		i = fetch16(t);
+		if (is_cons(vm->val))
+			vm->val = ((Cons *) as_ref(vm->val))->car;
+		else
+			vm->val = prim_(vm, i)->prim1(vm->val);
+		break;
+
+	case CDR:
+		i = fetch16(t);
+		if (is_cons(vm->val))
+			vm->val = ((Cons *) as_ref(vm->val))->cdr;
+		else
+			vm->val = prim_(vm, i)->prim1(vm->val);
 		break;
 
 	case CHECKED_GLOBAL_REF:
+	case GLOBAL_REF:
+		vm->val = vm->globals[fetch16(t)];
+		if (!vm->val.ptr)
+			error("unbound global");
+		break;
+
+	case CMP:
+		j = fetch8(t);
+		i = fetch16(t);
+		vm->arg1 = pop_v(&vm->stack);
+		if (is_fixnum_(vm->arg1) && is_fixnum_(vm->val))
+			vm->val = mk_bool(j == CMP_LT ?
+					  as_fixnum(vm->arg1) < as_fixnum(vm->val) :
+					  as_fixnum(vm->arg1) == as_fixnum(vm->val));
+		else
+			vm->val = prim_(vm, i)->prim2(vm->arg1, vm->val);
 		break;
 
 	case CONSTANT:
-		vm->val = v_ref(vm->constants, shift16(vm->code));
+		vm->val = vm->constants[fetch16(t)];
+		break;
+
+	case CLOSURE_REF:
+		vm->val = vm->closed[fetch8(t)];
 		break;
 
 	case CREATE_CLOSURE:
-		i = shift8(vm->code);
-		j = shift16(vm->code);
-		c = mm_alloc(CLOSURE, sizeof(*c));
-		c->code.b = vm->code->b + i;
-		c->code.e = vm->code->b + j;
-		c->env = vm->env;
+		n = fetch8(t);
+		i = fetch16(t);
+		j = fetch16(t);
+		c = mm_alloc(CLOSURE, sizeof(*c) + n * sizeof(Value));
+		c->code.b = t->b - i;
+		c->code.e = c->code.b + j;
+		c->code.alloc_e = c->code.e;
+		c->nr = n;
+		while (n--)
+			c->values[n] = pop_v(&vm->stack);
 		vm->val = mk_ref(c);
 		break;
 
 	case DEEP_ARGUMENT_REF:
-		assert(vm->env);
-		i = shift8(vm->code);
-		j = shift8(vm->code);
-		f_deep_get(vm->env, i, j);
+		i = fetch8(t);
+		j = fetch8(t);
+		vm->val = f_deep_get(vm->env, i, j);
 		break;
 
 	case ENV_EXTEND:
@@ -292,28 +718,30 @@ static inline bool step(VM *vm)
 		break;
 
 	case FUN_INVOKE:
+		invoke_(vm, fetch16(t));
 		break;
 
-	case FUN_POP:
-		vm->fun = pop_v(&vm->stack);
+	case FUN_TAIL_INVOKE:
+		tail_invoke_(vm, fetch16(t));
 		break;
 
-	case GLOBAL_REF:
-		vm->val = v_ref(vm->globals, shift16(vm->code));
+	case FUN_POP:
+		vm->fun = pop_v(&vm->stack);
 		break;
 
 	case GOTO:
-		vm->code->b += shift16(vm->code);
+		i = fetch16(t);
+		t->b += i;
 		break;
 
 	case JUMP_FALSE:
-		ij = shift16(vm->code);
+		i = fetch16(t);
 		if (is_nil(vm->val))
-			vm->code->b += ij;
+			t->b += i;
 		break;
 
 	case PACK_ARG:
-		f_set(peek_p(&vm->stack), shift8(vm->code), vm->val);
+		f_set(peek_p(&vm->stack), fetch8(t), vm->val);
 		break;
 
 	case POP_ARG1:
@@ -352,51 +780,66 @@ static inline bool step(VM *vm)
 		break;
 
 	case RETURN:
-		// FIXME: pop pc from stack? env?
+		vm->closed = pop_p(&vm->stack);
+		vm->frames_top = pop_p(&vm->stack);
+		t->e = pop_p(&vm->stack);
+		t->b = pop_p(&vm->stack);
+		t->alloc_e = t->e;
 		break;
 
 	case DEEP_ARGUMENT_SET:
 		// FIXME: variant of this op that packs i, j into a single byte?
-		assert(vm->env);
-		i = shift8(vm->code);
-		j = shift8(vm->code);
+		i = fetch8(t);
+		j = fetch8(t);
 		f_deep_set(vm->env, i, j, vm->val);
 		break;
 
 	case GLOBAL_SET:
+		vm->globals[fetch16(t)] = vm->val;
 		break;
 
 	case SHALLOW_ARGUMENT_SET:
-		assert(vm->env);
-		f_set(vm->env, shift8(vm->code), vm->val);
+		f_set(vm->env, fetch8(t), vm->val);
 		break;
 
 	case SHALLOW_ARGUMENT_REF:
-		assert(vm->env);
-		vm->val = f_get(vm->env, shift8(vm->code));
+		vm->val = f_get(vm->env, fetch8(t));
 		break;
 
 	case ENV_UNLINK:
-		assert(vm->env);
-		vm->env = vm->env->next;
+		f = vm->env;
+		vm->env = f->next;
+		f_pop_stack(vm, f);
+		break;
+
+	case UNBOX:
+		vm->val = ((Cons *) as_ref(vm->val))->car;
 		break;
 
 	case VALUE_POP:
+		vm->val = pop_v(&vm->stack);
 		break;
 	}
 
 	return true;
 }
 
+// Runs until the end of the top level code is reached, closures always end
+// with a RETURN, so can't get there first.
 static void run(VM *vm)
 {
-	while (step(vm))
+	while (vm->code.b < vm->code.e && step(vm))
 		;
 }
 
+static const char *prim_name_(StaticEnv *r, unsigned index)
+{
+	return ((Primitive *) as_ref(v_ref(r->constants, index)))->name;
+}
+
 static bool dis_instr(Thunk *t, StaticEnv *r)
 {
-	unsigned i, j;
+	unsigned i, j, n;
 
 	if (t->b >= t->e)
 		return false;
@@ -404,12 +847,17 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 	printf("  ");
 
 	switch (shift_op(t)) {
-	case ALLOCATE_DOTTED_FRAME:
-		printf("allocate_dotted_frame %u", shift8(t));
+	case ADD_FIXNUM:
+		printf("add_fixnum %s", prim_name_(r, shift16(t)));
+		break;
+
+	case ADD_IMM:
+		i = (int8_t) shift8(t);
+		printf("add_imm %d %s", (int) i, prim_name_(r, shift16(t)));
 		break;
 
-	case ALLOCATE_FRAME:
-		printf("allocate_frame %u", shift8(t));
+	case ALLOCATE_STACK_FRAME:
+		printf("allocate_stack_frame %u", shift8(t));
 		break;
 
 	case ARITY_EQ:
@@ -417,47 +865,67 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 		break;
 
 	case ARITY_GEQ:
-		printf("arity_geq");
+		printf("arity_geq %u", shift8(t));
 		break;
 
-	case CALL0:
-		printf("call0");
+	case BOX_ARG:
+		printf("box_arg %u", shift8(t));
+		break;
+
+	case BOX_SET:
+		printf("box_set");
 		break;
 
+	case CALL0:
 	case CALL1:
-		printf("call1");
+	case CALL2:
+	case CALL3:
+		i = t->b[-1] - CALL0;
+		printf("call%u %s", i, prim_name_(r, shift16(t)));
 		break;
 
-	case CALL2: {
-		Primitive *p = as_ref(v_ref(r->constants, shift16(t)));
-		printf("call2 %s", p->name);
+	case CAR:
+		printf("car %s", prim_name_(r, shift16(t)));
 		break;
-	}
 
-	case CALL3:
-	     	printf("call3");
+	case CDR:
+		printf("cdr %s", prim_name_(r, shift16(t)));
 		break;
 
 	case CHECKED_GLOBAL_REF:
 		printf("checked_global_ref");
 		break;
 
+	case CMP:
+		i = shift8(t);
+		printf("cmp %s %s", i == CMP_LT ? "lt" : "eq", prim_name_(r, shift16(t)));
+		break;
+
 	case CONSTANT:
 		printf("constant %u", shift16(t));
 		break;
 
+	case CLOSURE_REF:
+		printf("closure_ref %u", shift8(t));
+		break;
+
 	case CREATE_CLOSURE:
-		i = shift8(t);
+		n = shift8(t);
+		i = shift16(t);
 		j = shift16(t);
-		printf("create_closure %u %u", i, j);
+		printf("create_closure %u %u %u", n, i, j);
 		break;
 
 	case DEEP_ARGUMENT_REF:
-		printf("deep_argument_ref");
+		i = shift8(t);
+		j = shift8(t);
+		printf("deep_argument_ref %u %u", i, j);
 		break;
 
 	case DEEP_ARGUMENT_SET:
-		printf("deep_argument_set");
+		i = shift8(t);
+		j = shift8(t);
+		printf("deep_argument_set %u %u", i, j);
 		break;
 
 	case ENV_EXTEND:
@@ -489,7 +957,7 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 		break;
 
 	case GLOBAL_SET:
-		printf("global_set");
+		printf("global_set %u", shift16(t));
 		break;
 
 	case GOTO:
@@ -497,11 +965,15 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 		break;
 
 	case FUN_INVOKE:
-		printf("invoke");
+		printf("invoke %u", shift16(t));
+		break;
+
+	case FUN_TAIL_INVOKE:
+		printf("tail_invoke %u", shift16(t));
 		break;
 
 	case JUMP_FALSE:
-		printf("jump_false");
+		printf("jump_false %u", shift16(t));
 		break;
 
 	case PACK_ARG:
@@ -549,7 +1021,11 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 		break;
 
 	case SHALLOW_ARGUMENT_SET:
-		printf("shallow_argument_set");
+		printf("shallow_argument_set %u", shift8(t));
+		break;
+
+	case UNBOX:
+		printf("unbox");
 		break;
 
 	case VALUE_POP:
@@ -565,105 +1041,613 @@ static bool dis_instr(Thunk *t, StaticEnv *r)
 	return true;
 }
 
-// Passing the static env in so we can add informative comments.
-static void disassemble(Thunk *t, StaticEnv *r)
+// Works on a copy, since cached thunks get run again.
+void disassemble(Thunk *t, StaticEnv *r)
 {
-	while (dis_instr(t, r))
+	Thunk tmp = *t;
+
+	while (dis_instr(&tmp, r))
 		;
 }
 
 //----------------------------------------------------------------
-// Intermediate instructions
-
-static inline void op(Thunk *t, ByteOp o)
-{
-	t_append(t, (uint8_t) o);
-}
+// Verifier
+//
+// The verifier follows every path through a thunk, tracking the shape of
+// the value stack, the environment, and what's in vm->val.  So it can
+// prove operands are in range, jumps land on instructions, the stack never
+// underflows and frame indexes are in bounds, which the interpreter then
+// doesn't check.  Jumps only go forwards, so a single pass suffices.
+// Closure bodies are verified as the closures that run them are created.
 
-static inline void op8(Thunk *t, ByteOp o, unsigned v)
-{
-	op(t, o);
-	assert(v < 256);
-	t_append(t, (uint8_t) v);
-}
+typedef enum {
+	VK_VALUE,
+	VK_FRAME,	// n slots
+	VK_ARGS,	// a closure's arguments, before its arity check
+	VK_ENV,		// a saved environment, n is its node
+} VKind;
 
-static inline void op8_8(Thunk *t, ByteOp o, unsigned i, unsigned j)
-{
-	op(t, o);
-	assert(i < 256);
-	t_append(t, (uint8_t) i);
-	assert(j < 256);
-	t_append(t, (uint8_t) j);
-}
+// Stacks and environments are lists of these, so states are cheap to copy.
+typedef struct {
+	int parent;
+	VKind kind;
+	int n;
+} VNode;
 
-static inline void op8_16(Thunk *t, ByteOp o, unsigned i, unsigned j)
-{
-	op(t, o);
-	assert(i < 256);
-	t_append(t, (uint8_t) i);
-	assert(j < 256 * 256);
-	t_append(t, (uint8_t) j >> 8);
-	t_append(t, (uint8_t) j & 0xff);
-}
+#define V_EMPTY -1
+#define V_UNKNOWN -2	// an environment left by a call
 
-static inline void op16(Thunk *t, ByteOp o, unsigned v)
-{
-	op(t, o);
-	assert(v < 256 * 256);
-	t_append(t, (uint8_t) v >> 8);
-	t_append(t, (uint8_t) v & 0xff);
-}
+typedef struct {
+	bool live;
+	int stack;
+	unsigned depth;
+	int env;
+	VKind val;
+	int val_n;
+} VState;
 
-static Thunk *i_shallow_argument_ref(unsigned i)
-{
-	Thunk *t = t_new(2);
-	op8(t, SHALLOW_ARGUMENT_REF, i);
-	return t;
-}
+typedef struct {
+	StaticEnv *r;
+	unsigned nr_constants, nr_globals, nr_sites;
 
-static Thunk *i_shallow_argument_set(unsigned i, Thunk *val)
-{
-	Thunk *t = t_new(t_size(val) + 2);
-	t_merge(t, val);
-	op8(t, SHALLOW_ARGUMENT_SET, i);
-	return t;
-}
+	VNode *nodes;
+	unsigned nr_nodes, nodes_size;
+} Verifier;
 
-static Thunk *i_deep_argument_ref(unsigned i, unsigned j)
+// The number of operand bytes, or -1 if o isn't something the compiler
+// emits.
+static int op_len_(unsigned o)
 {
-	Thunk *t = t_new(3);
-	op8_8(t, DEEP_ARGUMENT_REF, i, j);
-	return t;
-}
+	switch (o) {
+	case BOX_SET:
+	case ENV_EXTEND:
+	case ENV_PRESERVE:
+	case ENV_RESTORE:
+	case ENV_UNLINK:
+	case FUN_POP:
+	case RETURN:
+	case UNBOX:
+	case VALUE_POP:
+	case VALUE_PUSH:
+		return 0;
 
-static Thunk *i_deep_argument_set(unsigned i, unsigned j, Thunk *val)
+	case ALLOCATE_STACK_FRAME:
+	case ARITY_EQ:
+	case ARITY_GEQ:
+	case BOX_ARG:
+	case CLOSURE_REF:
+	case PACK_ARG:
+	case SHALLOW_ARGUMENT_REF:
+	case SHALLOW_ARGUMENT_SET:
+		return 1;
+
+	case ADD_FIXNUM:
+	case CALL0:
+	case CALL1:
+	case CALL2:
+	case CALL3:
+	case CAR:
+	case CDR:
+	case CONSTANT:
+	case DEEP_ARGUMENT_REF:
+	case DEEP_ARGUMENT_SET:
+	case FUN_INVOKE:
+	case FUN_TAIL_INVOKE:
+	case GLOBAL_REF:
+	case GLOBAL_SET:
+	case GOTO:
+	case JUMP_FALSE:
+		return 2;
+
+	case ADD_IMM:
+	case CMP:
+		return 3;
+
+	case CREATE_CLOSURE:
+		return 5;
+
+	default:
+		return -1;
+	}
+}
+
+static inline unsigned u16_(unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static int v_node_(Verifier *v, int parent, VKind kind, int n)
+{
+	if (v->nr_nodes == v->nodes_size) {
+		v->nodes_size = v->nodes_size ? v->nodes_size * 2 : 64;
+		v->nodes = realloc(v->nodes, v->nodes_size * sizeof(*v->nodes));
+		if (!v->nodes)
+			error("out of memory");
+	}
+
+	v->nodes[v->nr_nodes].parent = parent;
+	v->nodes[v->nr_nodes].kind = kind;
+	v->nodes[v->nr_nodes].n = n;
+	return v->nr_nodes++;
+}
+
+static bool v_same_(Verifier *v, int lhs, int rhs)
+{
+	while (lhs != rhs) {
+		VNode *l, *r;
+
+		if (lhs < 0 || rhs < 0)
+			return false;
+
+		l = v->nodes + lhs;
+		r = v->nodes + rhs;
+		if (l->kind != r->kind ||
+		    (l->kind == VK_ENV ? !v_same_(v, l->n, r->n) : l->n != r->n))
+			return false;
+
+		lhs = l->parent;
+		rhs = r->parent;
+	}
+
+	return true;
+}
+
+// Where paths join the stacks have to agree, anything else that differs
+// is forgotten.
+static bool v_merge_(Verifier *v, VState *into, VState *s)
+{
+	if (!into->live) {
+		*into = *s;
+		return true;
+	}
+
+	if (into->depth != s->depth || !v_same_(v, into->stack, s->stack))
+		return false;
+
+	if (!v_same_(v, into->env, s->env))
+		into->env = V_UNKNOWN;
+
+	if (into->val != s->val || into->val_n != s->val_n) {
+		into->val = VK_VALUE;
+		into->val_n = 0;
+	}
+
+	return true;
+}
+
+static void v_push_(Verifier *v, VState *s, VKind kind, int n)
+{
+	s->stack = v_node_(v, s->stack, kind, n);
+	s->depth++;
+}
+
+static bool v_pop_(Verifier *v, VState *s, VKind *kind, int *n)
+{
+	VNode *node;
+
+	if (!s->depth)
+		return false;
+
+	node = v->nodes + s->stack;
+	*kind = node->kind;
+	*n = node->n;
+	s->stack = node->parent;
+	s->depth--;
+	return true;
+}
+
+static bool v_pop_value_(Verifier *v, VState *s)
+{
+	VKind kind;
+	int n;
+
+	return v_pop_(v, s, &kind, &n) && kind == VK_VALUE;
+}
+
+static void v_set_val_(VState *s, VKind kind, int n)
+{
+	s->val = kind;
+	s->val_n = n;
+}
+
+// The size of the frame depth frames into the environment, or -1.
+static int v_env_frame_(Verifier *v, VState *s, unsigned depth)
+{
+	int env = s->env;
+
+	while (env >= 0 && depth--)
+		env = v->nodes[env].parent;
+
+	return env >= 0 ? v->nodes[env].n : -1;
+}
+
+static bool v_prim_(Verifier *v, unsigned index, unsigned argc)
+{
+	Value p;
+
+	if (index >= v->nr_constants)
+		return false;
+
+	p = v_ref(v->r->constants, index);
+	return get_type(p) == PRIMITIVE && ((Primitive *) as_ref(p))->argc == argc;
+}
+
+static bool v_unit_(Verifier *v, unsigned char *b, unsigned char *e, int nr_closed);
+
+// Checks one instruction, updating s.  at holds the states at the jump
+// targets of the unit starting at b.
+static bool v_instr_(Verifier *v, VState *s, VState *at, unsigned char *b,
+		     unsigned char *e, unsigned char *pc, unsigned char *next,
+		     int nr_closed)
+{
+	unsigned char *operands = pc + 1, *start;
+	unsigned i, j, n;
+	VKind kind;
+	int size;
+
+	switch (*pc) {
+	case ADD_FIXNUM:
+		if (!v_prim_(v, u16_(operands), 2) || s->val != VK_VALUE ||
+		    !v_pop_value_(v, s))
+			return false;
+		break;
+
+	case ADD_IMM:
+		if (!v_prim_(v, u16_(operands + 1), 2) || s->val != VK_VALUE)
+			return false;
+		break;
+
+	case ALLOCATE_STACK_FRAME:
+		v_set_val_(s, VK_FRAME, operands[0]);
+		break;
+
+	case ARITY_EQ:
+		if (s->val != VK_ARGS && s->val != VK_FRAME)
+			return false;
+		v_set_val_(s, VK_FRAME, operands[0]);
+		break;
+
+	case ARITY_GEQ:
+		if ((s->val != VK_ARGS && s->val != VK_FRAME) || !operands[0])
+			return false;
+		v_set_val_(s, VK_FRAME, operands[0]);
+		break;
+
+	case BOX_ARG:
+		if (operands[0] >= v_env_frame_(v, s, 0))
+			return false;
+		break;
+
+	case BOX_SET:
+		if (s->val != VK_VALUE || !v_pop_value_(v, s))
+			return false;
+		break;
+
+	case CALL0:
+	case CALL1:
+	case CALL2:
+	case CALL3:
+		n = *pc - CALL0;
+		if (!v_prim_(v, u16_(operands), n) || (n && s->val != VK_VALUE))
+			return false;
+		for (i = 1; i < n; i++)
+			if (!v_pop_value_(v, s))
+				return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case CAR:
+	case CDR:
+		if (!v_prim_(v, u16_(operands), 1) || s->val != VK_VALUE)
+			return false;
+		break;
+
+	case CLOSURE_REF:
+		if ((int) operands[0] >= nr_closed)
+			return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case CMP:
+		if (operands[0] > CMP_EQ || !v_prim_(v, u16_(operands + 1), 2) ||
+		    s->val != VK_VALUE || !v_pop_value_(v, s))
+			return false;
+		break;
+
+	case CONSTANT:
+		if (u16_(operands) >= v->nr_constants)
+			return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case CREATE_CLOSURE:
+		// The body has to come before the instruction.
+		n = operands[0];
+		i = u16_(operands + 1);
+		j = u16_(operands + 3);
+		if (i > next - b)
+			return false;
+
+		start = next - i;
+		if (start >= pc || !j || j > pc - start ||
+		    !v_unit_(v, start, start + j, n))
+			return false;
+		while (n--)
+			if (!v_pop_value_(v, s))
+				return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case DEEP_ARGUMENT_REF:
+	case DEEP_ARGUMENT_SET:
+		if (operands[1] >= v_env_frame_(v, s, operands[0]))
+			return false;
+		if (*pc == DEEP_ARGUMENT_SET && s->val != VK_VALUE)
+			return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case ENV_EXTEND:
+		if (s->val != VK_FRAME)
+			return false;
+		s->env = v_node_(v, s->env, VK_FRAME, s->val_n);
+		break;
+
+	case ENV_PRESERVE:
+		v_push_(v, s, VK_ENV, s->env);
+		break;
+
+	case ENV_RESTORE:
+		if (!v_pop_(v, s, &kind, &size) || kind != VK_ENV)
+			return false;
+		s->env = size;
+		break;
+
+	case ENV_UNLINK:
+		if (s->env < 0)
+			return false;
+		s->env = v->nodes[s->env].parent;
+		break;
+
+	case FUN_INVOKE:
+	case FUN_TAIL_INVOKE:
+		if (u16_(operands) >= v->nr_sites || s->val != VK_FRAME)
+			return false;
+
+		// A tail call replaces the return on top of the stack.
+		if (*pc == FUN_TAIL_INVOKE && nr_closed >= 0 && s->depth)
+			return false;
+
+		s->env = V_UNKNOWN;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case FUN_POP:
+		if (!v_pop_value_(v, s))
+			return false;
+		break;
+
+	case GLOBAL_REF:
+	case GLOBAL_SET:
+		if (u16_(operands) >= v->nr_globals ||
+		    (*pc == GLOBAL_SET && s->val != VK_VALUE))
+			return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case GOTO:
+	case JUMP_FALSE:
+		i = u16_(operands);
+		if (i > e - next || !v_merge_(v, at + (next - b) + i, s))
+			return false;
+		if (*pc == GOTO)
+			s->live = false;
+		break;
+
+	case PACK_ARG:
+		if (!s->depth || s->val != VK_VALUE)
+			return false;
+		if (v->nodes[s->stack].kind != VK_FRAME ||
+		    operands[0] >= v->nodes[s->stack].n)
+			return false;
+		break;
+
+	case RETURN:
+		if (nr_closed < 0 || s->depth || s->val != VK_VALUE)
+			return false;
+		s->live = false;
+		break;
+
+	case SHALLOW_ARGUMENT_REF:
+	case SHALLOW_ARGUMENT_SET:
+		if (operands[0] >= v_env_frame_(v, s, 0))
+			return false;
+		if (*pc == SHALLOW_ARGUMENT_SET && s->val != VK_VALUE)
+			return false;
+		v_set_val_(s, VK_VALUE, 0);
+		break;
+
+	case UNBOX:
+		if (s->val != VK_VALUE)
+			return false;
+		break;
+
+	case VALUE_POP:
+		if (!v_pop_(v, s, &kind, &size) || kind == VK_ENV)
+			return false;
+		v_set_val_(s, kind, size);
+		break;
+
+	case VALUE_PUSH:
+		if (s->val == VK_ARGS)
+			return false;
+		v_push_(v, s, s->val, s->val_n);
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+// nr_closed is the number of values the closure captured, or -1 for top
+// level code, which has no closure and may run off the end.
+static bool v_unit_(Verifier *v, unsigned char *b, unsigned char *e, int nr_closed)
+{
+	size_t len = e - b, off, k;
+	unsigned char *pc, *next;
+	VState s, *at;
+	int op_len;
+	bool r = false;
+
+	// One more than the length, for jumps to the end.
+	at = calloc(len + 1, sizeof(*at));
+	if (!at)
+		error("out of memory");
+
+	memset(&s, 0, sizeof(s));
+	s.live = true;
+	s.stack = V_EMPTY;
+	s.env = V_EMPTY;
+	s.val = nr_closed < 0 ? VK_VALUE : VK_ARGS;
+
+	for (pc = b; pc < e; pc = next) {
+		off = pc - b;
+		if (at[off].live && !v_merge_(v, &s, at + off))
+			goto out;
+
+		// Skip code nothing reaches, ie. closure bodies.
+		if (!s.live) {
+			next = pc + 1;
+			continue;
+		}
+
+		op_len = op_len_(*pc);
+		if (op_len < 0 || op_len >= e - pc)
+			goto out;
+
+		next = pc + 1 + op_len;
+		for (k = off + 1; k < off + 1 + op_len; k++)
+			if (at[k].live)
+				goto out;
+
+		if (!v_instr_(v, &s, at, b, e, pc, next, nr_closed))
+			goto out;
+	}
+
+	r = nr_closed < 0 || (!s.live && !at[len].live);
+
+out:
+	free(at);
+	return r;
+}
+
+bool verify_thunk(StaticEnv *r, Thunk *t)
+{
+	Verifier v;
+	bool ok;
+
+	memset(&v, 0, sizeof(v));
+	v.r = r;
+	v.nr_constants = v_size(r->constants);
+	v.nr_globals = ht_size(r->globals_r);
+	v.nr_sites = r->nr_call_sites < MAX_CALL_SITES ? r->nr_call_sites : MAX_CALL_SITES;
+
+	ok = v_unit_(&v, t->b, t->e, -1);
+	free(v.nodes);
+	return ok;
+}
+
+//----------------------------------------------------------------
+// Intermediate instructions
+//
+// These append to t.  Instructions that take a value expect the code that
+// computes it to have been emitted already.
+
+static inline void op(Thunk *t, ByteOp o)
+{
+	t_append(t, (uint8_t) o);
+}
+
+static inline void op8(Thunk *t, ByteOp o, unsigned v)
+{
+	op(t, o);
+	assert(v < 256);
+	t_append(t, (uint8_t) v);
+}
+
+static inline void op8_8(Thunk *t, ByteOp o, unsigned i, unsigned j)
+{
+	op(t, o);
+	assert(i < 256);
+	t_append(t, (uint8_t) i);
+	assert(j < 256);
+	t_append(t, (uint8_t) j);
+}
+
+static inline void op8_16(Thunk *t, ByteOp o, unsigned i, unsigned j)
+{
+	op(t, o);
+	assert(i < 256);
+	t_append(t, (uint8_t) i);
+	assert(j < 256 * 256);
+	t_append(t, (uint8_t) (j >> 8));
+	t_append(t, (uint8_t) (j & 0xff));
+}
+
+static inline void op16(Thunk *t, ByteOp o, unsigned v)
+{
+	op(t, o);
+	assert(v < 256 * 256);
+	t_append(t, (uint8_t) (v >> 8));
+	t_append(t, (uint8_t) (v & 0xff));
+}
+
+// Returns the offset of the operand, for t_patch_here().
+static size_t op_fwd16(Thunk *t, ByteOp o)
+{
+	op16(t, o, 0);
+	return t_size(t) - 2;
+}
+
+static void i_shallow_argument_ref(Thunk *t, unsigned i)
+{
+	op8(t, SHALLOW_ARGUMENT_REF, i);
+}
+
+static void i_shallow_argument_set(Thunk *t, unsigned i)
+{
+	op8(t, SHALLOW_ARGUMENT_SET, i);
+}
+
+static void i_deep_argument_ref(Thunk *t, unsigned i, unsigned j)
+{
+	op8_8(t, DEEP_ARGUMENT_REF, i, j);
+}
+
+static void i_deep_argument_set(Thunk *t, unsigned i, unsigned j)
 {
-	Thunk *t = t_new(t_size(val) + 3);
-	t_merge(t, val);
 	op8_8(t, DEEP_ARGUMENT_SET, i, j);
-	return t;
 }
 
-static Thunk *i_checked_global_ref(unsigned i)
+static void i_closure_ref(Thunk *t, unsigned i)
+{
+	op8(t, CLOSURE_REF, i);
+}
+
+static void i_checked_global_ref(Thunk *t, unsigned i)
 {
-	Thunk *t = t_new(3);
 	op16(t, GLOBAL_REF, i);
-	return t;
 }
 
-static Thunk *i_global_set(unsigned i, Thunk *val)
+static void i_global_set(Thunk *t, unsigned i)
 {
-	Thunk *t = t_new(t_size(val) + 3);
-	t_merge(t, val);
 	op16(t, GLOBAL_SET, i);
-	return t;
 }
 
-static Thunk *i_primitive(unsigned i, unsigned argc, Thunk *args)
+static void i_primitive(Thunk *t, unsigned i, unsigned argc)
 {
-	Thunk *t = t_new(t_size(args) + 3);
-	t_merge(t, args);
-
 	switch (argc) {
 	case 0:
 		op16(t, CALL0, i);
@@ -684,222 +1668,350 @@ static Thunk *i_primitive(unsigned i, unsigned argc, Thunk *args)
 	default:
 		error("primitives must have <= 3 args\n");
 	}
-
-	return t;
 }
 
-static Thunk *i_constant(unsigned i)
+static void i_constant(Thunk *t, unsigned i)
 {
-	Thunk *t = t_new(3);
 	op16(t, CONSTANT, i);
-	return t;
 }
 
-static Thunk *i_alternative(Thunk *t1, Thunk *t2, Thunk *t3)
+// The closure's code is jumped over, and followed by the code that pushes
+// the values it captures, which aren't known until the body has been
+// compiled.  CREATE_CLOSURE's operands are the number of captured values,
+// the distance back to the code and its length.  Returns the offset of the
+// code, to pass to i_closure_end() once the body has been emitted.
+static size_t i_closure_begin(Thunk *t)
 {
-	Thunk *t = t_new(t_size(t1) + t_size(t2) + t_size(t3) + 20);
-	t_merge(t, t1);
-	op16(t, JUMP_FALSE, t_size(t2) + 1);
-	t_merge(t, t2);
-	op16(t, GOTO, t_size(t3));
-	t_merge(t, t3);
-	return t;
+	op_fwd16(t, GOTO);
+	return t_size(t);
 }
 
-static Thunk *i_sequence(Thunk *t1, Thunk *t2)
-{
-	Thunk *t = t_new(t_size(t1) + t_size(t2));
-	t_merge(t, t1);
-	t_merge(t, t2);
-	return t;
-}
+static void i_load(Thunk *t, Kind k);
 
-static Thunk *i_fix_closure(Thunk *body, unsigned arity)
+// captured is the list of names the body captured, r the environment the
+// lambda is in.
+static void i_closure_end(Thunk *t, size_t b, Value captured, StaticEnv *r)
 {
-	Thunk *t, *fn;
+	size_t e;
+	unsigned n = 0;
+	Kind k;
+
+	op(t, RETURN);
+	e = t_size(t);
+	t_patch_here(t, b - 2);
+
+	for (; is_cons(captured); captured = cdr(captured), n++) {
+		r_lookup_local(r, as_ref(car(captured)), &k);
+		i_load(t, k);
+		op(t, VALUE_PUSH);
+	}
 
-	fn = t_new(t_size(body) + 20);
-	op8(fn, ARITY_EQ, arity);
-	t_merge(fn, body);
-	op(fn, RETURN);
+	if (n >= 256)
+		error("too many captured variables");
 
-	t = t_new(t_size(fn) + 10);
-	op8_16(t, CREATE_CLOSURE, 1, t_size(fn));
-	op16(t, GOTO, t_size(fn));
-	t_merge(t, fn);
-	return t;
+	op8(t, CREATE_CLOSURE, n);
+	t_append(t, 0);
+	t_append(t, 0);
+	t_append(t, 0);
+	t_append(t, 0);
+	t_patch16(t, t_size(t) - 4, t_size(t) - b);
+	t_patch16(t, t_size(t) - 2, e - b);
 }
 
-static Thunk *i_nary_closure(Thunk *body, unsigned arity)
+static void i_regular_call_begin(Thunk *t)
 {
-	Thunk *t, *fn;
-
-	fn = t_new(t_size(body) + 20);
-	op8(fn, ARITY_GEQ, arity + 1);
-	op(fn, ENV_EXTEND);
-	t_merge(fn, body);
-	op(fn, RETURN);
-
-	t = t_new(t_size(fn) + 10);
-	op8(t, CREATE_CLOSURE, 1);
-	op16(t, GOTO, t_size(fn));
-	t_merge(t, fn);
-	return t;
+	op(t, VALUE_PUSH); // fn is in vm->val
 }
 
-static Thunk *i_regular_call(Thunk *fn, Thunk *args)
+static void i_regular_call_end(Thunk *t, unsigned site)
 {
-	Thunk *t = t_new(t_size(fn) + t_size(args) + 20);
-	t_merge(t, fn); // leaves fn in vm->val, where fn is a closure
-	op(t, VALUE_PUSH);
-	t_merge(t, args);
 	op(t, FUN_POP);
 	op(t, ENV_PRESERVE);
-	op(t, FUN_INVOKE);
+	op16(t, FUN_INVOKE, site);
 	op(t, ENV_RESTORE);
-	return t;
 }
 
-static Thunk *i_tr_regular_call(Thunk *fn, Thunk *args)
+static void i_tr_regular_call_end(Thunk *t, unsigned site)
 {
-	Thunk *t = t_new(t_size(fn) + t_size(args) + 20);
-	t_merge(t, fn);
-	op(t, VALUE_PUSH);
-	t_merge(t, args);
 	op(t, FUN_POP);
-	op(t, FUN_INVOKE);
-	return t;
+	op16(t, FUN_TAIL_INVOKE, site);
 }
 
-static Thunk *i_pack_args(unsigned argc, Thunk **args)
-{
-	Thunk *t;
-	unsigned i, tot = 0;
+//----------------------------------------------------------------
+// Special forms
 
-	for (i = 0; i < argc; i++)
-		tot += t_size(args[i]);
+// Symbols are interned, so the special forms are recognised by pointer.
+static Value sym_quote_, sym_lambda_, sym_if_, sym_begin_, sym_set_;
 
-	t = t_new(tot + argc * 2 + 3);
-	op8(t, ALLOCATE_FRAME, argc);
-	op(t, VALUE_PUSH);
-	for (i = 0; i < argc; i++) {
-		t_merge(t, args[i]);
-		op8(t, PACK_ARG, i);
+static void def_special_form_(Value *v, const char *name)
+{
+	*v = mk_ref(mk_symbol_cstr(name));
+	mm_add_root(v);
+}
+
+static void init_special_forms_()
+{
+	static bool initialised = false;
+
+	if (!initialised) {
+		def_special_form_(&sym_quote_, "quote");
+		def_special_form_(&sym_lambda_, "lambda");
+		def_special_form_(&sym_if_, "if");
+		def_special_form_(&sym_begin_, "begin");
+		def_special_form_(&sym_set_, "set!");
+		initialised = true;
 	}
-	op(t, VALUE_POP);
+}
 
-	return t;
+static inline bool is_sym(Value v, Value sym)
+{
+	return v.ptr == sym.ptr;
 }
 
 //----------------------------------------------------------------
 // Compilation
 
-Thunk *compile(Value e, StaticEnv *r, bool tail);
+static void compile(Thunk *t, Value e, StaticEnv *r, bool tail);
 
-
-static Thunk *c_quotation(Value v, StaticEnv *r, bool tail)
+static void c_quotation(Thunk *t, Value v, StaticEnv *r, bool tail)
 {
-	return i_constant(r_add_constant(r, v));
+	i_constant(t, r_add_constant(r, v));
 }
 
-static Thunk *c_reference(Value n, StaticEnv *r, bool tail)
+// Loads a local or closed variable, without unboxing it.
+static void i_load(Thunk *t, Kind k)
 {
-	Kind k = compute_kind(r, as_ref(n));
 	switch (k.t) {
 	case KindLocal:
 		if (k.i == 0)
-			return i_shallow_argument_ref(k.j);
+			i_shallow_argument_ref(t, k.j);
 		else
-			return i_deep_argument_ref(k.i, k.j);
+			i_deep_argument_ref(t, k.i, k.j);
+		break;
+
+	case KindClosed:
+		i_closure_ref(t, k.i);
+		break;
+
+	default:
+		assert(false);
+	}
+}
+
+static void c_reference(Thunk *t, Value n, StaticEnv *r, bool tail)
+{
+	Kind k = compute_kind(r, as_ref(n));
+	switch (k.t) {
+	case KindLocal:
+	case KindClosed:
+		i_load(t, k);
+		if (k.boxed)
+			op(t, UNBOX);
+		break;
 
 	case KindGlobal:
-		return i_checked_global_ref(k.i);
+		i_checked_global_ref(t, k.i);
+		break;
 
 	case KindConstant:
-		return i_constant(k.i);
+		i_constant(t, k.i);
+		break;
 	}
-
-	return NULL;
 }
 
-static Thunk *c_assignment(String *n, Value e, StaticEnv *r, bool tail)
+static void c_assignment(Thunk *t, String *n, Value e, StaticEnv *r, bool tail)
 {
-	Thunk *t = compile(e, r, false);
-	Kind k = compute_kind(r, n);
+	Kind k;
+
+	if (r_lookup_local(r, n, &k) && k.boxed) {
+		compile(t, e, r, false);
+		op(t, VALUE_PUSH);
+		i_load(t, k);
+		op(t, BOX_SET);
+		return;
+	}
 
+	compile(t, e, r, false);
+	k = compute_kind(r, n);
 	switch (k.t) {
 	case KindLocal:
 		if (k.i == 0)
-			return i_shallow_argument_set(k.j, t);
+			i_shallow_argument_set(t, k.j);
 		else
-			return i_deep_argument_set(k.i, k.j, t);
+			i_deep_argument_set(t, k.i, k.j);
+		break;
+
+	case KindClosed:
+		error("captured variable isn't boxed");
+		break;
 
 	case KindGlobal:
-		return i_global_set(k.i, t);
+		i_global_set(t, k.i);
+		break;
 
 	case KindConstant:
 		error("Predefined variables are immutable.");
 	}
+}
 
-	return NULL;
+static void c_alternative(Thunk *t, Value e1, Value e2, Value e3,
+			  StaticEnv *r, bool tail)
+{
+	size_t to_else, to_end;
+
+	compile(t, e1, r, false);
+	to_else = op_fwd16(t, JUMP_FALSE);
+	compile(t, e2, r, tail);
+	to_end = op_fwd16(t, GOTO);
+	t_patch_here(t, to_else);
+	compile(t, e3, r, tail);
+	t_patch_here(t, to_end);
 }
 
-static Thunk *c_alternative(Value e1, Value e2, Value e3, StaticEnv *r, bool tail)
+static void c_sequence(Thunk *t, Value es, StaticEnv *r, bool tail)
 {
-	Thunk *t1 = compile(e1, r, false);
-	Thunk *t2 = compile(e2, r, tail);
-	Thunk *t3 = compile(e3, r, tail);
+	if (!is_cons(es))
+		error("bad sequence");
+
+	while (is_cons(cdr(es))) {
+		compile(t, car(es), r, false);
+		es = cdr(es);
+	}
 
-	return i_alternative(t1, t2, t3);
+	compile(t, car(es), r, tail);
 }
 
-static Thunk *c_sequence(Value es, StaticEnv *r, bool tail);
-static Thunk *c_multiple_seq(Value e, Value es, StaticEnv *r, bool tail)
+//----------------------------------------------------------------
+// Closure conversion
+//
+// A lambda captures the outer locals it uses, directly or through lambdas
+// within it, as it's created.  Variables that are assigned, and that a
+// closure might capture, are boxed when they're bound.  Lambdas that are
+// applied immediately don't create closures, but their bodies may.
+
+static bool memq_(Value sym, Value xs)
 {
-	Thunk *t1 = compile(e, r, false);
-	Thunk *t2 = c_sequence(es, r, tail);
+	for (; is_cons(xs); xs = cdr(xs))
+		if (car(xs).ptr == sym.ptr)
+			return true;
 
-	return i_sequence(t1, t2);
+	return false;
 }
 
-static Thunk *c_sequence(Value es, StaticEnv *r, bool tail)
+static bool list_captures_(Value es);
+
+static bool captures_(Value e)
 {
-	if (is_cons(es)) {
-		if (is_cons(cdr(es)))
-			return c_multiple_seq(car(es), cdr(es), r, tail);
-		else
-			return compile(car(es), r, tail);
+	Value s;
+
+	if (!is_cons(e))
+		return false;
+
+	s = car(e);
+	if (is_sym(s, sym_quote_))
+		return false;
+
+	if (is_sym(s, sym_lambda_))
+		return true;
+
+	if (is_cons(s) && is_sym(car(s), sym_lambda_) && is_cons(cdr(s)))
+		return list_captures_(cddr(s)) || list_captures_(cdr(e));
+
+	return list_captures_(e);
+}
+
+static bool list_captures_(Value es)
+{
+	while (is_cons(es)) {
+		if (captures_(car(es)))
+			return true;
+		es = cdr(es);
 	}
 
-	error("bad sequence");
-	return NULL;
+	return false;
 }
 
-static Thunk *c_fix_abstraction(Value ns, Value es, StaticEnv *r, bool tail)
+// Names that are assigned anywhere in e.
+static void assigned_(Value e, ListBuilder *lb)
 {
-	Thunk *t;
-	unsigned arity = list_len(ns);
+	if (!is_cons(e) || is_sym(car(e), sym_quote_))
+		return;
 
-	r_push_frame(r, ns);
-	t = c_sequence(es, r, true);
-	r_pop_frame(r);
+	if (is_sym(car(e), sym_set_) && is_cons(cdr(e)) && !memq_(cadr(e), lb_get(lb)))
+		lb_append(lb, cadr(e));
 
-	return i_fix_closure(t, arity);
+	for (; is_cons(e); e = cdr(e))
+		assigned_(car(e), lb);
 }
 
-static Thunk *c_dotted_abstraction(Value ns, Value es, StaticEnv *r, bool tail)
+// The parameters in ns that need boxing.  Any parameter assigned somewhere
+// in the top level form is, if the body creates a closure.  This may box
+// a variable unnecessarily, but never misses one.
+static Value boxed_params_(Value ns, Value es, StaticEnv *r)
 {
-	Thunk *t;
-	unsigned arity = list_len(ns) - 1; // extra param is already on here
+	ListBuilder lb;
+	Value vs;
+
+	lb_init(&lb);
+	for (vs = ns; is_cons(vs); vs = cdr(vs))
+		if (memq_(car(vs), r->assigned_r))
+			break;
+
+	if (!is_cons(vs) || !list_captures_(es))
+		return mk_nil();
+
+	for (; is_cons(ns); ns = cdr(ns))
+		if (memq_(car(ns), r->assigned_r))
+			lb_append(&lb, car(ns));
+
+	return lb_get(&lb);
+}
+
+static void i_box_args(Thunk *t, Value ns, Value boxed)
+{
+	unsigned i;
+
+	for (i = 0; is_cons(ns); i++, ns = cdr(ns))
+		if (memq_(car(ns), boxed))
+			op8(t, BOX_ARG, i);
+}
+
+//----------------------------------------------------------------
+
+// The body runs in a scope of its own, so only its frames and captured
+// values are visible.
+static void c_closure_body(Thunk *t, size_t b, Value ns, Value es, StaticEnv *r)
+{
+	Value boxed = boxed_params_(ns, es, r);
 
-	r_push_frame(r, ns);
-	t = c_sequence(es, r, tail);
+	op(t, ENV_EXTEND);
+	i_box_args(t, ns, boxed);
+	r_push_scope(r);
+	r_push_frame(r, ns, boxed);
+	c_sequence(t, es, r, true);
 	r_pop_frame(r);
+	i_closure_end(t, b, r_pop_scope(r), r);
+}
+
+static void c_fix_abstraction(Thunk *t, Value ns, Value es, StaticEnv *r, bool tail)
+{
+	unsigned arity = list_len(ns);
+	size_t b = i_closure_begin(t);
+
+	op8(t, ARITY_EQ, arity);
+	c_closure_body(t, b, ns, es, r);
+}
+
+static void c_dotted_abstraction(Thunk *t, Value ns, Value es, StaticEnv *r, bool tail)
+{
+	unsigned arity = list_len(ns) - 1; // extra param is already on here
+	size_t b = i_closure_begin(t);
 
-	return i_nary_closure(t, arity);
+	op8(t, ARITY_GEQ, arity + 1);
+	c_closure_body(t, b, ns, es, r);
 }
 
-static Thunk *c_abstraction(Value ns, Value es, StaticEnv *r, bool tail)
+static void c_abstraction(Thunk *t, Value ns, Value es, StaticEnv *r, bool tail)
 {
 	ListBuilder lb;
 	lb_init(&lb);
@@ -910,122 +2022,330 @@ static Thunk *c_abstraction(Value ns, Value es, StaticEnv *r, bool tail)
 	}
 
 	if (is_nil(ns))
-		return c_fix_abstraction(lb_get(&lb), es, r, tail);
+		c_fix_abstraction(t, lb_get(&lb), es, r, tail);
 
 	else {
 		lb_append(&lb, ns);
-		return c_dotted_abstraction(lb_get(&lb), es, r, tail);
+		c_dotted_abstraction(t, lb_get(&lb), es, r, tail);
 	}
 }
 
-static Thunk *c_args(Value es, StaticEnv *r, bool tail)
+// Frames are never captured, so always go on the frame stack.
+static void c_args(Thunk *t, Value es, StaticEnv *r, bool tail)
 {
 	unsigned i, argc = list_len(es);
-	Thunk *args[argc]; // Variable length arrays are in c99
 
+	op8(t, ALLOCATE_STACK_FRAME, argc);
+	op(t, VALUE_PUSH);
 	for (i = 0; i < argc; i++) {
-		args[i] = compile(car(es), r, false);
+		compile(t, car(es), r, false);
+		op8(t, PACK_ARG, i);
 		es = cdr(es);
 	}
-
-	return i_pack_args(argc, args);
+	op(t, VALUE_POP);
 }
 
-static Thunk *c_regular_application(Value e, Value es, StaticEnv *r, bool tail)
+static void c_regular_application(Thunk *t, Value e, Value es, StaticEnv *r, bool tail)
 {
-	Thunk *fn = compile(e, r, false);
-	Thunk *args = c_args(es, r, false);
+	unsigned site = r->nr_call_sites++ % MAX_CALL_SITES;
+
+	compile(t, e, r, false);
+	i_regular_call_begin(t);
+	c_args(t, es, r, false);
 
 	if (tail)
-		return i_tr_regular_call(fn, args);
+		i_tr_regular_call_end(t, site);
 	else
-		return i_regular_call(fn, args);
+		i_regular_call_end(t, site);
+}
+
+// ((lambda (ns) body) es), the let idiom.  The frame is built and the body
+// run inline, there's no closure and no call.  In tail position whatever
+// follows discards the environment, so it isn't unlinked.
+static void c_closed_application(Thunk *t, Value e, Value es, StaticEnv *r, bool tail)
+{
+	Value ns = cadr(e), boxed;
+	unsigned nr_fixed = 0, argc = list_len(es);
+	ListBuilder lb;
+
+	lb_init(&lb);
+	while (is_cons(ns)) {
+		lb_append(&lb, car(ns));
+		nr_fixed++;
+		ns = cdr(ns);
+	}
+
+	if (is_nil(ns) ? argc != nr_fixed : argc < nr_fixed)
+		error("arity error");
+
+	c_args(t, es, r, false);
+	if (!is_nil(ns)) {
+		lb_append(&lb, ns);
+		op8(t, ARITY_GEQ, nr_fixed + 1);
+	}
+	ns = lb_get(&lb);
+	boxed = boxed_params_(ns, cddr(e), r);
+	op(t, ENV_EXTEND);
+	i_box_args(t, ns, boxed);
+
+	r_push_frame(r, ns, boxed);
+	c_sequence(t, cddr(e), r, tail);
+	r_pop_frame(r);
+
+	if (!tail)
+		op(t, ENV_UNLINK);
+}
+
+//----------------------------------------------------------------
+// Inlined primitives
+//
+// The hottest primitives get their own instructions, which handle the
+// common types inline and call the primitive for anything else.  So they
+// keep its semantics, including its errors.  If all the arguments are
+// constants of those common types the call is folded.
+//
+// The arguments have been compiled by the time we get here, args holds the
+// offset of each one's code within t.  Argument code doesn't contain any
+// absolute offsets, so can be moved.
+
+typedef struct {
+	const char *name;
+	bool (*fold)(Value *args, Value *result);
+	void (*emit)(Thunk *t, StaticEnv *r, unsigned prim, size_t *args);
+} InlinePrim;
+
+static bool fold_add_(Value *args, Value *result)
+{
+	int64_t n;
+
+	if (!is_int(args[0]) || !is_int(args[1]) ||
+	    __builtin_add_overflow(as_int(args[0]), as_int(args[1]), &n))
+		return false;
+
+	*result = mk_int(n);
+	return true;
+}
+
+static bool fold_lt_(Value *args, Value *result)
+{
+	if (!is_int(args[0]) || !is_int(args[1]))
+		return false;
+
+	*result = mk_bool(as_int(args[0]) < as_int(args[1]));
+	return true;
+}
+
+static bool fold_eq_(Value *args, Value *result)
+{
+	if (!is_int(args[0]) || !is_int(args[1]))
+		return false;
+
+	*result = mk_bool(as_int(args[0]) == as_int(args[1]));
+	return true;
+}
+
+static bool fold_car_(Value *args, Value *result)
+{
+	if (!is_cons(args[0]))
+		return false;
+
+	*result = car(args[0]);
+	return true;
+}
+
+static bool fold_cdr_(Value *args, Value *result)
+{
+	if (!is_cons(args[0]))
+		return false;
+
+	*result = cdr(args[0]);
+	return true;
+}
+
+// Is the code from b to e a single CONSTANT instruction?
+static bool constant_code_(Thunk *t, StaticEnv *r, size_t b, size_t e, Value *v)
+{
+	if (e - b != 3 || t->b[b] != CONSTANT)
+		return false;
+
+	*v = v_ref(r->constants, (t->b[b + 1] << 8) | t->b[b + 2]);
+	return true;
 }
 
-static Thunk *c_closed_application(Value e, Value es, StaticEnv *r, bool tail)
+// A fixnum constant that fits in a signed byte?
+static bool small_constant_(Thunk *t, StaticEnv *r, size_t b, size_t e, int *n)
 {
-	// FIXME: finish
+	Value v;
+
+	if (!constant_code_(t, r, b, e, &v))
+		return false;
+
+	if (!is_fixnum_(v) || as_fixnum(v) < -128 || as_fixnum(v) > 127)
+		return false;
+
+	*n = as_fixnum(v);
+	return true;
+}
+
+// The code for (+ a b) is: a, VALUE_PUSH, b
+static void emit_add_(Thunk *t, StaticEnv *r, unsigned prim, size_t *args)
+{
+	int n;
+
+	if (small_constant_(t, r, args[1], t_size(t), &n)) {
+		t->e = t->b + args[1] - 1;
+		op8_16(t, ADD_IMM, n & 0xff, prim);
+
+	} else if (small_constant_(t, r, args[0], args[1] - 1, &n)) {
+		memmove(t->b + args[0], t->b + args[1], t_size(t) - args[1]);
+		t->e -= args[1] - args[0];
+		op8_16(t, ADD_IMM, n & 0xff, prim);
+
+	} else
+		op16(t, ADD_FIXNUM, prim);
+}
+
+static void emit_lt_(Thunk *t, StaticEnv *r, unsigned prim, size_t *args)
+{
+	op8_16(t, CMP, CMP_LT, prim);
+}
+
+static void emit_eq_(Thunk *t, StaticEnv *r, unsigned prim, size_t *args)
+{
+	op8_16(t, CMP, CMP_EQ, prim);
+}
+
+static void emit_car_(Thunk *t, StaticEnv *r, unsigned prim, size_t *args)
+{
+	op16(t, CAR, prim);
+}
+
+static void emit_cdr_(Thunk *t, StaticEnv *r, unsigned prim, size_t *args)
+{
+	op16(t, CDR, prim);
+}
+
+static const InlinePrim inline_prims_[] = {
+	{"+", fold_add_, emit_add_},
+	{"<", fold_lt_, emit_lt_},
+	{"=", fold_eq_, emit_eq_},
+	{"car", fold_car_, emit_car_},
+	{"cdr", fold_cdr_, emit_cdr_},
+};
+
+static const InlinePrim *find_inline_(Primitive *prim)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(inline_prims_) / sizeof(*inline_prims_); i++)
+		if (!strcmp(inline_prims_[i].name, prim->name))
+			return inline_prims_ + i;
+
 	return NULL;
 }
 
-static Thunk *c_primitive_application(unsigned constant_index,
-		                      Value es, StaticEnv *r, bool tail)
+// If every argument compiled to a single CONSTANT, replace the lot with
+// the result.
+static bool try_fold_(Thunk *t, StaticEnv *r, const InlinePrim *ip,
+		      size_t *args, unsigned argc)
+{
+	unsigned i;
+	size_t e;
+	Value vs[3], result;
+
+	for (i = 0; i < argc; i++) {
+		e = (i == argc - 1) ? t_size(t) : args[i + 1] - 1;
+		if (!constant_code_(t, r, args[i], e, vs + i))
+			return false;
+	}
+
+	if (!ip->fold(vs, &result))
+		return false;
+
+	t->e = t->b + args[0];
+	i_constant(t, r_add_constant(r, result));
+	return true;
+}
+
+static void c_primitive_application(Thunk *t, unsigned constant_index,
+				    Value es, StaticEnv *r, bool tail)
 {
 	Primitive *prim = as_ref(v_ref(r->constants, constant_index));
+	const InlinePrim *ip = find_inline_(prim);
 	unsigned i, argc = list_len(es);
-	Thunk *t = t_new(16);
+	size_t args[3];
 
 	if (argc != prim->argc)
 		error("arity error\n");
 
 	for (i = 0; i < argc; i++) {
-		t_merge(t, compile(car(es), r, false));
+		args[i] = t_size(t);
+		compile(t, car(es), r, false);
 		if (i < argc - 1)
 			op(t, VALUE_PUSH);
 		es = cdr(es);
 	}
 
-	return i_primitive(constant_index, argc, t);
+	if (!ip)
+		i_primitive(t, constant_index, argc);
+
+	else if (!try_fold_(t, r, ip, args, argc))
+		ip->emit(t, r, constant_index, args);
 }
 
-static Thunk *c_application(Value e, Value es, StaticEnv *r, bool tail)
+static void c_application(Thunk *t, Value e, Value es, StaticEnv *r, bool tail)
 {
 	// FIXME: check es is a proper list
 	if (is_type(SYMBOL, e)) {
 		Kind k = compute_kind(r, as_ref(e));
 		switch (k.t) {
 		case KindLocal:
+		case KindClosed:
 		case KindGlobal:
-			return c_regular_application(e, es, r, tail);
+			c_regular_application(t, e, es, r, tail);
+			break;
 
 		case KindConstant:
-			return c_primitive_application(k.i, es, r, tail);
+			c_primitive_application(t, k.i, es, r, tail);
+			break;
 		}
 
-	} else if (is_cons(e) &&
-		   is_type(SYMBOL, car(e)) &&
-		   !string_cmp_cstr(as_ref(car(e)), "lambda"))
-		return c_closed_application(e, es, r, tail);
+	} else if (is_cons(e) && is_sym(car(e), sym_lambda_))
+		c_closed_application(t, e, es, r, tail);
 
 	else
-		return c_regular_application(e, es, r, tail);
-
-	return NULL;
+		c_regular_application(t, e, es, r, tail);
 }
 
-// We assume that symbols can use ptr comparison.  Probably will always be
-// true.
-Thunk *compile(Value e, StaticEnv *r, bool tail)
+static void compile(Thunk *t, Value e, StaticEnv *r, bool tail)
 {
 	if (is_cons(e)) {
-		if (is_type(SYMBOL, car(e))) {
-			String *s = as_ref(car(e));
-			// FIXME: use ptr comparison
-			if (!string_cmp_cstr(s, "quote"))
-				return c_quotation(cadr(e), r, tail);
+		Value s = car(e);
 
-			else if (!string_cmp_cstr(s, "lambda"))
-				return c_abstraction(cadr(e), cddr(e), r, tail);
+		if (is_sym(s, sym_quote_))
+			c_quotation(t, cadr(e), r, tail);
 
-			else if (!string_cmp_cstr(s, "if"))
-				return c_alternative(cadr(e), caddr(e), cadddr(e),
-					      	     r, tail);
+		else if (is_sym(s, sym_lambda_))
+			c_abstraction(t, cadr(e), cddr(e), r, tail);
 
-			else if (!string_cmp_cstr(s, "begin"))
-				return c_sequence(cdr(e), r, tail);
+		else if (is_sym(s, sym_if_))
+			c_alternative(t, cadr(e), caddr(e), cadddr(e),
+				      r, tail);
 
-			else if (!string_cmp_cstr(s, "set!"))
-				return c_assignment(as_ref(cadr(e)), caddr(e), r, tail);
+		else if (is_sym(s, sym_begin_))
+			c_sequence(t, cdr(e), r, tail);
 
-			// Fall through
-		}
+		else if (is_sym(s, sym_set_))
+			c_assignment(t, as_ref(cadr(e)), caddr(e), r, tail);
+
+		else
+			c_application(t, car(e), cdr(e), r, tail);
 
-		return c_application(car(e), cdr(e), r, tail);
 	} else {
 		if (is_type(SYMBOL, e))
-			return c_reference(e, r, tail);
+			c_reference(t, e, r, tail);
 		else
-			return c_quotation(e, r, tail);
+			c_quotation(t, e, r, tail);
 	}
 }
 
@@ -1042,13 +2362,159 @@ void print_constants_(Vector *cs)
 	}
 }
 
-Value eval(StaticEnv *r, VM *vm, Value sexp)
+Thunk *compile_toplevel(StaticEnv *r, Value sexp)
+{
+	Thunk *t;
+	ListBuilder assigned;
+
+	init_special_forms_();
+
+	t = r_cached_code(r, sexp);
+	if (t)
+		return t;
+
+	// compute_kind() may define many globals whilst compiling a single
+	// form, nobody else holds the old globals_r or constants_r, or the
+	// compile time stacks, so we can use transients.
+	t = t_new(64);
+	lb_init(&assigned);
+	assigned_(sexp, &assigned);
+	r->assigned_r = lb_get(&assigned);
+	r->globals_r = ht_transient_begin(r->globals_r);
+	r->constants_r = ht_transient_begin(r->constants_r);
+	r->frames_r = v_transient_begin(r->frames_r);
+	r->boxes_r = v_transient_begin(r->boxes_r);
+	r->scopes_r = v_transient_begin(r->scopes_r);
+	compile(t, sexp, r, true);
+	v_transient_end(r->scopes_r);
+	v_transient_end(r->boxes_r);
+	v_transient_end(r->frames_r);
+	ht_transient_end(r->constants_r);
+	ht_transient_end(r->globals_r);
+
+	r->assigned_r = mk_nil();
+
+	// The interpreter doesn't check as it goes, so a compiler bug mustn't
+	// get as far as running.
+	if (!verify_thunk(r, t))
+		error("compiled code doesn't verify");
+
+	r_cache_code(r, sexp, t);
+	return t;
+}
+
+void vm_init(VM *vm)
+{
+	memset(vm, 0, sizeof(*vm));
+
+	stack_init(&vm->stack);
+
+	vm->frames_b = mmap(NULL, FRAME_STACK_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (vm->frames_b == MAP_FAILED)
+		error("couldn't allocate frame stack");
+	vm->frames_top = vm->frames_b;
+	vm->frames_e = vm->frames_b + FRAME_STACK_SIZE;
+}
+
+void vm_exit(VM *vm)
+{
+	stack_exit(&vm->stack);
+	munmap(vm->frames_b, FRAME_STACK_SIZE);
+	free(vm->constants);
+	free(vm->globals);
+	free(vm->call_caches);
+}
+
+// Grows a table to count entries, zeroing the new ones.
+static void *grow_table_(void *table, unsigned old_count, unsigned count, size_t size)
+{
+	char *r = realloc(table, count * size);
+
+	if (!r)
+		error("out of memory");
+
+	memset(r + old_count * size, 0, (count - old_count) * size);
+	return r;
+}
+
+static void reserve_globals_(VM *vm, unsigned count)
+{
+	if (vm->nr_globals < count) {
+		vm->globals = grow_table_(vm->globals, vm->nr_globals, count,
+					  sizeof(*vm->globals));
+		vm->nr_globals = count;
+	}
+}
+
+Vector *vm_globals(VM *vm)
+{
+	unsigned i;
+	Vector *v = v_transient_begin(v_empty());
+
+	for (i = 0; i < vm->nr_globals; i++)
+		v = v_push(v, vm->globals[i]);
+	v_transient_end(v);
+
+	return v;
+}
+
+static void sync_constants_(VM *vm, StaticEnv *r)
+{
+	unsigned i, nr = v_size(r->constants);
+
+	if (vm->constants_owner != r) {
+		vm->constants_owner = r;
+		vm->nr_constants = 0;
+	}
+
+	if (vm->nr_constants < nr) {
+		vm->constants = grow_table_(vm->constants, vm->nr_constants, nr,
+					    sizeof(*vm->constants));
+		for (i = vm->nr_constants; i < nr; i++)
+			vm->constants[i] = v_ref(r->constants, i);
+		vm->nr_constants = nr;
+	}
+}
+
+void vm_set_globals(VM *vm, Vector *globals)
+{
+	unsigned i;
+
+	reserve_globals_(vm, v_size(globals));
+	for (i = 0; i < v_size(globals); i++)
+		vm->globals[i] = v_ref(globals, i);
+}
+
+Value eval_thunk(StaticEnv *r, VM *vm, Thunk *t)
 {
-	Thunk *t = compile(sexp, r, true);
+	unsigned nr_sites = r->nr_call_sites < MAX_CALL_SITES ?
+		r->nr_call_sites : MAX_CALL_SITES;
+
+	vm->code = *t;
+	vm->val = mk_nil();
+	vm->env = NULL;
+	vm->closed = NULL;
+	stack_reset(&vm->stack);
+	vm->frames_top = vm->frames_b;
+	sync_constants_(vm, r);
+	reserve_globals_(vm, ht_size(r->globals_r));
+
+	if (vm->nr_call_caches < nr_sites) {
+		vm->call_caches = grow_table_(vm->call_caches, vm->nr_call_caches,
+					      nr_sites, sizeof(*vm->call_caches));
+		vm->nr_call_caches = nr_sites;
+	}
+
+	// The last eval's caches may point at objects that have since gone.
+	vm->epoch++;
 
-	printf("disassembly:\n");
-	disassemble(t, r);
-	print_constants_(r->constants);
-	return sexp;
+	run(vm);
+	return vm->val;
+}
+
+Value eval(StaticEnv *r, VM *vm, Value sexp)
+{
+	return eval_thunk(r, vm, compile_toplevel(r, sexp));
 }
 
@@ -6,8 +6,28 @@
 
 //----------------------------------------------------------------
 
+void vm_init(VM *vm);
+void vm_exit(VM *vm);
+
+// The globals as a Vector, for snapshots, and setting them back from one.
+Vector *vm_globals(VM *vm);
+void vm_set_globals(VM *vm, Vector *globals);
+
+// Returns the value of the form.
 Value eval(StaticEnv *r, VM *vm, Value sexp);
 
+// eval() is these two, split so that compiled code can be saved (see
+// image.h).
+Thunk *compile_toplevel(StaticEnv *r, Value sexp);
+Value eval_thunk(StaticEnv *r, VM *vm, Thunk *t);
+
+// Checks code is safe to run, eval_thunk() assumes it is.  Both
+// compile_toplevel() and image_load() verify what they return.
+bool verify_thunk(StaticEnv *r, Thunk *t);
+
+// Prints t's instructions to stdout.
+void disassemble(Thunk *t, StaticEnv *r);
+
 //----------------------------------------------------------------
 
 #endif
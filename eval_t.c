@@ -0,0 +1,659 @@
+#include "equality.h"
+#include "eval.h"
+#include "primitives.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//----------------------------------------------------------------
+
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static StaticEnv *new_env_()
+{
+	StaticEnv *r = r_alloc();
+	def_basic_primitives(r);
+	return r;
+}
+
+static Value read_one_(const char *txt)
+{
+	String input;
+	TokenStream ts;
+	Value v;
+
+	string_tmp(txt, &input);
+	stream_init(&input, &ts);
+	assert(read_sexp(&ts, &v));
+
+	return v;
+}
+
+static size_t code_len_(const char *src)
+{
+	Thunk *t = compile_toplevel(new_env_(), read_one_(src));
+	return t->e - t->b;
+}
+
+static void t_code_len()
+{
+	// goto 3, arity_eq 2, env_extend 1, shallow_argument_ref 2,
+	// return 1, create_closure 6
+	assert(code_len_("(lambda (x) x)") == 15);
+
+	// constant 3, jump_false 3, constant 3, goto 3, constant 3
+	assert(code_len_("(if 1 2 3)") == 15);
+
+	// constant 3, value_push 1, constant 3, call2 3
+	assert(code_len_("(string-append \"a\" \"b\")") == 10);
+}
+
+// Verifies src's code with the byte at offset replaced, or cut short there
+// if byte is negative.
+static bool verifies_(StaticEnv *r, const char *src, size_t offset, int byte)
+{
+	Thunk *t = compile_toplevel(r, read_one_(src));
+	size_t len = t->e - t->b;
+	unsigned char *copy = malloc(len);
+	Thunk tmp;
+	bool ok;
+
+	assert(copy && offset <= len);
+	memcpy(copy, t->b, len);
+	tmp.b = copy;
+	tmp.e = tmp.alloc_e = copy + len;
+	if (byte < 0)
+		tmp.e = copy + offset;
+	else
+		copy[offset] = byte;
+
+	ok = verify_thunk(r, &tmp);
+	free(copy);
+	return ok;
+}
+
+static int code_byte_(StaticEnv *r, const char *src, size_t offset)
+{
+	return compile_toplevel(r, read_one_(src))->b[offset];
+}
+
+// See t_code_len() for the layouts.
+static void t_verifier()
+{
+	StaticEnv *r = new_env_();
+	const char *lambda = "(lambda (x) x)";
+	const char *closure = "((lambda (n) (lambda (x . y) (set! n (+ n x)) (car y))) 1)";
+	size_t i;
+
+	assert(verifies_(r, lambda, 0, -1));
+	assert(verifies_(r, lambda, 6, code_byte_(r, lambda, 6)));
+
+	// out of range frame index, constant and jump
+	assert(!verifies_(r, lambda, 7, 1));
+	assert(!verifies_(r, "(quote (a))", 1, 0xff));
+	assert(!verifies_(r, "(if 1 2 3)", 5, 0xff));
+
+	// a jump into the middle of an instruction
+	assert(!verifies_(r, "(if 1 2 3)", 5, 7));
+
+	// the closure pops a value nobody pushed
+	assert(!verifies_(r, lambda, 10, 1));
+
+	// the body doesn't return, env_extend replaces the return
+	assert(!verifies_(r, lambda, 8, code_byte_(r, lambda, 5)));
+
+	// cut short anywhere but the end of a top level instruction, the
+	// goto over the body is fine on its own
+	for (i = 1; i < 15; i++)
+		assert(verifies_(r, lambda, i, -1) == (i == 9));
+	assert(verifies_(r, "(if 1 2 3)", 15, -1));
+	assert(!verifies_(r, "(if 1 2 3)", 14, -1));
+
+	// whatever the corruption, the verifier itself copes
+	for (i = 0; i < code_len_(closure) * 256; i++)
+		verifies_(r, closure, i / 256, i % 256);
+}
+
+static void t_closed_application()
+{
+	// allocate_frame 2, value_push 1, constant 3, pack_arg 2,
+	// value_pop 1, env_extend 1, shallow_argument_ref 2
+	assert(code_len_("((lambda (x) x) \"a\")") == 12);
+
+	// not in tail position, so env_unlink 1 as well
+	assert(code_len_("(string-length ((lambda (x) x) \"a\"))") == 16);
+}
+
+static void t_inline()
+{
+	// folded to a single constant
+	assert(code_len_("(+ 1 2)") == 3);
+	assert(code_len_("(< (+ 1 2) (car (quote (4))))") == 3);
+
+	// not folded, add_imm passes the string to the primitive, which
+	// reports the type error at run time
+	assert(code_len_("(+ 1 \"a\")") == 7);
+
+	// global_ref 3, add_imm 4
+	assert(code_len_("(+ x 1)") == 7);
+	assert(code_len_("(+ -1 x)") == 7);
+
+	// global_ref 3, value_push 1, global_ref 3, add_fixnum 3
+	assert(code_len_("(+ x y)") == 10);
+
+	// global_ref 3, car 3
+	assert(code_len_("(car x)") == 6);
+}
+
+//----------------------------------------------------------------
+
+static void check_eval_(StaticEnv *r, VM *vm, const char *src, const char *expected)
+{
+	String input;
+	TokenStream ts;
+	Value v, result = mk_nil();
+
+	string_tmp(src, &input);
+	stream_init(&input, &ts);
+	while (read_sexp(&ts, &v))
+		result = eval(r, vm, v);
+
+	if (!equalp(result, read_one_(expected))) {
+		fprintf(stderr, "'%s' didn't evaluate to '%s', got ", src, expected);
+		print(stderr, result);
+		fprintf(stderr, "\n");
+		assert(false);
+	}
+}
+
+static void t_eval()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+
+	vm_init(&vm);
+	check_eval_(r, &vm, "(+ 1 2)", "3");
+	check_eval_(r, &vm, "(if (< 1 2) (quote yes) (quote no))", "yes");
+	check_eval_(r, &vm, "(if (= 1 2) (quote yes) (quote no))", "no");
+	check_eval_(r, &vm, "((lambda (x y) (+ x y)) 3 4)", "7");
+	check_eval_(r, &vm, "((lambda (a . rest) rest) 1 2 3)", "(2 3)");
+	check_eval_(r, &vm, "(set! inc (lambda (x) (+ x 1))) (inc 41)", "42");
+	check_eval_(r, &vm, "(set! add (lambda (x) (lambda (y) (+ x y)))) ((add 3) 4)", "7");
+	check_eval_(r, &vm, "(set! sum (lambda (n) (if (= n 0) 0 (+ n (sum (+ n -1)))))) (sum 100)",
+		    "5050");
+	check_eval_(r, &vm, "(string-length (string-append \"ab\" \"c\"))", "3");
+	check_eval_(r, &vm, "(set! l (quote (1 2 3))) (car (cdr l))", "2");
+
+	// primitives can be passed around
+	check_eval_(r, &vm, "((lambda (f) (f 1 2)) +)", "3");
+
+	// lets
+	check_eval_(r, &vm, "(+ 1 ((lambda (x y) (+ x y)) 2 3))", "6");
+	check_eval_(r, &vm, "((lambda (x) ((lambda (y) (+ x y)) 2)) 1)", "3");
+	check_eval_(r, &vm, "(set! k ((lambda (x) (lambda (y) (+ x y))) 10)) (k 5)", "15");
+	check_eval_(r, &vm, "((lambda (x) ((lambda (x) x) 2) x) 1)", "1");
+	check_eval_(r, &vm, "((lambda (a . rest) (cdr rest)) 1 2 3)", "(3)");
+	vm_exit(&vm);
+}
+
+// Values the inline instructions don't handle go to the primitive.
+static void t_fallback()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+
+	vm_init(&vm);
+	check_eval_(r, &vm, "(set! big 536870911) (+ big 1)", "536870912");
+	check_eval_(r, &vm, "(+ big big)", "1073741822");
+	check_eval_(r, &vm, "(< big (+ big 1))", "t");
+	check_eval_(r, &vm, "(set! huge 9000000000) (= huge (+ huge 0))", "t");
+	vm_exit(&vm);
+}
+
+static void t_closures()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+
+	vm_init(&vm);
+
+	// captured through a lambda that doesn't use it itself
+	check_eval_(r, &vm, "(set! f (lambda (x) (lambda (y) (lambda (z) (+ x z))))) (((f 1) 2) 3)",
+		    "4");
+
+	// and through lets
+	check_eval_(r, &vm, "(((lambda (a) ((lambda (b) (lambda (c) (+ a c))) 2)) 10) 5)", "15");
+
+	// assigned and captured variables are shared
+	check_eval_(r, &vm, "(set! make-counter (lambda () ((lambda (n) (lambda () (set! n (+ n 1)) n)) 0)))"
+		    "(set! c (make-counter)) (c) (c)", "2");
+	check_eval_(r, &vm, "((make-counter))", "1");
+	check_eval_(r, &vm, "(c)", "3");
+	check_eval_(r, &vm, "((lambda (n) ((lambda (inc get) (inc) (inc) (get))"
+		    " (lambda () (set! n (+ n 1))) (lambda () n))) 0)", "2");
+	check_eval_(r, &vm, "((lambda (n) (set! n 5) ((lambda () n))) 1)", "5");
+
+	// assigned but not captured
+	check_eval_(r, &vm, "((lambda (x) (set! x 5) x) 1)", "5");
+	vm_exit(&vm);
+}
+
+static void t_stack_frames()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+	Value call;
+	size_t allocated;
+
+	vm_init(&vm);
+	check_eval_(r, &vm, "(set! sum (lambda (n) (if (= n 0) 0 (+ n (sum (+ n -1)))))) (sum 100)",
+		    "5050");
+
+	// Nothing is captured, so once compiled a call doesn't touch the heap.
+	call = read_one_("(sum ((lambda (x) (+ x 1)) 99))");
+	eval(r, &vm, call);
+	allocated = memory_stats_.total_allocated;
+	assert(as_int(eval(r, &vm, call)) == 5050);
+	assert(memory_stats_.total_allocated == allocated);
+
+	// Closures keep their values after the call that made them returns,
+	// and the frame stack is reused.
+	check_eval_(r, &vm, "(set! adder (lambda (x) (lambda (y) (+ x y)))) (set! a5 (adder 5)) 0",
+		    "0");
+	check_eval_(r, &vm, "(sum 10) (a5 1)", "6");
+	check_eval_(r, &vm, "(set! a6 ((lambda (x) (lambda (y) (+ x y))) 6)) (sum 10) (a6 1)", "7");
+	check_eval_(r, &vm, "(set! a7 ((lambda (x) ((lambda (z) (lambda (y) (+ x y))) 0)) 7)) (sum 10) (a7 1)",
+		    "8");
+	vm_exit(&vm);
+}
+
+static void t_tail_calls()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+
+	vm_init(&vm);
+
+	// A loop far deeper than the stack would hold if calls in tail
+	// position pushed anything.
+	check_eval_(r, &vm, "(set! loop (lambda (n acc) (if (= n 0) acc (loop (+ n -1) (+ acc 1)))))"
+		    "(loop 1000000 0)", "1000000");
+	assert(vm.stack.nr_chunks == 1);
+	assert(vm.frames_top == vm.frames_b);
+
+	check_eval_(r, &vm, "(set! ev (lambda (n) (if (= n 0) (quote t) (od (+ n -1)))))"
+		    "(set! od (lambda (n) (if (= n 0) () (ev (+ n -1)))))"
+		    "(ev 100000)", "t");
+	check_eval_(r, &vm, "(set! down (lambda (n) ((lambda (m) (if (= m 0) m (down m))) (+ n -1))))"
+		    "(down 100000)", "0");
+	check_eval_(r, &vm, "(set! count (lambda (n . rest) (if (= n 0) rest (count (+ n -1) n))))"
+		    "(count 100000)", "(1)");
+	check_eval_(r, &vm, "(set! plus +) ((lambda (x) (plus x 1)) 1)", "2");
+	assert(vm.stack.nr_chunks == 1);
+
+	// A closure calling something that tail calls gets its own captured
+	// values back.
+	check_eval_(r, &vm, "(set! c (lambda (z) z)) (set! b (lambda (y) (c y)))"
+		    "(set! mk (lambda (k) (lambda (y) (+ (b y) k)))) ((mk 100) 1)", "101");
+
+	// Calls that aren't in tail position grow the stack a chunk at a
+	// time, and give the chunks back as they return.
+	check_eval_(r, &vm, "(set! sum (lambda (n) (if (= n 0) 0 (+ n (sum (+ n -1))))))"
+		    "(sum 100000)", "5000050000");
+	assert(vm.stack.nr_chunks <= 2);
+	vm_exit(&vm);
+}
+
+static void t_call_caches()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+	Vector *globals;
+	Value sum;
+	unsigned i;
+	bool cached = false;
+
+	vm_init(&vm);
+	check_eval_(r, &vm, "(set! sum (lambda (n) (if (= n 0) 0 (+ n (sum (+ n -1)))))) (sum 100)",
+		    "5050");
+
+	// The recursive call remembers sum.
+	eval(r, &vm, read_one_("(sum 10)"));
+	sum = vm.globals[0];
+	for (i = 0; i < vm.nr_call_caches; i++)
+		if (vm.call_caches[i].fun == sum.ptr && vm.call_caches[i].epoch == vm.epoch)
+			cached = true;
+	assert(cached);
+
+	// The same site calling different things.
+	check_eval_(r, &vm, "(set! app (lambda (f x) (f x))) (app (lambda (x) (+ x 1)) 1)", "2");
+	check_eval_(r, &vm, "(app car (quote (3)))", "3");
+	check_eval_(r, &vm, "(app (lambda (x . rest) rest) 1)", "()");
+	check_eval_(r, &vm, "(set! twice (lambda (f g) (+ (app f 1) (app g 1))))"
+		    "(twice (lambda (x) x) (lambda (x) (+ x 10)))", "12");
+
+	// Globals survive a round trip through a snapshot's vector.
+	globals = vm_globals(&vm);
+	vm_exit(&vm);
+	vm_init(&vm);
+	vm_set_globals(&vm, globals);
+	check_eval_(r, &vm, "(sum 3)", "6");
+	vm_exit(&vm);
+}
+
+static void t_constant_dedup()
+{
+	StaticEnv *r = new_env_();
+	unsigned nr = v_size(r->constants);
+
+	compile_toplevel(r, read_one_("(string-append \"a\" \"a\")"));
+	assert(v_size(r->constants) == nr + 1);
+
+	compile_toplevel(r, read_one_("(begin \"a\" (quote (x 1)) \"a\" (quote (x 1)))"));
+	assert(v_size(r->constants) == nr + 2);
+}
+
+// The vm's copy of the constants follows the environment it's running.
+static void t_flat_constants()
+{
+	StaticEnv *r1 = new_env_(), *r2 = new_env_();
+	VM vm;
+
+	vm_init(&vm);
+	check_eval_(r1, &vm, "(quote (a b))", "(a b)");
+	check_eval_(r1, &vm, "\"one\"", "\"one\"");
+	assert(vm.nr_constants == v_size(r1->constants));
+
+	check_eval_(r2, &vm, "\"two\"", "\"two\"");
+	assert(vm.nr_constants == v_size(r2->constants));
+	check_eval_(r1, &vm, "(quote (a b))", "(a b)");
+	vm_exit(&vm);
+}
+
+static void t_code_cache()
+{
+	StaticEnv *r = new_env_();
+	Thunk *t1, *t2;
+	Primitive *p;
+	unsigned nr;
+
+	// The same structure read twice gives the same thunk.
+	t1 = compile_toplevel(r, read_one_("(set! foo (lambda (x) (+ x 1)))"));
+	nr = v_size(r->constants);
+	t2 = compile_toplevel(r, read_one_("(set! foo (lambda (x) (+ x 1)))"));
+	assert(t1 == t2);
+	assert(v_size(r->constants) == nr);
+
+	t2 = compile_toplevel(r, read_one_("(set! foo (lambda (x) (+ x 2)))"));
+	assert(t1 != t2);
+
+	// Adding a primitive invalidates the cache.
+	p = mm_alloc(PRIMITIVE, sizeof(*p));
+	*p = *((Primitive *) v_ref(r->constants, 0).ptr);
+	p->name = "inc";
+	r_add_prim(r, mk_ref(p));
+	t2 = compile_toplevel(r, read_one_("(set! foo (lambda (x) (+ x 1)))"));
+	assert(t1 != t2);
+	assert(t1->e - t1->b == t2->e - t2->b);
+	assert(!memcmp(t1->b, t2->b, t1->e - t1->b));
+}
+
+//----------------------------------------------------------------
+// Compile benchmark
+//
+// Generated scripts are deeply nested, which is where building each
+// subexpression's code separately, and copying it into its parent, hurt.
+
+#define NR_FORMS 1000
+#define DEPTH 7
+
+static unsigned rand_(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static size_t gen_expr_(char *buffer, size_t len, unsigned depth, unsigned *seed)
+{
+	static const char *leaves[] = {"x", "y", "1", "2", "\"s\""};
+	size_t n;
+
+	if (!depth)
+		return snprintf(buffer, len, "%s", leaves[rand_(seed) % 5]);
+
+	switch (rand_(seed) % 4) {
+	case 0:
+		n = snprintf(buffer, len, "(+ ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		n += snprintf(buffer + n, len - n, " ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		break;
+
+	case 1:
+		n = snprintf(buffer, len, "(if ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		n += snprintf(buffer + n, len - n, " ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		n += snprintf(buffer + n, len - n, " ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		break;
+
+	case 2:
+		n = snprintf(buffer, len, "(lambda (x y) ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		break;
+
+	default:
+		n = snprintf(buffer, len, "(begin ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		n += snprintf(buffer + n, len - n, " ");
+		n += gen_expr_(buffer + n, len - n, depth - 1, seed);
+		break;
+	}
+
+	return n + snprintf(buffer + n, len - n, ")");
+}
+
+static void bench_compile()
+{
+	unsigned i, seed = 1;
+	size_t len = 0, max = NR_FORMS * 8192, code_len = 0;
+	size_t allocated;
+	char *src = malloc(max);
+	double before, after;
+	String input;
+	TokenStream ts;
+	StaticEnv *r = new_env_();
+	Vector *forms = v_transient_begin(v_empty());
+	Value v;
+
+	assert(src);
+	for (i = 0; i < NR_FORMS; i++) {
+		len += snprintf(src + len, max - len, "(set! f%u ", i);
+		len += gen_expr_(src + len, max - len, DEPTH, &seed);
+		len += snprintf(src + len, max - len, ")\n");
+		assert(len < max);
+	}
+
+	string_tmp(src, &input);
+	stream_init(&input, &ts);
+	while (read_sexp(&ts, &v))
+		forms = v_push(forms, v);
+
+	allocated = memory_stats_.total_allocated;
+	before = now_();
+	for (i = 0; i < v_size(forms); i++) {
+		Thunk *t = compile_toplevel(r, v_ref(forms, i));
+		code_len += t->e - t->b;
+	}
+	after = now_();
+
+	fprintf(stderr, "compiled %u forms, %.1fms, %zu bytes of code, %zu allocated\n",
+		NR_FORMS, (after - before) * 1000, code_len,
+		memory_stats_.total_allocated - allocated);
+
+	// Again, as a script that reevaluates its forms would.
+	before = now_();
+	for (i = 0; i < v_size(forms); i++)
+		compile_toplevel(r, v_ref(forms, i));
+	after = now_();
+	fprintf(stderr, "recompiled %u forms from the cache, %.1fms\n",
+		NR_FORMS, (after - before) * 1000);
+
+	v_transient_end(forms);
+	free(src);
+}
+
+//----------------------------------------------------------------
+// Eval benchmark
+//
+// A recursive sum, with the arithmetic inlined, and with it called through
+// a global that holds the primitives, which is what every call used to
+// cost.
+
+#define NR_SUMS 2000
+
+static double time_sum_(StaticEnv *r, VM *vm, const char *def)
+{
+	unsigned i;
+	double before;
+	Value call = read_one_("(sum 500)");
+
+	eval(r, vm, read_one_(def));
+	before = now_();
+	for (i = 0; i < NR_SUMS; i++)
+		assert(as_int(eval(r, vm, call)) == 125250);
+
+	return now_() - before;
+}
+
+static void bench_eval()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+	double inlined, called;
+	size_t allocated;
+
+	vm_init(&vm);
+	eval(r, &vm, read_one_("(set! plus +)"));
+	eval(r, &vm, read_one_("(set! eq =)"));
+
+	allocated = memory_stats_.total_allocated;
+	inlined = time_sum_(r, &vm,
+			    "(set! sum (lambda (n) (if (= n 0) 0 (+ n (sum (+ n -1))))))");
+	allocated = memory_stats_.total_allocated - allocated;
+	called = time_sum_(r, &vm,
+			   "(set! sum (lambda (n) (if (eq n 0) 0 (plus n (sum (plus n -1))))))");
+
+	fprintf(stderr, "%u sums: inlined %.1fms, %zu allocated, called %.1fms\n",
+		NR_SUMS, inlined * 1000, allocated, called * 1000);
+	vm_exit(&vm);
+}
+
+// A let in the loop, against the same lambda passed through a function so
+// it has to be created and called.
+static void bench_let()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+	double closed, called;
+	size_t allocated;
+
+	vm_init(&vm);
+	eval(r, &vm, read_one_("(set! id (lambda (f) f))"));
+
+	allocated = memory_stats_.total_allocated;
+	closed = time_sum_(r, &vm,
+			   "(set! sum (lambda (n) (if (= n 0) 0 ((lambda (m) (+ m (sum (+ m -1)))) n))))");
+	fprintf(stderr, "%u sums with a let: closed %.1fms, %zu allocated",
+		NR_SUMS, closed * 1000, memory_stats_.total_allocated - allocated);
+
+	allocated = memory_stats_.total_allocated;
+	called = time_sum_(r, &vm,
+			   "(set! sum (lambda (n) (if (= n 0) 0 ((id (lambda (m) (+ m (sum (+ m -1))))) n))))");
+	fprintf(stderr, ", called %.1fms, %zu allocated\n",
+		called * 1000, memory_stats_.total_allocated - allocated);
+	vm_exit(&vm);
+}
+
+// A loop written as tail recursion, against the same loop with a non-tail
+// call, which has to return through every level.
+#define NR_LOOPS 10
+#define NR_ITERATIONS 100000
+
+static double time_loop_(StaticEnv *r, VM *vm, const char *def)
+{
+	unsigned i;
+	double before;
+	Value call = read_one_("(loop 100000 0)");
+
+	eval(r, vm, read_one_(def));
+	before = now_();
+	for (i = 0; i < NR_LOOPS; i++)
+		assert(as_int(eval(r, vm, call)) == NR_ITERATIONS);
+
+	return now_() - before;
+}
+
+static void bench_tail()
+{
+	StaticEnv *r = new_env_();
+	VM vm;
+	double tail, deep;
+
+	vm_init(&vm);
+	tail = time_loop_(r, &vm,
+			  "(set! loop (lambda (n acc) (if (= n 0) acc (loop (+ n -1) (+ acc 1)))))");
+	deep = time_loop_(r, &vm,
+			  "(set! loop (lambda (n acc) (if (= n 0) acc (+ 1 (loop (+ n -1) acc)))))");
+
+	fprintf(stderr, "%u loops of %u: tail calls %.1fms, non-tail %.1fms\n",
+		NR_LOOPS, NR_ITERATIONS, tail * 1000, deep * 1000);
+	vm_exit(&vm);
+}
+
+//----------------------------------------------------------------
+
+static void run(const char *name, void (*fn)())
+{
+	fprintf(stderr, "%s", name);
+	fprintf(stderr, "%*s... ", (int) (24 - strlen(name)), "");
+	fn();
+	fprintf(stderr, "ok\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	mm_init(512 * 1024 * 1024);
+	run("code length", t_code_len);
+	run("constant dedup", t_constant_dedup);
+	run("code cache", t_code_cache);
+	run("flat constants", t_flat_constants);
+	run("inlined primitives", t_inline);
+	run("closed application", t_closed_application);
+	run("eval", t_eval);
+	run("fallback to primitives", t_fallback);
+	run("closures", t_closures);
+	run("stack frames", t_stack_frames);
+	run("tail calls", t_tail_calls);
+	run("verifier", t_verifier);
+	run("call caches", t_call_caches);
+
+	bench_compile();
+	bench_eval();
+	bench_let();
+	bench_tail();
+	mm_exit();
+
+	return 0;
+}
+
+//----------------------------------------------------------------
@@ -5,6 +5,7 @@
 #include "error.h"
 #include "slab.h"
 #include "string_type.h"
+#include "symbol.h"
 #include "vector.h"
 
 #include <assert.h>
@@ -37,8 +38,12 @@ static uint32_t hash_(Value v)
 	case STRING:
 		return string_hash(v.ptr);
 
+	case ROPE:
+		// must agree with equalp(), which compares ropes and strings
+		return string_hash(as_flat_string(v));
+
 	case SYMBOL:
-		return string_hash(v.ptr) ^ 0b01010101;
+		return symbol_hash(v.ptr) ^ 0b01010101;
 
 	case CONS:
 		return combine_hash(hash_(car(v)),
@@ -63,6 +68,11 @@ static uint32_t hash_(Value v)
 	case FIXNUM:
 		return hash_u32(as_fixnum(v));
 
+	case INT64: {
+		uint64_t n = as_int(v);
+		return hash_u32(n ^ (n >> 32));
+	}
+
 	case PRIMITIVE:
 	case HTABLE:
 	case CLOSURE:
@@ -79,25 +89,128 @@ static uint32_t hash_(Value v)
 	return 0;
 }
 
-static uint32_t hash(Value v, unsigned level)
+bool ht_hashable(Value v)
+{
+	unsigned i, size;
+
+	switch (get_type(v)) {
+	case STRING:
+	case ROPE:
+	case SYMBOL:
+	case NIL:
+	case FIXNUM:
+	case INT64:
+		return true;
+
+	case CONS:
+		while (is_cons(v)) {
+			if (!ht_hashable(car(v)))
+				return false;
+			v = cdr(v);
+		}
+		return ht_hashable(v);
+
+	case VECTOR:
+		size = v_size(v.ptr);
+		for (i = 0; i < size; i++)
+			if (!ht_hashable(v_ref(v.ptr, i)))
+				return false;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// The hash of a key is calculated once, and then cached in its entry.  Each
+// level of the trie consumes another nibble of it.
+#define BITS_PER_LEVEL 4u
+#define LEVEL_MASK ((1u << BITS_PER_LEVEL) - 1u)
+
+static inline unsigned nibble(uint32_t h, unsigned level)
 {
-	return (hash_(v) >> (level * 4)) & 0xf;
+	return (h >> (level * BITS_PER_LEVEL)) & LEVEL_MASK;
 }
 
 //----------------------------------------------------------------
 
-HBlock hb_alloc_(unsigned nr_entries)
+// Edit ids identify the transient that owns a block.  0 is reserved for
+// persistent blocks.
+static uint32_t next_edit_ = 1;
+
+static uint32_t new_edit_()
+{
+	uint32_t edit = next_edit_++;
+
+	if (!next_edit_)
+		next_edit_ = 1;
+
+	return edit;
+}
+
+static size_t hb_size_(unsigned nr_entries)
+{
+	return sizeof(HBlock) + sizeof(HashEntry) * nr_entries;
+}
+
+static HBlock *hb_alloc_(unsigned nr_entries, uint32_t edit)
+{
+	HBlock *hb = mm_alloc(HBLOCK, hb_size_(nr_entries));
+	hb->edit = edit;
+	return hb;
+}
+
+// Returns a block that may be updated in place by the given transient;
+// either hb itself, or a clone if hb is shared.
+static HBlock *hb_editable(HBlock *hb, uint32_t edit)
 {
-	return mm_alloc(HBLOCK, sizeof(HashEntry) * nr_entries);
+	if (edit && hb->edit == edit)
+		return hb;
+
+	hb = mm_clone(hb);
+	hb->edit = edit;
+	return hb;
 }
 
-// Returns a clone with one extra entry
-static HBlock hb_extend(HBlock hb)
+// Returns a block with he inserted at index.  Blocks owned by the transient
+// are grown in place if there's room in their slab slot.
+static HBlock *hb_insert(HBlock *hb, unsigned index, HashEntry *he, uint32_t edit)
 {
-	size_t s = get_obj_size(hb);
-	HBlock new = mm_alloc(HBLOCK, s + sizeof(HashEntry));
-	assert((s / sizeof(HashEntry)) < ENTRIES_PER_HBLOCK);
-	memcpy(new, hb, s);
+	unsigned nr_entries = hb_nr_entries(hb);
+	HBlock *new;
+
+	if (edit && hb->edit == edit && mm_resize_inplace(hb, hb_size_(nr_entries + 1))) {
+		memmove(hb->entries + index + 1, hb->entries + index,
+			sizeof(HashEntry) * (nr_entries - index));
+		hb->entries[index] = *he;
+		return hb;
+	}
+
+	new = hb_alloc_(nr_entries + 1, edit);
+	memcpy(new->entries, hb->entries, sizeof(HashEntry) * index);
+	new->entries[index] = *he;
+	memcpy(new->entries + index + 1, hb->entries + index,
+	       sizeof(HashEntry) * (nr_entries - index));
+	return new;
+}
+
+// Returns a block with the entry at index removed.
+static HBlock *hb_remove(HBlock *hb, unsigned index, uint32_t edit)
+{
+	unsigned nr_entries = hb_nr_entries(hb);
+	HBlock *new;
+
+	if (edit && hb->edit == edit) {
+		memmove(hb->entries + index, hb->entries + index + 1,
+			sizeof(HashEntry) * (nr_entries - index - 1));
+		mm_resize_inplace(hb, hb_size_(nr_entries - 1));
+		return hb;
+	}
+
+	new = hb_alloc_(nr_entries - 1, edit);
+	memcpy(new->entries, hb->entries, sizeof(HashEntry) * index);
+	memcpy(new->entries + index, hb->entries + index + 1,
+	       sizeof(HashEntry) * (nr_entries - index - 1));
 	return new;
 }
 
@@ -105,6 +218,7 @@ HashTable *ht_empty()
 {
 	HashTable *ht = mm_alloc(HTABLE, sizeof(*ht));
 	ht->nr_entries = 0;
+	ht->edit = 0;
 	return ht;
 }
 
@@ -124,31 +238,92 @@ static inline void set_bit(uint32_t *word, unsigned bit)
 	(*word) |= (1 << bit);
 }
 
+static inline void clear_bit(uint32_t *word, unsigned bit)
+{
+	(*word) &= ~(1 << bit);
+}
+
 static inline uint32_t test_bit(uint32_t *word, unsigned bit)
 {
 	return (*word) & (1 << bit);
 }
 
-static bool lookup_(HashEntry *he, Value k, Value *v, unsigned level)
+//----------------------------------------------------------------
+// An entry is one of:
+//
+// - a leaf; key, val and the cached hash of key.
+// - a branch; val points to an HBlock with an entry for each bit set in map.
+// - a collision node; val points to an HBlock of leaves that all have the
+//   same full hash.  map is zero, which can't happen for a branch since empty
+//   blocks are always removed.
+//
+// Collision nodes don't consume any of the hash, so they can appear at any
+// level.  Once all 32 bits have been used up two different keys must either
+// have ended up in a collision node, or have been split.
+
+static inline bool is_leaf(HashEntry *he)
 {
-	if (get_type(he->val) == HBLOCK) {
-		uint32_t h = hash(k, level);
-		uint32_t bits = he->map;
+	return get_type(he->val) != HBLOCK;
+}
 
-		if (test_bit(&bits, h)) {
-			HBlock hb = he->val.ptr;
-			unsigned index = pop_count(bits, h);
-			return lookup_(hb + index, k, v, level + 1);
-		}
+static inline bool is_collision(HashEntry *he)
+{
+	return !is_leaf(he) && !he->map;
+}
 
-		return false;
+static inline bool leaf_matches(HashEntry *he, uint32_t h, Value k)
+{
+	return he->hash == h && equalp(he->key, k);
+}
 
-	} else if (equalp(he->key, k)) {
-		*v = he->val;
-		return true;
+static inline uint32_t collision_hash(HashEntry *he)
+{
+	return ((HBlock *) he->val.ptr)->entries[0].hash;
+}
 
-	} else
-		return false;
+// Returns the index of the matching leaf, or -1.
+static int collision_find(HBlock *hb, uint32_t h, Value k)
+{
+	unsigned i, nr_entries = hb_nr_entries(hb);
+
+	for (i = 0; i < nr_entries; i++)
+		if (leaf_matches(hb->entries + i, h, k))
+			return i;
+
+	return -1;
+}
+
+static bool lookup_(HashEntry *he, uint32_t h, Value k, Value *v, unsigned level)
+{
+	for (;;) {
+		if (is_leaf(he)) {
+			if (leaf_matches(he, h, k)) {
+				*v = he->val;
+				return true;
+			}
+
+			return false;
+
+		} else if (is_collision(he)) {
+			HBlock *hb = he->val.ptr;
+			int index = collision_find(hb, h, k);
+
+			if (index < 0)
+				return false;
+
+			*v = hb->entries[index].val;
+			return true;
+
+		} else {
+			unsigned n = nibble(h, level);
+
+			if (!test_bit(&he->map, n))
+				return false;
+
+			he = ((HBlock *) he->val.ptr)->entries + pop_count(he->map, n);
+			level++;
+		}
+	}
 }
 
 bool ht_lookup(HashTable *ht, Value k, Value *v)
@@ -156,106 +331,311 @@ bool ht_lookup(HashTable *ht, Value k, Value *v)
 	if (!ht->nr_entries)
 		return false;
 
-	return lookup_(&ht->root, k, v, 0);
+	return lookup_(&ht->root, hash_(k), k, v, 0);
+}
+
+//----------------------------------------------------------------
+
+static void mk_leaf(HashEntry *he, uint32_t h, Value k, Value v)
+{
+	he->hash = h;
+	he->key = k;
+	he->val = v;
 }
 
-static int cmp_he(const void *l, const void *r, void *level_)
+// Builds a branch that holds the two entries, neither of which is a branch,
+// and whose hashes differ.  Interim single entry blocks are created for the
+// levels where their hashes agree.
+static void split_(HashEntry *root, HashEntry *lhs, uint32_t lh,
+		   HashEntry *rhs, uint32_t rh, unsigned level, uint32_t edit)
 {
-	const HashEntry *lhs = l, *rhs = r;
-	unsigned *level = level_;
-	unsigned hl = hash(lhs->key, *level);
-	unsigned hr = hash(rhs->key, *level);
+	HBlock *hb;
+	unsigned ln = nibble(lh, level);
+	unsigned rn = nibble(rh, level);
 
-	if (hl < hr)
-		return -1;
+	root->hash = 0;
+	root->map = 0;
+	set_bit(&root->map, ln);
+	set_bit(&root->map, rn);
 
-	else if (hl > hr)
-		return 1;
+	if (ln == rn) {
+		hb = hb_alloc_(1, edit);
+		root->val.ptr = hb;
+		split_(hb->entries, lhs, lh, rhs, rh, level + 1, edit);
 
-	else {
-		// hashes must always be unique within an hblock
-		assert(0);
-		return 0;
+	} else {
+		hb = hb_alloc_(2, edit);
+		hb->entries[ln > rn] = *lhs;
+		hb->entries[ln < rn] = *rhs;
+		root->val.ptr = hb;
 	}
 }
 
-static void hb_sort(HBlock hb, unsigned nr_entries, unsigned level)
+// root must already be editable by the caller, either because it's
+// embedded in a table we've just cloned, or in a block returned by
+// hb_editable().  Returns true if a new entry was added, false if an existing
+// value was replaced.
+static bool insert_(HashEntry *root, uint32_t h, Value k, Value v,
+		    unsigned level, uint32_t edit)
 {
-	qsort_r(hb, nr_entries, sizeof(HashEntry), cmp_he, &level);
-}
+	HBlock *hb;
+	HashEntry leaf;
 
-static void insert_(HashEntry *root, Value k, Value v, unsigned level)
-{
-	HBlock hb;
+	mk_leaf(&leaf, h, k, v);
 
-	if (get_type(root->val) == HBLOCK) {
-		unsigned h;
-		unsigned nr_entries = get_obj_size(root->val.ptr) / sizeof(HashEntry);
+	for (;;) {
+		if (is_leaf(root)) {
+			if (leaf_matches(root, h, k)) {
+				root->val = v;
+				return false;
 
-		h = hash(k, level);
-		if (test_bit(&root->map, h)) {
-			root->val.ptr = hb = mm_clone(root->val.ptr);
-			insert_(hb + pop_count(root->map, h), k, v, level + 1);
+			} else if (root->hash == h) {
+				hb = hb_alloc_(2, edit);
+				hb->entries[0] = *root;
+				hb->entries[1] = leaf;
+				root->map = 0;
+				root->val.ptr = hb;
 
-		} else {
-			set_bit(&root->map, h);
-			hb = hb_extend(root->val.ptr);
-			hb[nr_entries].key = k;
-			hb[nr_entries].val = v;
-			hb_sort(hb, nr_entries + 1, level);
-			root->val.ptr = hb;
-		}
-	} else {
-		HashEntry he = *root;
+			} else {
+				HashEntry old = *root;
+				split_(root, &old, old.hash, &leaf, h, level, edit);
+			}
+
+			return true;
 
-		// If there's a hash clash we create an interim
-		// hblock with a single entry.
-		if (hash(k, level) == hash(he.key, level)) {
-			HBlock hb = hb_alloc_(1);
-			hb[0].key = he.key;
-			hb[0].val = he.val;
-			root->map = 0;
-			set_bit(&root->map, hash(he.key, level));
-			root->val.ptr = hb;
+		} else if (is_collision(root)) {
+			uint32_t ch = collision_hash(root);
 
-			return insert_(hb, k, v, level + 1);
+			if (ch == h) {
+				int index = collision_find(root->val.ptr, h, k);
+
+				if (index >= 0) {
+					root->val.ptr = hb = hb_editable(root->val.ptr, edit);
+					hb->entries[index].val = v;
+					return false;
+				}
+
+				if (hb_nr_entries(root->val.ptr) == ENTRIES_PER_HBLOCK)
+					error("too many hash collisions");
+
+				root->val.ptr = hb_insert(root->val.ptr, 0, &leaf, edit);
+
+			} else {
+				HashEntry old = *root;
+				split_(root, &old, ch, &leaf, h, level, edit);
+			}
+
+			return true;
 
 		} else {
-			assert(hash(k, level) != hash(he.key, level));
-
-			HBlock hb = hb_alloc_(2);
-			hb[0].key = k;
-			hb[0].val = v;
-			hb[1].key = he.key;
-			hb[1].val = he.val;
-			hb_sort(hb, 2, level);
-
-			root->map = 0;
-			set_bit(&root->map, hash(k, level));
-			set_bit(&root->map, hash(he.key, level));
-			root->val.ptr = hb;
+			unsigned n = nibble(h, level);
+			unsigned index = pop_count(root->map, n);
+
+			if (!test_bit(&root->map, n)) {
+				set_bit(&root->map, n);
+				root->val.ptr = hb_insert(root->val.ptr, index, &leaf, edit);
+				return true;
+			}
+
+			root->val.ptr = hb = hb_editable(root->val.ptr, edit);
+			root = hb->entries + index;
+			level++;
 		}
 	}
 }
 
+static HashTable *ht_shadow(HashTable *ht)
+{
+	return ht->edit ? ht : mm_clone(ht);
+}
+
 HashTable *ht_insert(HashTable *ht, Value k, Value v)
 {
-	ht = mm_clone(ht);
+	uint32_t h = hash_(k);
+
+	ht = ht_shadow(ht);
 
 	if (!ht->nr_entries) {
-		ht->root.key = k;
-		ht->root.val = v;
-	} else
-		insert_(&ht->root, k, v, 0);
+		mk_leaf(&ht->root, h, k, v);
+		ht->nr_entries++;
+
+	} else if (insert_(&ht->root, h, k, v, 0, ht->edit))
+		ht->nr_entries++;
 
-	ht->nr_entries++;
 	return ht;
 }
 
-HashTable *ht_erase(HashTable *ht, Value k)
+//----------------------------------------------------------------
+
+// Leaves and collision nodes don't depend on the level they're at, so a
+// block that's left holding just one of them can be replaced by it.
+static void collapse_(HashEntry *root)
 {
+	HBlock *hb = root->val.ptr;
+
+	if (hb_nr_entries(hb) == 1 && (is_leaf(hb->entries) || is_collision(hb->entries)))
+		*root = hb->entries[0];
+}
+
+// The key must be present.  Returns true if root is now empty and should be
+// removed from its parent.  A block that's left holding a single key/value
+// pair is collapsed back into its parent entry, so the trie never gets
+// deeper than it needs to be.
+static bool erase_(HashEntry *root, uint32_t h, Value k, unsigned level, uint32_t edit)
+{
+	HBlock *hb;
+
+	if (is_leaf(root))
+		return true;
+
+	if (is_collision(root)) {
+		int index = collision_find(root->val.ptr, h, k);
+
+		assert(index >= 0);
+		root->val.ptr = hb_remove(root->val.ptr, index, edit);
+		collapse_(root);
+
+	} else {
+		unsigned n = nibble(h, level);
+		unsigned index = pop_count(root->map, n);
+
+		root->val.ptr = hb = hb_editable(root->val.ptr, edit);
+		if (erase_(hb->entries + index, h, k, level + 1, edit)) {
+			if (hb_nr_entries(hb) == 1)
+				return true;
+
+			clear_bit(&root->map, n);
+			root->val.ptr = hb_remove(hb, index, edit);
+		}
+
+		collapse_(root);
+	}
+
 	return false;
 }
 
+HashTable *ht_erase(HashTable *ht, Value k)
+{
+	Value v;
+	uint32_t h = hash_(k);
+
+	if (!ht->nr_entries || !lookup_(&ht->root, h, k, &v, 0))
+		return ht;
+
+	ht = ht_shadow(ht);
+	erase_(&ht->root, h, k, 0, ht->edit);
+	ht->nr_entries--;
+	return ht;
+}
+
 //----------------------------------------------------------------
+// Equality
+
+// Checks every leaf under l is also present in rhs, with an equal value.
+static bool present_(HashEntry *l, HashTable *rhs)
+{
+	Value v;
+	HBlock *hb;
+	unsigned i, nr_entries;
 
+	if (is_leaf(l))
+		return lookup_(&rhs->root, l->hash, l->key, &v, 0) &&
+			equalp(l->val, v);
+
+	hb = l->val.ptr;
+	nr_entries = hb_nr_entries(hb);
+	for (i = 0; i < nr_entries; i++)
+		if (!present_(hb->entries + i, rhs))
+			return false;
+
+	return true;
+}
+
+// As present_(), but r is the entry at the same position in rhs (or NULL).
+// We walk the two tries together for as long as their shapes agree, so
+// blocks they share don't need to be looked at.
+static bool subset_(HashEntry *l, HashEntry *r, HashTable *rhs)
+{
+	if (r && !is_leaf(l) && !is_leaf(r) && l->val.ptr == r->val.ptr)
+		return true;
+
+	if (r && is_leaf(l) && is_leaf(r) && leaf_matches(r, l->hash, l->key))
+		return equalp(l->val, r->val);
+
+	if (r && !is_leaf(l) && !is_collision(l) && !is_leaf(r) && !is_collision(r)) {
+		HBlock *lb = l->val.ptr, *rb = r->val.ptr;
+		uint32_t bits = l->map;
+		unsigned n, i = 0;
+
+		while (bits) {
+			n = __builtin_ctz(bits);
+			bits &= bits - 1;
+
+			if (!subset_(lb->entries + i++,
+				     test_bit(&r->map, n) ?
+				     rb->entries + pop_count(r->map, n) : NULL,
+				     rhs))
+				return false;
+		}
+
+		return true;
+	}
+
+	return present_(l, rhs);
+}
+
+// Since keys are unique, two tables of the same size are equal if every
+// entry in one is in the other.
+bool ht_equalp(HashTable *lhs, HashTable *rhs)
+{
+	if (lhs == rhs)
+		return true;
+
+	if (lhs->nr_entries != rhs->nr_entries)
+		return false;
+
+	if (!lhs->nr_entries)
+		return true;
+
+	return subset_(&lhs->root, &rhs->root, rhs);
+}
+
+//----------------------------------------------------------------
+
+static void walk_(HashEntry *he, HtWalkFn fn, void *context)
+{
+	HBlock *hb;
+	unsigned i, nr_entries;
+
+	if (is_leaf(he)) {
+		fn(context, he->key, he->val);
+		return;
+	}
+
+	hb = he->val.ptr;
+	nr_entries = hb_nr_entries(hb);
+	for (i = 0; i < nr_entries; i++)
+		walk_(hb->entries + i, fn, context);
+}
+
+void ht_walk(HashTable *ht, HtWalkFn fn, void *context)
+{
+	if (ht->nr_entries)
+		walk_(&ht->root, fn, context);
+}
+
+//----------------------------------------------------------------
+
+HashTable *ht_transient_begin(HashTable *ht)
+{
+	ht = mm_clone(ht);
+	ht->edit = new_edit_();
+	return ht;
+}
+
+void ht_transient_end(HashTable *ht)
+{
+	ht->edit = 0;
+}
+
+//----------------------------------------------------------------
@@ -11,11 +11,32 @@ HashTable *ht_empty();
 
 unsigned ht_size(HashTable *ht);
 
-// FIXME: keys can only be fixnum atm.
+// Keys must be hashable; atoms, strings and symbols, and lists and vectors
+// of them.
+bool ht_hashable(Value k);
+
 HashTable *ht_insert(HashTable *ht, Value k, Value v);
 bool ht_lookup(HashTable *ht, Value k, Value *v);
+
+// Returns ht itself if k isn't present.
 HashTable *ht_erase(HashTable *ht, Value k);
 
+// Structural equality, shared blocks aren't compared.
+bool ht_equalp(HashTable *lhs, HashTable *rhs);
+
+// Calls fn for every entry, in no particular order.
+typedef void (*HtWalkFn)(void *context, Value k, Value v);
+void ht_walk(HashTable *ht, HtWalkFn fn, void *context);
+
+/*
+ * Transient mode works like the vector equivalent; within the transient
+ * period inserts and erases update the table in place and return the same
+ * table.  Blocks that are shared with the persistent versions are copied on
+ * first write, after that they're mutated directly.
+ */
+HashTable *ht_transient_begin(HashTable *ht);
+void ht_transient_end(HashTable *ht);
+
 //----------------------------------------------------------------
 
 #endif
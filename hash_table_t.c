@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <time.h>
 
 //----------------------------------------------------------------
 
@@ -87,6 +88,351 @@ static void t_100k()
 	insert_many(1024 * 1024);
 }
 
+static void t_transient()
+{
+	Value v;
+	unsigned i, count = 4096;
+	HashTable *ht = ht_empty(), *ht2, *ht3;
+
+	for (i = 0; i < 16; i++)
+		ht = ht_insert(ht, mk_fixnum(i), mk_fixnum(i));
+
+	ht2 = ht_transient_begin(ht);
+	assert(ht2 != ht);
+	for (i = 16; i < count; i++)
+		assert(ht_insert(ht2, mk_fixnum(i), mk_fixnum(i * i)) == ht2);
+	ht_transient_end(ht2);
+
+	// the original mustn't have been touched
+	assert(ht_size(ht) == 16);
+	for (i = 0; i < 16; i++) {
+		assert(ht_lookup(ht, mk_fixnum(i), &v));
+		assert(equalp(mk_fixnum(i), v));
+	}
+	assert(!ht_lookup(ht, mk_fixnum(16), &v));
+
+	assert(ht_size(ht2) == count);
+	for (i = 16; i < count; i++) {
+		assert(ht_lookup(ht2, mk_fixnum(i), &v));
+		assert(equalp(mk_fixnum(i * i), v));
+	}
+
+	// and once it's ended we're back to being persistent
+	ht3 = ht_insert(ht2, mk_fixnum(count), mk_fixnum(0));
+	assert(ht3 != ht2);
+	assert(!ht_lookup(ht2, mk_fixnum(count), &v));
+	assert(ht_lookup(ht3, mk_fixnum(count), &v));
+}
+
+static void t_100k_transient()
+{
+	Value v;
+	unsigned i, count = 1024 * 1024;
+	HashTable *ht = ht_transient_begin(ht_empty());
+
+	for (i = 0; i < count; i++) {
+		ht_insert(ht, mk_fixnum(i), mk_fixnum(i * i));
+
+		if (!(i % (16 * 1024))) {
+			Value val = mk_ref(ht);
+			mm_garbage_collect(&val, 1);
+		}
+	}
+	ht_transient_end(ht);
+
+	for (i = 0; i < count; i++) {
+		assert(ht_lookup(ht, mk_fixnum(i), &v));
+		assert(equalp(mk_fixnum(i * i), v));
+	}
+}
+
+static void t_replace()
+{
+	Value v;
+	HashTable *ht = ht_empty(), *ht2;
+	unsigned i;
+
+	for (i = 0; i < 64; i++)
+		ht = ht_insert(ht, mk_fixnum(i), mk_fixnum(i));
+
+	ht2 = ht_insert(ht, mk_fixnum(17), mk_fixnum(1234));
+	assert(ht_size(ht2) == 64);
+	assert(ht_lookup(ht2, mk_fixnum(17), &v));
+	assert(equalp(mk_fixnum(1234), v));
+	assert(ht_lookup(ht, mk_fixnum(17), &v));
+	assert(equalp(mk_fixnum(17), v));
+}
+
+// Integers hash to n * GOLDEN_RATIO_32, which is odd, so can be inverted
+// to find an integer with any hash we like.
+static uint32_t unhash_u32_(uint32_t h)
+{
+	uint32_t g = 0x9e3779b9, inv = g;
+	unsigned i;
+
+	for (i = 0; i < 5; i++)
+		inv *= 2 - g * inv;
+
+	return h * inv;
+}
+
+// 0 and () both hash to zero.  A string, an integer and a one element
+// list are built to share a hash too.
+static void t_collisions()
+{
+	Value v;
+	unsigned i;
+	HashTable *ht = ht_empty();
+	Value zero = mk_fixnum(0);
+	Value nil = mk_nil();
+	String *str = mk_string_from_cstr(STRING, "collide");
+	uint32_t n = unhash_u32_(string_hash(str));
+	Value keys[3] = {
+		mk_ref(str),
+		mk_int(n),
+		mk_ref(cons(mk_int(unhash_u32_(n)), mk_nil())),
+	};
+
+	for (i = 1; i < 64; i++)
+		ht = ht_insert(ht, mk_fixnum(i), mk_fixnum(i));
+
+	ht = ht_insert(ht, zero, mk_fixnum(100));
+	ht = ht_insert(ht, nil, mk_fixnum(101));
+	for (i = 0; i < 3; i++)
+		ht = ht_insert(ht, keys[i], mk_fixnum(102 + i));
+	assert(ht_size(ht) == 68);
+
+	assert(ht_lookup(ht, zero, &v) && equalp(v, mk_fixnum(100)));
+	assert(ht_lookup(ht, nil, &v) && equalp(v, mk_fixnum(101)));
+	for (i = 0; i < 3; i++)
+		assert(ht_lookup(ht, keys[i], &v) && equalp(v, mk_fixnum(102 + i)));
+
+	ht = ht_insert(ht, nil, mk_fixnum(201));
+	ht = ht_insert(ht, keys[1], mk_fixnum(202));
+	assert(ht_size(ht) == 68);
+	assert(ht_lookup(ht, nil, &v) && equalp(v, mk_fixnum(201)));
+	assert(ht_lookup(ht, keys[1], &v) && equalp(v, mk_fixnum(202)));
+
+	ht = ht_erase(ht, zero);
+	assert(!ht_lookup(ht, zero, &v));
+	assert(ht_lookup(ht, nil, &v) && equalp(v, mk_fixnum(201)));
+
+	// three down to two, then one, which collapses the collision
+	ht = ht_erase(ht, keys[1]);
+	assert(!ht_lookup(ht, keys[1], &v));
+	assert(ht_lookup(ht, keys[0], &v) && equalp(v, mk_fixnum(102)));
+	assert(ht_lookup(ht, keys[2], &v) && equalp(v, mk_fixnum(104)));
+
+	ht = ht_erase(ht, keys[0]);
+	assert(!ht_lookup(ht, keys[0], &v));
+	assert(ht_lookup(ht, keys[2], &v) && equalp(v, mk_fixnum(104)));
+
+	ht = ht_erase(ht, keys[2]);
+	ht = ht_erase(ht, nil);
+	assert(ht_size(ht) == 63);
+	for (i = 1; i < 64; i++)
+		assert(ht_lookup(ht, mk_fixnum(i), &v) && equalp(v, mk_fixnum(i)));
+}
+
+static void t_equal()
+{
+	unsigned i, count = 1000;
+	HashTable *ht = ht_empty(), *ht2 = ht_empty(), *ht3;
+
+	for (i = 0; i < count; i++)
+		ht = ht_insert(ht, mk_fixnum(i), mk_ref(mk_string_from_cstr(STRING, "foo")));
+
+	// same contents, different insertion order
+	for (i = count; i--; )
+		ht2 = ht_insert(ht2, mk_fixnum(i), mk_ref(mk_string_from_cstr(STRING, "foo")));
+
+	assert(equalp(mk_ref(ht), mk_ref(ht2)));
+
+	// shares nearly everything with ht
+	ht3 = ht_erase(ht_insert(ht, mk_fixnum(count), mk_fixnum(0)), mk_fixnum(count));
+	assert(equalp(mk_ref(ht), mk_ref(ht3)));
+
+	ht3 = ht_insert(ht, mk_fixnum(17), mk_ref(mk_string_from_cstr(STRING, "bar")));
+	assert(!equalp(mk_ref(ht), mk_ref(ht3)));
+
+	ht3 = ht_erase(ht, mk_fixnum(17));
+	assert(!equalp(mk_ref(ht), mk_ref(ht3)));
+	assert(!equalp(mk_ref(ht3), mk_ref(ht)));
+
+	ht3 = ht_insert(ht3, mk_fixnum(count), mk_ref(mk_string_from_cstr(STRING, "foo")));
+	assert(!equalp(mk_ref(ht), mk_ref(ht3)));
+}
+
+static void t_erase_missing()
+{
+	HashTable *ht = ht_insert(ht_empty(), mk_fixnum(1), mk_fixnum(1));
+	assert(ht_erase(ht, mk_fixnum(2)) == ht);
+	assert(ht_erase(ht_empty(), mk_fixnum(2)));
+}
+
+static void t_erase_single()
+{
+	Value v;
+	HashTable *ht = ht_insert(ht_empty(), mk_fixnum(1), mk_fixnum(123));
+	HashTable *ht2 = ht_erase(ht, mk_fixnum(1));
+
+	assert(ht2 != ht);
+	assert(ht_size(ht2) == 0);
+	assert(!ht_lookup(ht2, mk_fixnum(1), &v));
+	assert(ht_lookup(ht, mk_fixnum(1), &v));
+}
+
+static void erase_many(unsigned count)
+{
+	Value v;
+	unsigned i;
+	HashTable *ht = ht_transient_begin(ht_empty()), *full;
+
+	for (i = 0; i < count; i++)
+		ht_insert(ht, mk_fixnum(i), mk_fixnum(i * i));
+	ht_transient_end(ht);
+	full = ht;
+
+	// erase the evens
+	for (i = 0; i < count; i += 2) {
+		ht = ht_erase(ht, mk_fixnum(i));
+		assert(!ht_lookup(ht, mk_fixnum(i), &v));
+
+		if (!(i % (16 * 1024))) {
+			Value vals[] = {mk_ref(ht), mk_ref(full)};
+			mm_garbage_collect(vals, 2);
+		}
+	}
+	assert(ht_size(ht) == count / 2);
+
+	for (i = 0; i < count; i++) {
+		if (i & 1) {
+			assert(ht_lookup(ht, mk_fixnum(i), &v));
+			assert(equalp(mk_fixnum(i * i), v));
+		} else
+			assert(!ht_lookup(ht, mk_fixnum(i), &v));
+
+		// structure sharing mustn't have corrupted the original
+		assert(ht_lookup(full, mk_fixnum(i), &v));
+		assert(equalp(mk_fixnum(i * i), v));
+	}
+
+	// and the odds, leaving a single entry
+	for (i = 1; i < count - 1; i += 2) {
+		ht = ht_erase(ht, mk_fixnum(i));
+
+		if (!((i - 1) % (16 * 1024))) {
+			Value val = mk_ref(ht);
+			mm_garbage_collect(&val, 1);
+		}
+	}
+	assert(ht_size(ht) == 1);
+
+	// which should have been collapsed all the way back into the root
+	assert(get_type(ht->root.val) != HBLOCK);
+	assert(ht_lookup(ht, mk_fixnum(count - 1), &v));
+
+	ht = ht_erase(ht, mk_fixnum(count - 1));
+	assert(ht_size(ht) == 0);
+}
+
+static void t_erase_single_level()
+{
+	erase_many(16);
+}
+
+static void t_erase_100k()
+{
+	erase_many(128 * 1024);
+}
+
+static void t_erase_transient()
+{
+	Value v;
+	unsigned i, count = 4096;
+	HashTable *ht = ht_empty(), *ht2;
+
+	for (i = 0; i < count; i++)
+		ht = ht_insert(ht, mk_fixnum(i), mk_fixnum(i));
+
+	ht2 = ht_transient_begin(ht);
+	for (i = 0; i < count; i += 2)
+		assert(ht_erase(ht2, mk_fixnum(i)) == ht2);
+	ht_transient_end(ht2);
+
+	assert(ht_size(ht) == count);
+	assert(ht_size(ht2) == count / 2);
+	for (i = 0; i < count; i++) {
+		assert(ht_lookup(ht, mk_fixnum(i), &v));
+		assert(ht_lookup(ht2, mk_fixnum(i), &v) == !!(i & 1));
+	}
+}
+
+//----------------------------------------------------------------
+// Benchmarks
+
+static void gc_table_(HashTable *ht)
+{
+	Value val = mk_ref(ht);
+	mm_garbage_collect(&val, 1);
+}
+
+static Value fixnum_key_(unsigned i)
+{
+	return mk_fixnum(i);
+}
+
+// The cost of building the string is included in the timings.
+static Value string_key_(unsigned i)
+{
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "vg%u-lv%u", i % 97, i);
+	return mk_ref(mk_string_from_cstr(STRING, buffer));
+}
+
+static void insert_keys_(unsigned count, Value (*key)(unsigned), bool transient)
+{
+	unsigned i;
+	HashTable *ht = ht_empty();
+
+	if (transient)
+		ht = ht_transient_begin(ht);
+
+	for (i = 0; i < count; i++) {
+		ht = ht_insert(ht, key(i), mk_fixnum(i));
+
+		if (!(i % (32 * 1024)))
+			gc_table_(ht);
+	}
+
+	if (transient)
+		ht_transient_end(ht);
+
+	assert(ht_size(ht) == count);
+}
+
+#define BENCH_COUNT (1024 * 1024)
+
+static void b_fixnum()
+{
+	insert_keys_(BENCH_COUNT, fixnum_key_, false);
+}
+
+static void b_fixnum_transient()
+{
+	insert_keys_(BENCH_COUNT, fixnum_key_, true);
+}
+
+static void b_string()
+{
+	insert_keys_(BENCH_COUNT, string_key_, false);
+}
+
+static void b_string_transient()
+{
+	insert_keys_(BENCH_COUNT, string_key_, true);
+}
+
 //----------------------------------------------------------------
 
 static size_t total_allocated_()
@@ -115,15 +461,55 @@ static void run(const char *name, void (*fn)())
 	fprintf(stderr, "%llu\n", (unsigned long long) (after - before));
 }
 
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void bench(const char *name, void (*fn)())
+{
+	double before, after;
+
+	fprintf(stderr, "%s", name);
+	indent(24 - strlen(name));
+	fprintf(stderr, "... ");
+
+	// Start with a clean heap so earlier runs don't skew the numbers.
+	mm_garbage_collect(NULL, 0);
+	before = now_();
+
+	fn();
+
+	after = now_();
+	fprintf(stderr, "%.0f inserts/sec\n", BENCH_COUNT / (after - before));
+}
+
 int main(int argc, const char *argv[])
 {
-	mm_init(96 * 1024 * 1024);
+	mm_init(256 * 1024 * 1024);
 	run("empty", t_empty);
 	run("single entry", t_single_entry);
 	run("two entries", t_two_entries);
 	run("single level", t_single_level);
 	run("two levels", t_two_levels);
 	run("100k", t_100k);
+	run("transient", t_transient);
+	run("100k transient", t_100k_transient);
+	run("replace", t_replace);
+	run("collisions", t_collisions);
+	run("equal", t_equal);
+	run("erase missing", t_erase_missing);
+	run("erase single", t_erase_single);
+	run("erase single level", t_erase_single_level);
+	run("erase 100k", t_erase_100k);
+	run("erase transient", t_erase_transient);
+
+	bench("fixnum inserts", b_fixnum);
+	bench("fixnum inserts (trans)", b_fixnum_transient);
+	bench("string inserts", b_string);
+	bench("string inserts (trans)", b_string_transient);
 	mm_exit();
 
 	return 0;
@@ -0,0 +1,481 @@
+#include "image.h"
+
+#include "cons.h"
+#include "equality.h"
+#include "eval.h"
+#include "error.h"
+#include "hash_table.h"
+#include "string_type.h"
+#include "symbol.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//----------------------------------------------------------------
+// Image files
+//
+// Every field is a 32 bit word, in host byte order, so images are only
+// portable between machines of the same endianness.  Byte strings are a
+// length followed by the bytes, padded to a word.
+//
+//   header
+//   symbols:   nr_symbols x byte string
+//   constants: nr_constants x encoded value
+//   globals:   nr_globals x (symbol index, global index)
+//   thunks:    nr_thunks x byte string
+//
+// Loading interns the symbols and decodes the constants.  Strings become
+// slices of the mapped file, and the thunks run straight from it, so very
+// little is copied.
+
+#define IMAGE_MAGIC "DMXI"
+
+// Bump this if you change the encoding, or the bytecode.
+#define IMAGE_VERSION 8
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t nr_symbols;
+	uint32_t nr_constants;
+	uint32_t nr_globals;
+	uint32_t nr_thunks;
+	uint32_t nr_call_sites;	// the thunks' calls index the vm's caches
+} ImageHeader;
+
+// Values are a code followed by a payload.
+typedef enum {
+	IC_FIXNUM,	// value
+	IC_NIL,
+	IC_STRING,	// byte string
+	IC_SYMBOL,	// symbol index
+	IC_LIST,	// nr elements, elements, tail
+	IC_VECTOR,	// nr elements, elements
+	IC_PRIMITIVE,	// symbol index of the name
+	IC_INT64,	// low word, high word
+} ImageCode;
+
+//----------------------------------------------------------------
+// Writing
+
+typedef struct {
+	char *b, *e, *alloc_e;
+} Buffer;
+
+static void buf_append_(Buffer *buf, const void *data, size_t len)
+{
+	if (buf->e + len > buf->alloc_e) {
+		size_t used = buf->e - buf->b;
+		size_t size = 2 * (buf->alloc_e - buf->b) + len + 256;
+		char *new = realloc(buf->b, size);
+		if (!new)
+			error("out of memory");
+
+		buf->b = new;
+		buf->e = new + used;
+		buf->alloc_e = new + size;
+	}
+
+	memcpy(buf->e, data, len);
+	buf->e += len;
+}
+
+static void buf_u32_(Buffer *buf, uint32_t n)
+{
+	buf_append_(buf, &n, sizeof(n));
+}
+
+static void buf_bytes_(Buffer *buf, const void *b, const void *e)
+{
+	static const char zeroes[4] = {0};
+	uint32_t len = e - b;
+
+	buf_u32_(buf, len);
+	buf_append_(buf, b, len);
+	buf_append_(buf, zeroes, (4 - (len & 3)) & 3);
+}
+
+typedef struct {
+	ImageHeader header;
+	Buffer symbols, constants, globals, thunks;
+
+	// symbol -> index
+	HashTable *sym_indexes;
+} ImageWriter;
+
+static uint32_t iw_symbol_(ImageWriter *iw, String *sym)
+{
+	Value v;
+
+	if (ht_lookup(iw->sym_indexes, mk_ref(sym), &v))
+		return as_fixnum(v);
+
+	iw->sym_indexes = ht_insert(iw->sym_indexes, mk_ref(sym),
+				    mk_fixnum(iw->header.nr_symbols));
+	buf_bytes_(&iw->symbols, sym->b, sym->e);
+	return iw->header.nr_symbols++;
+}
+
+static void iw_value_(ImageWriter *iw, Buffer *buf, Value v)
+{
+	unsigned i, n;
+
+	switch (get_type(v)) {
+	case FIXNUM:
+		buf_u32_(buf, IC_FIXNUM);
+		buf_u32_(buf, as_fixnum(v));
+		break;
+
+	case INT64: {
+		uint64_t n = as_int(v);
+		buf_u32_(buf, IC_INT64);
+		buf_u32_(buf, n);
+		buf_u32_(buf, n >> 32);
+		break;
+	}
+
+	case NIL:
+		buf_u32_(buf, IC_NIL);
+		break;
+
+	case STRING:
+	case ROPE: {
+		String *str = as_flat_string(v);
+		buf_u32_(buf, IC_STRING);
+		buf_bytes_(buf, str->b, str->e);
+		break;
+	}
+
+	case SYMBOL:
+		buf_u32_(buf, IC_SYMBOL);
+		buf_u32_(buf, iw_symbol_(iw, v.ptr));
+		break;
+
+	case CONS: {
+		Value tail = v;
+
+		for (n = 0; is_cons(tail); n++)
+			tail = cdr(tail);
+
+		buf_u32_(buf, IC_LIST);
+		buf_u32_(buf, n);
+		for (; is_cons(v); v = cdr(v))
+			iw_value_(iw, buf, car(v));
+		iw_value_(iw, buf, tail);
+		break;
+	}
+
+	case VECTOR:
+		n = v_size(v.ptr);
+		buf_u32_(buf, IC_VECTOR);
+		buf_u32_(buf, n);
+		for (i = 0; i < n; i++)
+			iw_value_(iw, buf, v_ref(v.ptr, i));
+		break;
+
+	case PRIMITIVE:
+		buf_u32_(buf, IC_PRIMITIVE);
+		buf_u32_(buf, iw_symbol_(iw, mk_symbol_cstr(((Primitive *) v.ptr)->name)));
+		break;
+
+	default:
+		error("can't save this type of constant in an image");
+	}
+}
+
+static void iw_global_(void *context, Value k, Value v)
+{
+	ImageWriter *iw = context;
+
+	buf_u32_(&iw->globals, iw_symbol_(iw, k.ptr));
+	buf_u32_(&iw->globals, as_fixnum(v));
+	iw->header.nr_globals++;
+}
+
+static void write_buffer_(FILE *fp, Buffer *buf, const char *path)
+{
+	if (fwrite(buf->b, 1, buf->e - buf->b, fp) != buf->e - buf->b)
+		error("couldn't write '%s'", path);
+	free(buf->b);
+}
+
+void image_write(const char *path, StaticEnv *r, Vector *thunks)
+{
+	unsigned i;
+	FILE *fp;
+	ImageWriter iw;
+
+	memset(&iw, 0, sizeof(iw));
+	memcpy(iw.header.magic, IMAGE_MAGIC, sizeof(iw.header.magic));
+	iw.header.version = IMAGE_VERSION;
+	iw.sym_indexes = ht_transient_begin(ht_empty());
+
+	iw.header.nr_constants = v_size(r->constants);
+	for (i = 0; i < iw.header.nr_constants; i++)
+		iw_value_(&iw, &iw.constants, v_ref(r->constants, i));
+
+	ht_walk(r->globals_r, iw_global_, &iw);
+
+	iw.header.nr_call_sites = r->nr_call_sites;
+	iw.header.nr_thunks = v_size(thunks);
+	for (i = 0; i < iw.header.nr_thunks; i++) {
+		Thunk *t = v_ref(thunks, i).ptr;
+		buf_bytes_(&iw.thunks, t->b, t->e);
+	}
+	ht_transient_end(iw.sym_indexes);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		error("couldn't open '%s'", path);
+
+	if (fwrite(&iw.header, sizeof(iw.header), 1, fp) != 1)
+		error("couldn't write '%s'", path);
+
+	write_buffer_(fp, &iw.symbols, path);
+	write_buffer_(fp, &iw.constants, path);
+	write_buffer_(fp, &iw.globals, path);
+	write_buffer_(fp, &iw.thunks, path);
+
+	if (fclose(fp))
+		error("couldn't write '%s'", path);
+}
+
+//----------------------------------------------------------------
+// Loading
+
+typedef struct {
+	StaticEnv *r;
+	String *file;
+	const char *b, *e;
+
+	uint32_t nr_symbols;
+	Value *symbols;
+} ImageReader;
+
+static uint32_t ir_u32_(ImageReader *ir)
+{
+	uint32_t n;
+
+	if (ir->e - ir->b < sizeof(n))
+		error("image is truncated");
+
+	memcpy(&n, ir->b, sizeof(n));
+	ir->b += sizeof(n);
+	return n;
+}
+
+static void ir_bytes_(ImageReader *ir, const char **b, const char **e)
+{
+	uint32_t len = ir_u32_(ir);
+	uint32_t padded = len + ((4 - (len & 3)) & 3);
+
+	if (ir->e - ir->b < padded)
+		error("image is truncated");
+
+	*b = ir->b;
+	*e = ir->b + len;
+	ir->b += padded;
+}
+
+static Value ir_symbol_(ImageReader *ir)
+{
+	uint32_t i = ir_u32_(ir);
+
+	if (i >= ir->nr_symbols)
+		error("image refers to a bad symbol");
+
+	return ir->symbols[i];
+}
+
+static Value ir_value_(ImageReader *ir)
+{
+	Value v;
+	uint32_t i, n;
+	const char *b, *e;
+
+	switch (ir_u32_(ir)) {
+	case IC_FIXNUM:
+		return mk_fixnum((int32_t) ir_u32_(ir));
+
+	case IC_INT64: {
+		uint64_t n = ir_u32_(ir);
+		n |= (uint64_t) ir_u32_(ir) << 32;
+		return mk_int(n);
+	}
+
+	case IC_NIL:
+		return mk_nil();
+
+	case IC_STRING:
+		ir_bytes_(ir, &b, &e);
+		return mk_ref(string_slice(ir->file, b - ir->file->b,
+					   e - ir->file->b));
+
+	case IC_SYMBOL:
+		return ir_symbol_(ir);
+
+	case IC_LIST: {
+		ListBuilder lb;
+
+		n = ir_u32_(ir);
+		lb_init(&lb);
+		for (i = 0; i < n; i++)
+			lb_append(&lb, ir_value_(ir));
+
+		v = ir_value_(ir);
+		if (!is_nil(v)) {
+			if (!n)
+				error("image has a bad list");
+			lb.tail->cdr = v;
+		}
+
+		return lb_get(&lb);
+	}
+
+	case IC_VECTOR: {
+		Vector *vec = v_transient_begin(v_empty());
+
+		n = ir_u32_(ir);
+		for (i = 0; i < n; i++)
+			vec = v_push(vec, ir_value_(ir));
+		v_transient_end(vec);
+
+		return mk_ref(vec);
+	}
+
+	case IC_PRIMITIVE:
+		v = ir_symbol_(ir);
+		if (!ht_lookup(ir->r->primitives_r, v, &v))
+			error("image uses a primitive that isn't defined");
+
+		return v_ref(ir->r->constants, as_fixnum(v));
+
+	default:
+		error("image has a bad constant");
+	}
+
+	return mk_nil();
+}
+
+// Constants already in r (typically just the primitives) must match the
+// image, the rest get appended.
+static void ir_constants_(ImageReader *ir, uint32_t nr_constants)
+{
+	Value v;
+	uint32_t i, nr_existing = v_size(ir->r->constants);
+
+	if (nr_existing > nr_constants)
+		error("image doesn't match the environment");
+
+	for (i = 0; i < nr_constants; i++) {
+		v = ir_value_(ir);
+		if (i < nr_existing) {
+			if (!equalp(v, v_ref(ir->r->constants, i)))
+				error("image doesn't match the environment");
+		} else
+			r_push_constant(ir->r, v);
+	}
+}
+
+// Indexes the environment already uses can only be for the same symbols,
+// or two globals would share a slot.  The rest have to be the next ones
+// along, each used once, since new globals are given ht_size(globals_r).
+static void ir_globals_(ImageReader *ir, uint32_t nr_globals)
+{
+	uint32_t i, index, nr_existing = ht_size(ir->r->globals_r), nr_new = 0;
+	Value sym, v;
+	bool *used = calloc(nr_globals + 1, sizeof(*used));
+
+	if (!used)
+		error("out of memory");
+
+	ir->r->globals_r = ht_transient_begin(ir->r->globals_r);
+	for (i = 0; i < nr_globals; i++) {
+		sym = ir_symbol_(ir);
+		index = ir_u32_(ir);
+
+		if (ht_lookup(ir->r->globals_r, sym, &v)) {
+			if (as_fixnum(v) != index)
+				error("image doesn't match the environment");
+
+		} else {
+			if (index < nr_existing || index - nr_existing >= nr_globals ||
+			    used[index - nr_existing])
+				error("image doesn't match the environment");
+
+			used[index - nr_existing] = true;
+			nr_new++;
+			ir->r->globals_r = ht_insert(ir->r->globals_r, sym,
+						     mk_fixnum(index));
+		}
+	}
+	ht_transient_end(ir->r->globals_r);
+
+	for (i = 0; i < nr_new; i++)
+		if (!used[i])
+			error("image doesn't match the environment");
+	free(used);
+}
+
+bool is_image(String *file)
+{
+	return string_len(file) >= sizeof(ImageHeader) &&
+		!memcmp(file->b, IMAGE_MAGIC, 4);
+}
+
+Vector *image_load(StaticEnv *r, String *file)
+{
+	uint32_t i;
+	ImageHeader header;
+	ImageReader ir;
+	Vector *thunks;
+	const char *b, *e;
+
+	if (!is_image(file))
+		error("not an image");
+
+	memcpy(&header, file->b, sizeof(header));
+	if (header.version != IMAGE_VERSION)
+		error("image is version %u, expected %u",
+		      header.version, IMAGE_VERSION);
+
+	ir.r = r;
+	ir.file = file;
+	ir.b = file->b + sizeof(header);
+	ir.e = file->e;
+
+	ir.nr_symbols = header.nr_symbols;
+	ir.symbols = malloc(sizeof(*ir.symbols) * header.nr_symbols);
+	if (!ir.symbols && header.nr_symbols)
+		error("out of memory");
+
+	for (i = 0; i < header.nr_symbols; i++) {
+		ir_bytes_(&ir, &b, &e);
+		ir.symbols[i] = mk_ref(mk_symbol(b, e));
+	}
+
+	ir_constants_(&ir, header.nr_constants);
+	ir_globals_(&ir, header.nr_globals);
+	if (r->nr_call_sites < header.nr_call_sites)
+		r->nr_call_sites = header.nr_call_sites;
+
+	thunks = v_transient_begin(v_empty());
+	for (i = 0; i < header.nr_thunks; i++) {
+		Thunk *t = mm_alloc(THUNK, sizeof(*t));
+
+		ir_bytes_(&ir, &b, &e);
+		t->b = (unsigned char *) b;
+		t->e = t->alloc_e = (unsigned char *) e;
+		if (!verify_thunk(r, t))
+			error("thunk %u of the image doesn't verify", i);
+		thunks = v_push(thunks, mk_ref(t));
+	}
+	v_transient_end(thunks);
+
+	free(ir.symbols);
+	return thunks;
+}
+
+//----------------------------------------------------------------
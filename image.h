@@ -0,0 +1,26 @@
+#ifndef DMEXEC_IMAGE_H
+#define DMEXEC_IMAGE_H
+
+#include "env.h"
+
+//----------------------------------------------------------------
+// An image holds compiled top level forms, along with the constants and
+// globals they refer to, so a library can be run without recompiling it.
+
+// thunks is a vector of the compiled forms, in the order they should be run.
+void image_write(const char *path, StaticEnv *r, Vector *thunks);
+
+// file should come from mk_string_from_file().
+bool is_image(String *file);
+
+// Restores the image's constants and globals into r, which must have been
+// set up with the same primitives.  The image keeps its indexes, so load it
+// before anything else has been defined in r, a mismatch is an error.
+// Returns the thunks, which run straight from the file, so keep it live
+// until you're done with them.  Each thunk is verified, a bad one is an
+// error.
+Vector *image_load(StaticEnv *r, String *file);
+
+//----------------------------------------------------------------
+
+#endif
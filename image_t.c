@@ -0,0 +1,277 @@
+#include "equality.h"
+#include "eval.h"
+#include "hash_table.h"
+#include "image.h"
+#include "primitives.h"
+#include "symbol.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------
+
+// Tests that expect an error set this, and error() jumps back to it.
+static jmp_buf *on_error_;
+
+void error(const char *format, ...)
+{
+	va_list ap;
+
+	if (on_error_)
+		longjmp(*on_error_, 1);
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static StaticEnv *new_env_()
+{
+	StaticEnv *r = r_alloc();
+	def_basic_primitives(r);
+	return r;
+}
+
+static Vector *compile_source_(StaticEnv *r, const char *src)
+{
+	String input;
+	TokenStream ts;
+	Value v;
+	Vector *thunks = v_empty();
+
+	string_tmp(src, &input);
+	stream_init(&input, &ts);
+	while (read_sexp(&ts, &v))
+		thunks = v_push(thunks, mk_ref(compile_toplevel(r, v)));
+
+	return thunks;
+}
+
+static bool thunks_equal_(Vector *lhs, Vector *rhs)
+{
+	unsigned i;
+
+	if (v_size(lhs) != v_size(rhs))
+		return false;
+
+	for (i = 0; i < v_size(lhs); i++) {
+		Thunk *l = v_ref(lhs, i).ptr, *r = v_ref(rhs, i).ptr;
+		if (l->e - l->b != r->e - r->b || memcmp(l->b, r->b, l->e - l->b))
+			return false;
+	}
+
+	return true;
+}
+
+// Each environment has its own primitives, so compare those by name.
+static bool constants_equal_(Vector *lhs, Vector *rhs)
+{
+	unsigned i;
+
+	if (v_size(lhs) != v_size(rhs))
+		return false;
+
+	for (i = 0; i < v_size(lhs); i++) {
+		Value l = v_ref(lhs, i), r = v_ref(rhs, i);
+
+		if (get_type(l) == PRIMITIVE && get_type(r) == PRIMITIVE) {
+			if (strcmp(((Primitive *) l.ptr)->name, ((Primitive *) r.ptr)->name))
+				return false;
+
+		} else if (!equalp(l, r))
+			return false;
+	}
+
+	return true;
+}
+
+// Round trips the source through an image, checking the loaded environment
+// matches the one it was compiled in.
+static void check_round_trip_(const char *src, double *compile_time,
+			      double *load_time)
+{
+	char path[] = "/tmp/image_t.XXXXXX";
+	int fd = mkstemp(path);
+	double t0, t1, t2;
+	StaticEnv *r1, *r2;
+	Vector *thunks1, *thunks2;
+	String *file;
+
+	assert(fd >= 0);
+	close(fd);
+
+	t0 = now_();
+	r1 = new_env_();
+	thunks1 = compile_source_(r1, src);
+	t1 = now_();
+	image_write(path, r1, thunks1);
+
+	t2 = now_();
+	r2 = new_env_();
+	file = mk_string_from_file(path);
+	thunks2 = image_load(r2, file);
+	if (load_time)
+		*load_time = now_() - t2;
+	if (compile_time)
+		*compile_time = t1 - t0;
+	unlink(path);
+
+	assert(constants_equal_(r1->constants, r2->constants));
+	assert(ht_equalp(r1->globals_r, r2->globals_r));
+	assert(thunks_equal_(thunks1, thunks2));
+}
+
+static void t_round_trip()
+{
+	check_round_trip_("(+ 1 2)\n"
+			  "(set! foo \"a string constant, long enough to be a slice\")\n"
+			  "(quote (a b (c \"d\") -1 ()))\n"
+			  "(lambda (x) (+ x bar))\n"
+			  "(if foo (+ foo 1) (string-append \"a\" \"b\"))\n",
+			  NULL, NULL);
+}
+
+static void t_empty()
+{
+	check_round_trip_("", NULL, NULL);
+}
+
+// The image's add3 would get the slot foo already has.
+static String *write_image_(StaticEnv *r, Vector *thunks)
+{
+	char path[] = "/tmp/image_t.XXXXXX";
+	int fd = mkstemp(path);
+	String *file;
+
+	assert(fd >= 0);
+	close(fd);
+	image_write(path, r, thunks);
+	file = mk_string_from_file(path);
+	unlink(path);
+
+	return file;
+}
+
+// Returns false if loading the image is an error.
+static bool loads_(StaticEnv *r, String *file)
+{
+	jmp_buf env;
+	bool ok = true;
+
+	on_error_ = &env;
+	if (!setjmp(env))
+		image_load(r, file);
+	else
+		ok = false;
+	on_error_ = NULL;
+
+	return ok;
+}
+
+// The image's add3 would get the slot foo already has.
+static void t_existing_global()
+{
+	StaticEnv *r1 = new_env_(), *r2 = new_env_();
+	String *file = write_image_(r1, compile_source_(r1, "(set! add3 (lambda (x) (+ x 3)))"));
+
+	compile_source_(r2, "(set! foo +)");
+	assert(!loads_(r2, file));
+
+	// an environment with nothing defined is fine
+	assert(loads_(new_env_(), file));
+}
+
+// Global indexes have to be used once each, with no gaps.
+static void t_bad_global_indexes()
+{
+	StaticEnv *r = new_env_();
+	Vector *thunks = compile_source_(r, "(set! a 1) (set! b 2)");
+	Value b = mk_ref(mk_symbol_cstr("b"));
+	HashTable *globals = r->globals_r;
+
+	assert(loads_(new_env_(), write_image_(r, thunks)));
+
+	r->globals_r = ht_insert(globals, b, mk_fixnum(0));
+	assert(!loads_(new_env_(), write_image_(r, v_empty())));
+
+	r->globals_r = ht_insert(globals, b, mk_fixnum(2));
+	assert(!loads_(new_env_(), write_image_(r, v_empty())));
+}
+
+static void t_bad_images()
+{
+	String tmp;
+
+	string_tmp("(+ 1 2)", &tmp);
+	assert(!is_image(&tmp));
+
+	string_tmp("DMX", &tmp);
+	assert(!is_image(&tmp));
+}
+
+//----------------------------------------------------------------
+// Load benchmark
+//
+// Compiling a library from source vs loading its image.
+
+#define NR_FORMS 10000
+
+static void bench_load()
+{
+	unsigned i;
+	size_t len = 0, max = NR_FORMS * 128;
+	char *src = malloc(max);
+	double compile_time, load_time;
+
+	assert(src);
+	for (i = 0; i < NR_FORMS; i++)
+		len += snprintf(src + len, max - len,
+				"(set! pool-%u (lambda (dev) (+ dev %u)))\n", i, i);
+
+	check_round_trip_(src, &compile_time, &load_time);
+	fprintf(stderr, "%u forms: compile %.1fms, image load %.1fms\n",
+		NR_FORMS, compile_time * 1000, load_time * 1000);
+	free(src);
+}
+
+//----------------------------------------------------------------
+
+static void run(const char *name, void (*fn)())
+{
+	fprintf(stderr, "%s", name);
+	fprintf(stderr, "%*s... ", (int) (24 - strlen(name)), "");
+	fn();
+	fprintf(stderr, "ok\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	mm_init(256 * 1024 * 1024);
+	run("round trip", t_round_trip);
+	run("empty", t_empty);
+	run("bad images", t_bad_images);
+	run("existing global", t_existing_global);
+	run("bad global indexes", t_bad_global_indexes);
+
+	bench_load();
+	mm_exit();
+
+	return 0;
+}
+
+//----------------------------------------------------------------
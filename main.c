@@ -15,6 +15,7 @@
 #include <readline/history.h>
 
 #include "eval.h"
+#include "image.h"
 #include "namespace.h"
 #include "primitives.h"
 #include "string_type.h"
@@ -98,34 +99,58 @@ void error(const char *format, ...)
 
 	throw();
 }
-#if 0
-static void load_file(VM *vm, const char *path)
+
+static void run_image(StaticEnv *r, VM *vm, String *file)
 {
-	int fd;
-	struct stat info;
-	String input;
-	Array *code;
+	unsigned i;
+	Vector *thunks = image_load(r, file);
+
+	for (i = 0; i < v_size(thunks); i++)
+		eval_thunk(r, vm, v_ref(thunks, i).ptr);
+}
 
-	if (stat(path, &info) < 0)
-		error("couldn't stat '%s'\n", path);
+// The file is mapped rather than read, and the strings we read share its
+// bytes.  It stays mapped whilst any of them are live.  Files may be source
+// or images.
+static void load_file(StaticEnv *r, VM *vm, const char *path)
+{
+	Value file = mk_ref(mk_string_from_file(path));
+	String input = *((String *) file.ptr);
+	TokenStream stream;
+	Value v;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		error("couldn't open '%s'\n", path);
+	mm_add_root(&file);
+	if (is_image(file.ptr))
+		run_image(r, vm, file.ptr);
 
-	input.b = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!input.b)
-		error("couldn't mmap '%s'\n", path);
+	else {
+		stream_init_shared(file.ptr, &input, &stream);
+		while (read_sexp(&stream, &v))
+			eval(r, vm, v);
+	}
+	mm_rm_root(&file);
+}
 
-	input.e = input.b + info.st_size;
+// Compiles the source files into an image, without running them.
+static void compile_files(StaticEnv *r, const char *out, int argc, char **argv)
+{
+	int i;
+	Value file, v;
+	String input;
+	TokenStream stream;
+	Vector *thunks = v_empty();
+
+	for (i = 0; i < argc; i++) {
+		file = mk_ref(mk_string_from_file(argv[i]));
+		input = *((String *) file.ptr);
+		stream_init_shared(file.ptr, &input, &stream);
+		while (read_sexp(&stream, &v))
+			thunks = v_push(thunks, mk_ref(compile_toplevel(r, v)));
+	}
 
-	global_vm = vm;
-	code = _read(&input);
-	eval(vm, code);
-	munmap(input.b, info.st_size);
-	close(fd);
+	image_write(out, r, thunks);
 }
-#endif
+
 // Read a string, and return a pointer to it.  Returns NULL on EOF.
 const char *rl_gets()
 {
@@ -146,50 +171,153 @@ const char *rl_gets()
 	return line_read;
 }
 
+typedef struct {
+	StaticEnv *r;
+	VM *vm;
+	bool print;
+} EvalContext;
+
+static void eval_datum(void *context, Value v)
+{
+	EvalContext *ec = context;
+
+	v = eval(ec->r, ec->vm, v);
+	if (ec->print) {
+		print(stdout, v);
+		printf("\n");
+	}
+}
+
+// Forms may span several lines.
 static int repl(StaticEnv *r, VM *vm)
 {
 	const char *buffer;
-	TokenStream stream;
-	String input;
-	Value v;
+	PushReader pr;
+	EvalContext ec = {r, vm, true};
 
 	//global_vm = vm;
+	pr_init(&pr);
 	for (;;) {
 		buffer = rl_gets();
 		if (!buffer)
 			break;
 
-		input.b = buffer;
-		input.e = buffer + strlen(buffer);
-		stream_init(&input, &stream);
-		while (read_sexp(&stream, &v)) {
-			print(stdout, eval(r, vm, v));
-			printf("\n");
-		}
+		pr_feed(&pr, buffer, buffer + strlen(buffer), eval_datum, &ec);
+		pr_feed(&pr, "\n", "\n" + 1, eval_datum, &ec);
 	}
+	pr_finish(&pr, eval_datum, &ec);
+	pr_exit(&pr);
 
 	return 0;
 }
 
+// For pipes and sockets.  Each form is evaluated as soon as it's been read,
+// and we only hold on to one chunk and the form in progress.
+#define CHUNK_LEN 4096
+
+static void load_fd(StaticEnv *r, VM *vm, int fd)
+{
+	ssize_t n;
+	char buffer[CHUNK_LEN];
+	PushReader pr;
+	EvalContext ec = {r, vm, false};
+
+	pr_init(&pr);
+	for (;;) {
+		n = read(fd, buffer, sizeof(buffer));
+		if (n < 0)
+			error("read failed");
+
+		if (!n)
+			break;
+
+		pr_feed(&pr, buffer, buffer + n, eval_datum, &ec);
+	}
+	pr_finish(&pr, eval_datum, &ec);
+	pr_exit(&pr);
+}
+
+static StaticEnv *init_env(void)
+{
+	StaticEnv *r = r_alloc();
+	def_basic_primitives(r);
+	//def_dm_primitives(&r);
+	return r;
+}
+
+// The roots of a snapshot are the environment, and the values of the
+// globals.
+static StaticEnv *restore_env(const char *path, VM *vm)
+{
+	Value roots[2];
+
+	if (mm_restore(path, roots, 2)) {
+		vm_set_globals(vm, roots[1].ptr);
+		return roots[0].ptr;
+	}
+
+	fprintf(stderr, "couldn't restore '%s', starting from scratch\n", path);
+	return init_env();
+}
+
 int main(int argc, char **argv)
 {
+	int i;
 	VM vm;
 	StaticEnv *r;
+	Value roots[2];
 
 	mm_init(64 * 1024 * 1024);
-	r = r_alloc();
-//	init_vm(&vm);
-	def_basic_primitives(r);
-	//def_dm_primitives(&r);
+	vm_init(&vm);
 
 	//load_file(&vm, "prelude.dm");
-#if 0
-	if (argc > 1)
-		for (i = 1; i < argc; i++)
-			load_file(&vm, argv[i]);
+	if (argc > 1 && !strcmp(argv[1], "--compile")) {
+		if (argc < 4)
+			error("usage: dmexec --compile <image> <source>...");
+
+		compile_files(init_env(), argv[2], argc - 3, argv + 3);
+
+	} else if (argc > 1 && !strcmp(argv[1], "--snapshot")) {
+		if (argc < 3)
+			error("usage: dmexec --snapshot <snapshot> [<file>...]");
+
+		r = init_env();
+		for (i = 3; i < argc; i++)
+			load_file(r, &vm, argv[i]);
+
+		roots[0] = mk_ref(r);
+		roots[1] = mk_ref(vm_globals(&vm));
+		mm_snapshot(argv[2], roots, 2);
+
+	} else if (argc > 1 && !strcmp(argv[1], "--from-snapshot")) {
+		if (argc < 3)
+			error("usage: dmexec --from-snapshot <snapshot> [<file>...]");
+
+		r = restore_env(argv[2], &vm);
+		for (i = 3; i < argc; i++)
+			load_file(r, &vm, argv[i]);
+
+		if (argc == 3) {
+			if (isatty(0))
+				repl(r, &vm);
+			else
+				load_fd(r, &vm, 0);
+		}
+
+	} else if (argc > 1) {
+		r = init_env();
+		for (i = 1; i < argc; i++) {
+			if (!strcmp(argv[i], "-"))
+				load_fd(r, &vm, 0);
+			else
+				load_file(r, &vm, argv[i]);
+		}
+
+	} else if (!isatty(0))
+		load_fd(init_env(), &vm, 0);
 	else
-#endif
-	repl(r, &vm);
+		repl(init_env(), &vm);
+	vm_exit(&vm);
 	mm_exit();
 
 	return 0;
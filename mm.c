@@ -1,17 +1,22 @@
 #include "mm.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <gc.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "list.h"
 #include "types.h"
 #include "string_type.h"
+#include "symbol.h"
+#include "utils.h"
 
 //----------------------------------------------------------------
 // Memory manager
@@ -162,10 +167,25 @@ static void walk_one_(Traversal *tv, Value v)
 	switch (get_type(v)) {
 	case PRIMITIVE:
 	case CLOSURE:
-	case STRING:
 	case SYMBOL:
 		break;
 
+	case STRING: {
+		String *str = v.ptr;
+		if (str->owner)
+			mark_value_(tv, mk_ref(str->owner));
+		break;
+	}
+
+	case ROPE: {
+		Rope *rope = v.ptr;
+		mark_value_(tv, rope->left);
+		mark_value_(tv, rope->right);
+		if (rope->flat)
+			mark_value_(tv, mk_ref(rope->flat));
+		break;
+	}
+
 	case CONS: {
 		Cons *cell = v.ptr;
 		mark_value_(tv, cell->car);
@@ -200,10 +220,10 @@ static void walk_one_(Traversal *tv, Value v)
 
 	case HBLOCK: {
 		unsigned i;
-		HBlock hb = v.ptr;
-		unsigned nr_entries = get_obj_size(hb) / sizeof(HashEntry);
+		HBlock *hb = v.ptr;
+		unsigned nr_entries = hb_nr_entries(hb);
 		for (i = 0; i < nr_entries; i++)
-			walk_he_(tv, hb + i);
+			walk_he_(tv, hb->entries + i);
 		break;
 	}
 
@@ -211,6 +231,7 @@ static void walk_one_(Traversal *tv, Value v)
 	case STATIC_ENV:
 	case THUNK:
 	case RAW:
+	case INT64:
 	case FIXNUM:
 	     break;
 	}
@@ -245,6 +266,158 @@ Slab generic_1024_slab_;
 Slab cons_slab_;
 Slab vblock_slab_;
 
+//----------------------------------------------------------------
+// Large objects
+//
+// Objects too big for the generic slabs get a mapping of their own.  The
+// mapping is chunk aligned, and starts with a Chunk header owned by
+// large_slab_, so ca_address(), marking and get_obj_type() work as normal.
+// The mapping isn't part of the chunk allocator's memory; it's unmapped by
+// the collector as soon as the object is unreachable.
+//
+// Layout: Chunk, mark bits, LargeHeader, Header, object.
+
+#define MAX_GENERIC 1024
+
+typedef struct {
+	size_t map_len;
+	size_t size;
+} LargeHeader;
+
+static Slab large_slab_;
+
+static void large_init_(void)
+{
+	slab_init(&large_slab_, "large", GENERIC_TYPE, CHUNK_SIZE);
+
+	// One object per chunk
+	large_slab_.objs_per_chunk = 1;
+	large_slab_.bitset_size = sizeof(uint32_t);
+}
+
+static bool is_large_(void *obj)
+{
+	return ca_address(obj).c->owner == &large_slab_;
+}
+
+#define PREFIX_SIZE (sizeof(LargeHeader) + sizeof(Header))
+
+// The object starts at objects + PREFIX_SIZE.
+static Chunk *large_map_(size_t len, void *objects_offset)
+{
+	Chunk *c;
+	LargeHeader *lh;
+	void *ptr, *aligned;
+
+	// over allocate so we can align to the chunk size
+	ptr = mmap(NULL, len + CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	aligned = (void *) ((((intptr_t) ptr) + CHUNK_SIZE - 1) & ~((intptr_t) CHUNK_SIZE - 1));
+	if (aligned != ptr)
+		munmap(ptr, aligned - ptr);
+	munmap(aligned + len, (ptr + CHUNK_SIZE) - aligned);
+
+	c = aligned;
+	c->owner = &large_slab_;
+	c->objects = aligned + (intptr_t) objects_offset;
+	c->search_start = 0;
+	c->unused = false;
+	c->marks[0] = 1;	// allocated
+	list_add(&c->list, &large_slab_.chunks);
+	large_slab_.nr_chunks++;
+	large_slab_.nr_allocs++;
+
+	lh = c->objects;
+	lh->map_len = len;
+	return c;
+}
+
+static Header *large_alloc_(size_t s)
+{
+	size_t offset = sizeof(Chunk) + large_slab_.bitset_size;
+	Chunk *c = large_map_(round_up(offset + PREFIX_SIZE + s, CHUNK_SIZE),
+			      (void *) offset);
+	LargeHeader *lh;
+
+	if (!c)
+		return NULL;
+
+	lh = c->objects;
+	lh->size = s;
+	return (Header *) (lh + 1);
+}
+
+static LargeHeader *large_header_(void *obj)
+{
+	return ((LargeHeader *) (((Header *) obj) - 1)) - 1;
+}
+
+static void large_free_(Chunk *c)
+{
+	LargeHeader *lh = c->objects;
+
+	list_del(&c->list);
+	large_slab_.nr_chunks--;
+	munmap(c, lh->map_len);
+}
+
+// The object goes at the end of the first page, and the file is mapped
+// from the second page on, so it's contiguous with nothing else.
+void *mm_alloc_file(ObjectType type, size_t s, int fd, size_t file_len,
+		    const void **data)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t offset = page - round_up(s, sizeof(void *)) - PREFIX_SIZE;
+	Chunk *c;
+	Header *h;
+	LargeHeader *lh;
+
+	assert(offset >= sizeof(Chunk) + large_slab_.bitset_size);
+	c = large_map_(round_up(page + file_len, CHUNK_SIZE), (void *) offset);
+	if (!c)
+		return NULL;
+
+	lh = c->objects;
+	lh->size = s;
+	if (mmap(((void *) c) + page, file_len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+		 fd, 0) == MAP_FAILED) {
+		large_free_(c);
+		return NULL;
+	}
+
+	h = (Header *) (lh + 1);
+	h->type = type;
+	h->size = 0;
+	memory_stats_.total_allocated += s;
+
+	*data = ((void *) c) + page;
+	return h + 1;
+}
+
+static void large_sweep_(void)
+{
+	Chunk *c, *tmp;
+
+	list_for_each_entry_safe (c, tmp, &large_slab_.chunks, list)
+		if (c->unused)
+			large_free_(c);
+}
+
+static void large_exit_(void)
+{
+	Chunk *c, *tmp;
+
+	fprintf(stderr, "%s: chunks allocated = %u, nr allocated = %u\n",
+		large_slab_.name, large_slab_.nr_chunks, large_slab_.nr_allocs);
+	list_for_each_entry_safe (c, tmp, &large_slab_.chunks, list)
+		large_free_(c);
+}
+
+//----------------------------------------------------------------
+
 void mm_init(size_t mem_size)
 {
 	ca_init(&global_allocator_, CHUNK_SIZE, mem_size);
@@ -260,6 +433,7 @@ void mm_init(size_t mem_size)
 
 	slab_init(&cons_slab_, "cons", CONS, sizeof(Cons));
 	slab_init(&vblock_slab_, "vblock", VBLOCK, sizeof(Value) * ENTRIES_PER_VBLOCK);
+	large_init_();
 }
 
 void mm_exit()
@@ -275,12 +449,18 @@ void mm_exit()
 
 	slab_exit(&cons_slab_);
 	slab_exit(&vblock_slab_);
+	large_exit_();
 
 	ca_exit(&global_allocator_);
 	printf("\n\ntotal allocated: %llu\n",
 	       (unsigned long long) memory_stats_.total_allocated);
 }
 
+static Header *obj_to_header(void *obj)
+{
+	return ((Header *) obj) - 1;
+}
+
 static Slab *choose_slab_(size_t s)
 {
 	static Slab *slabs_[] = {
@@ -297,7 +477,7 @@ static Slab *choose_slab_(size_t s)
 	unsigned i, n;
 
 	// FIXME: slow, use ffs
-	assert(s <= 1024);
+	assert(s <= MAX_GENERIC);
 	for (i = 0, n = 8; ; i++, n *= 2) {
 		if (s <= n)
 			return slabs_[i];
@@ -322,9 +502,12 @@ static inline void *alloc_(ObjectType type, size_t s)
 
 	default:
 		len = s + sizeof(Header);
-		h = slab_alloc(choose_slab_(len));
+		h = (len > MAX_GENERIC) ? large_alloc_(s) : slab_alloc(choose_slab_(len));
+		if (!h)
+			return NULL;
+
 		h->type = type;
-		h->size = s;
+		h->size = (len > MAX_GENERIC) ? 0 : s;
 		return h + 1;
 	}
 }
@@ -354,6 +537,24 @@ void *mm_realloc(void *obj, size_t s)
 	return ptr;
 }
 
+bool mm_resize_inplace(void *obj, size_t s)
+{
+	Slab *slab = ca_address(obj).c->owner;
+	Header *h;
+
+	if (slab->type != GENERIC_TYPE || slab == &large_slab_)
+		return false;
+
+	if (s + sizeof(*h) > slab->obj_size)
+		return false;
+
+	h = obj_to_header(obj);
+	if (s > h->size)
+		memory_stats_.total_allocated += s - h->size;
+	h->size = s;
+	return true;
+}
+
 void *mm_zalloc(ObjectType type, size_t s)
 {
 	void *ptr = mm_alloc(type, s);
@@ -361,11 +562,6 @@ void *mm_zalloc(ObjectType type, size_t s)
 	return ptr;
 }
 
-static Header *obj_to_header(void *obj)
-{
-	return ((Header *) obj) - 1;
-}
-
 static void *header_to_obj(Header *h)
 {
 	return h + 1;
@@ -375,15 +571,49 @@ void *mm_clone(void *obj)
 {
 	Slab *s = ca_address(obj).c->owner;
 
-	if (s->type == GENERIC_TYPE) {
+	if (s == &large_slab_) {
+		size_t len = get_obj_size(obj);
+		void *new = mm_alloc(get_obj_type(obj), len);
+		memcpy(new, obj, len);
+		return new;
+
+	} else if (s->type == GENERIC_TYPE) {
 		Header *h = obj_to_header(obj);
+		memory_stats_.total_allocated += h->size;
 		return header_to_obj(slab_clone(s, h, sizeof(*h) + h->size));
-	} else
+	} else {
+		memory_stats_.total_allocated += s->obj_size;
 		return slab_clone(s, obj, s->obj_size);
+	}
+}
+
+// Permanent roots, registered with mm_add_root().
+#define MAX_ROOTS 256
+static Value *roots_[MAX_ROOTS];
+static unsigned nr_roots_;
+
+void mm_add_root(Value *v)
+{
+	if (nr_roots_ == MAX_ROOTS)
+		fail_("too many roots");
+
+	roots_[nr_roots_++] = v;
+}
+
+void mm_rm_root(Value *v)
+{
+	unsigned i;
+
+	for (i = 0; i < nr_roots_; i++)
+		if (roots_[i] == v) {
+			roots_[i] = roots_[--nr_roots_];
+			return;
+		}
 }
 
 void mm_garbage_collect(Value *roots, unsigned count)
 {
+	unsigned i;
 	Traversal tv;
 
 	slab_clear_marks(&generic_8_slab_);
@@ -397,12 +627,17 @@ void mm_garbage_collect(Value *roots, unsigned count)
 
 	slab_clear_marks(&cons_slab_);
 	slab_clear_marks(&vblock_slab_);
+	slab_clear_marks(&large_slab_);
 
 	trav_init_(&tv);
 	while (count--)
 		mark_value_(&tv, roots[count]);
 
+	for (i = 0; i < nr_roots_; i++)
+		mark_value_(&tv, *roots_[i]);
+
 	walk_all_(&tv);
+	symbol_table_sweep();
 
 	slab_return_unused_chunks(&generic_8_slab_);
 	slab_return_unused_chunks(&generic_16_slab_);
@@ -415,6 +650,331 @@ void mm_garbage_collect(Value *roots, unsigned count)
 
 	slab_return_unused_chunks(&cons_slab_);
 	slab_return_unused_chunks(&vblock_slab_);
+	large_sweep_();
+}
+
+//----------------------------------------------------------------
+// Snapshots
+//
+// A snapshot is a copy of the heap, taken once the environment has been set
+// up, that later runs of the same executable map straight back in rather
+// than rebuilding it.  Nothing is relocated: the chunk allocator is mapped
+// at a fixed address, and the large objects go back where they were (or the
+// restore fails).  The only pointers out of the heap are the primitives'
+// names and functions, which are adjusted for wherever the executable has
+// been loaded this time.
+//
+//   header
+//   roots:        nr_roots x Value
+//   chunk slabs:  nr_chunks x byte, 0 if free, otherwise slab index + 1
+//   large chunks: nr_large x SnapshotLarge
+//   heap:         page aligned
+//   large chunks: each page aligned
+
+#define SNAPSHOT_MAGIC "DMXS"
+#define SNAPSHOT_VERSION 1
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+
+	// identifies the executable
+	uint64_t exe_ino;
+	uint64_t exe_size;
+	uint64_t exe_mtime;
+
+	uint64_t code_addr;	// of mm_snapshot(), to find the load bias
+	uint64_t heap_b, heap_e;
+	uint64_t heap_offset;
+
+	uint32_t nr_roots;
+	uint32_t nr_chunks;
+	uint32_t nr_large;
+} SnapshotHeader;
+
+typedef struct {
+	uint64_t addr;
+	uint64_t len;
+	uint64_t offset;
+} SnapshotLarge;
+
+// The index of a slab in here is its id in the snapshot.
+static Slab *all_slabs_[] = {
+	&generic_8_slab_,
+	&generic_16_slab_,
+	&generic_32_slab_,
+	&generic_64_slab_,
+	&generic_128_slab_,
+	&generic_256_slab_,
+	&generic_512_slab_,
+	&generic_1024_slab_,
+	&cons_slab_,
+	&vblock_slab_,
+};
+
+#define NR_SLABS (sizeof(all_slabs_) / sizeof(*all_slabs_))
+
+static void exe_identity_(SnapshotHeader *h)
+{
+	struct stat info;
+
+	if (stat("/proc/self/exe", &info))
+		memset(&info, 0, sizeof(info));
+
+	h->exe_ino = info.st_ino;
+	h->exe_size = info.st_size;
+	h->exe_mtime = info.st_mtime;
+}
+
+static size_t page_align_(size_t n)
+{
+	return round_up(n, sysconf(_SC_PAGESIZE));
+}
+
+static void write_all_(int fd, const void *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n <= 0)
+			error("couldn't write snapshot");
+
+		data += n;
+		len -= n;
+	}
+}
+
+static void write_at_(int fd, off_t offset, const void *data, size_t len)
+{
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		error("couldn't write snapshot");
+
+	write_all_(fd, data, len);
+}
+
+static void tag_chunks_(uint8_t *slabs, void *heap_b, struct list_head *chunks,
+			unsigned id)
+{
+	Chunk *c;
+
+	list_for_each_entry (c, chunks, list)
+		slabs[((void *) c - heap_b) / CHUNK_SIZE] = id + 1;
+}
+
+void mm_snapshot(const char *path, Value *roots, unsigned count)
+{
+	int fd;
+	unsigned i;
+	off_t offset;
+	void *heap_b, *heap_e;
+	uint8_t *slabs;
+	SnapshotLarge *large;
+	SnapshotHeader h;
+	Chunk *c;
+
+	ca_used(&global_allocator_, &heap_b, &heap_e);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	exe_identity_(&h);
+	h.code_addr = (uintptr_t) mm_snapshot;
+	h.heap_b = (uintptr_t) heap_b;
+	h.heap_e = (uintptr_t) heap_e;
+	h.nr_roots = count;
+	h.nr_chunks = (heap_e - heap_b) / CHUNK_SIZE;
+	h.nr_large = large_slab_.nr_chunks;
+
+	slabs = calloc(h.nr_chunks + 1, 1);
+	large = calloc(h.nr_large + 1, sizeof(*large));
+	if (!slabs || !large)
+		error("out of memory");
+
+	for (i = 0; i < NR_SLABS; i++) {
+		tag_chunks_(slabs, heap_b, &all_slabs_[i]->chunks, i);
+		tag_chunks_(slabs, heap_b, &all_slabs_[i]->full_chunks, i);
+	}
+
+	offset = page_align_(sizeof(h) + sizeof(*roots) * count + h.nr_chunks +
+			     sizeof(*large) * h.nr_large);
+	h.heap_offset = offset;
+	offset += page_align_(heap_e - heap_b);
+
+	i = 0;
+	list_for_each_entry (c, &large_slab_.chunks, list) {
+		LargeHeader *lh = c->objects;
+
+		large[i].addr = (uintptr_t) c;
+		large[i].len = lh->map_len;
+		large[i].offset = offset;
+		offset += page_align_(lh->map_len);
+		i++;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		error("couldn't open '%s'", path);
+
+	write_all_(fd, &h, sizeof(h));
+	write_all_(fd, roots, sizeof(*roots) * count);
+	write_all_(fd, slabs, h.nr_chunks);
+	write_all_(fd, large, sizeof(*large) * h.nr_large);
+	write_at_(fd, h.heap_offset, heap_b, heap_e - heap_b);
+	for (i = 0; i < h.nr_large; i++)
+		write_at_(fd, large[i].offset, (void *) (uintptr_t) large[i].addr,
+			  large[i].len);
+
+	if (close(fd))
+		error("couldn't write '%s'", path);
+
+	free(slabs);
+	free(large);
+}
+
+static bool read_all_(int fd, void *data, size_t len)
+{
+	return read(fd, data, len) == len;
+}
+
+static void add_chunk_(Slab *s, Chunk *c)
+{
+	c->owner = s;
+	list_add(&c->list, &s->chunks);
+	s->nr_chunks++;
+}
+
+static void fixup_obj_(Header *h, uintptr_t bias)
+{
+	void *obj = h + 1;
+
+	switch (h->type) {
+	case PRIMITIVE: {
+		Primitive *p = obj;
+		p->name += bias;
+		p->prim0 = (Value (*)()) ((uintptr_t) p->prim0 + bias);
+		break;
+	}
+
+	case SYMBOL:
+		symbol_table_add(obj);
+		break;
+
+	default:
+		break;
+	}
+}
+
+// Primitives and symbols live in the generic slabs.
+static void fixup_chunk_(Chunk *c, uintptr_t bias)
+{
+	unsigned i;
+	ChunkAddress addr;
+	Slab *s = c->owner;
+
+	if (s == &large_slab_) {
+		fixup_obj_((Header *) (((LargeHeader *) c->objects) + 1), bias);
+		return;
+	}
+
+	if (s->type != GENERIC_TYPE)
+		return;
+
+	addr.c = c;
+	for (i = 0; i < s->objs_per_chunk; i++) {
+		addr.index = i;
+		if (ca_marked(addr))
+			fixup_obj_(c->objects + i * s->obj_size, bias);
+	}
+}
+
+static void unmap_large_(SnapshotLarge *large, unsigned count)
+{
+	while (count--)
+		munmap((void *) (uintptr_t) large[count].addr, large[count].len);
+}
+
+bool mm_restore(const char *path, Value *roots, unsigned count)
+{
+	int fd;
+	unsigned i;
+	bool r = false;
+	uintptr_t bias;
+	void *ptr;
+	uint8_t *slabs = NULL;
+	SnapshotLarge *large = NULL;
+	SnapshotHeader h, expected;
+	Chunk *c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	exe_identity_(&expected);
+	if (!read_all_(fd, &h, sizeof(h)) ||
+	    memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) ||
+	    h.version != SNAPSHOT_VERSION ||
+	    h.exe_ino != expected.exe_ino ||
+	    h.exe_size != expected.exe_size ||
+	    h.exe_mtime != expected.exe_mtime ||
+	    h.nr_roots != count)
+		goto out;
+
+	slabs = malloc(h.nr_chunks + 1);
+	large = malloc(sizeof(*large) * (h.nr_large + 1));
+	if (!slabs || !large ||
+	    !read_all_(fd, roots, sizeof(*roots) * count) ||
+	    !read_all_(fd, slabs, h.nr_chunks) ||
+	    !read_all_(fd, large, sizeof(*large) * h.nr_large))
+		goto out;
+
+	for (i = 0; i < h.nr_chunks; i++)
+		if (slabs[i] > NR_SLABS)
+			goto out;
+
+	for (i = 0; i < h.nr_large; i++) {
+		ptr = (void *) (uintptr_t) large[i].addr;
+		if (mmap(ptr, large[i].len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+			 fd, large[i].offset) != ptr) {
+			// older kernels treat the address as a hint
+			unmap_large_(large, i);
+			goto out;
+		}
+	}
+
+	if (!ca_map(&global_allocator_, (void *) (uintptr_t) h.heap_b,
+		    (void *) (uintptr_t) h.heap_e, fd, h.heap_offset, slabs)) {
+		unmap_large_(large, h.nr_large);
+		goto out;
+	}
+
+	for (i = 0; i < h.nr_chunks; i++)
+		if (slabs[i])
+			add_chunk_(all_slabs_[slabs[i] - 1],
+				   (void *) (uintptr_t) (h.heap_b + i * CHUNK_SIZE));
+
+	for (i = 0; i < h.nr_large; i++)
+		add_chunk_(&large_slab_, (void *) (uintptr_t) large[i].addr);
+
+	bias = (uintptr_t) mm_snapshot - h.code_addr;
+	for (i = 0; i < NR_SLABS; i++)
+		list_for_each_entry (c, &all_slabs_[i]->chunks, list)
+			fixup_chunk_(c, bias);
+
+	list_for_each_entry (c, &large_slab_.chunks, list)
+		fixup_chunk_(c, bias);
+
+	r = true;
+out:
+	free(slabs);
+	free(large);
+	close(fd);
+	return r;
 }
 
 void *as_ref(Value v)
@@ -426,7 +986,9 @@ void *as_ref(Value v)
 
 ObjectType get_obj_type(void *obj)
 {
-	uint16_t t = ca_address(obj).c->owner->type;
+	// only the chunk is needed, not the index
+	Chunk *c = (Chunk *) (((intptr_t) obj) & ~((intptr_t) CHUNK_SIZE - 1));
+	uint16_t t = c->owner->type;
 
 	if (t == GENERIC_TYPE)
 		return obj_to_header(obj)->type;
@@ -438,7 +1000,10 @@ size_t get_obj_size(void *obj)
 {
 	uint16_t t = ca_address(obj).c->owner->type;
 
-	if (t == GENERIC_TYPE)
+	if (is_large_(obj))
+		return large_header_(obj)->size;
+
+	else if (t == GENERIC_TYPE)
 		return obj_to_header(obj)->size;
 	else
 		return ca_address(obj).c->owner->obj_size;
@@ -489,6 +1054,35 @@ int as_fixnum(Value v)
 	return v.i >> 2;
 }
 
+// Fixnums have 30 bits
+#define MIN_FIXNUM (-(1 << 29))
+#define MAX_FIXNUM ((1 << 29) - 1)
+
+Value mk_int(int64_t n)
+{
+	int64_t *box;
+
+	if (n >= MIN_FIXNUM && n <= MAX_FIXNUM)
+		return mk_fixnum(n);
+
+	box = mm_alloc(INT64, sizeof(*box));
+	*box = n;
+	return mk_ref(box);
+}
+
+int64_t as_int(Value v)
+{
+	if (get_tag(v) == TAG_FIXNUM)
+		return as_fixnum(v);
+
+	return *((int64_t *) as_type(INT64, v));
+}
+
+bool is_int(Value v)
+{
+	return get_tag(v) == TAG_FIXNUM || is_type(INT64, v);
+}
+
 Value mk_ref(void *ptr)
 {
 	Value v;
@@ -515,14 +1109,23 @@ bool is_false(Value v)
 
 static const char *type_desc(ObjectType t)
 {
-	// FIXME: out of date
 	static const char *strs[] = {
-		"forward",
 		"primitive",
 		"closure",
 		"string",
 		"symbol",
+		"cons",
 		"nil",
+		"vector",
+		"vblock",
+		"htable",
+		"hblock",
+		"frame",
+		"static-env",
+		"thunk",
+		"raw",
+		"rope",
+		"int64",
 		"fixnum"
 	};
 
@@ -19,13 +19,36 @@ void mm_rm_root(Value *v);
 // sure you call this frequently (after you register the roots).
 void mm_checkpoint();
 
+// Objects bigger than 1k get a mapping of their own, and can't be resized
+// in place.
 void *mm_alloc(ObjectType type, size_t s);
 void *mm_realloc(void *obj, size_t s);   // only for RAW types
 void *mm_zalloc(ObjectType type, size_t s);
+
+// Allocates an object of size s (less than a page), with fd mapped read only
+// at *data.  The mapping goes when the object is collected.  Returns NULL
+// on failure.
+void *mm_alloc_file(ObjectType type, size_t s, int fd, size_t file_len,
+		    const void **data);
 void *mm_clone(void *obj);
 
+// Changes the size of obj without moving it, which is only possible if the
+// slab slot it lives in is big enough.  Only use this on objects that nobody
+// else can see yet, eg, those belonging to a transient.
+bool mm_resize_inplace(void *obj, size_t s);
+
 void mm_garbage_collect(Value *roots, unsigned count);
 
+// Saves the heap, so a later run of the same executable can map it back in
+// with mm_restore(), instead of building it again.  Only the given roots
+// are saved, register any others again after restoring.
+void mm_snapshot(const char *path, Value *roots, unsigned count);
+
+// Call straight after mm_init().  Returns false, leaving the heap empty, if
+// the snapshot's missing, came from another executable, or can't be mapped
+// at the same addresses.
+bool mm_restore(const char *path, Value *roots, unsigned count);
+
 //----------------------------------------------------------------
 
 extern Slab generic_8_slab_;
@@ -53,6 +76,10 @@ static inline VBlock vb_clone(VBlock vb) {
 ObjectType get_obj_type(void *obj);
 size_t get_obj_size(void *obj);
 
+static inline unsigned hb_nr_entries(HBlock *hb) {
+	return (get_obj_size(hb) - sizeof(HBlock)) / sizeof(HashEntry);
+}
+
 typedef struct {
 	size_t total_allocated;
 	size_t total_collected;
@@ -83,6 +110,11 @@ Tag get_tag(Value v);
 Value mk_nil(void);
 
 int as_fixnum(Value v);
+
+// Integers are fixnums if they fit, otherwise they're boxed as INT64.
+Value mk_int(int64_t n);
+int64_t as_int(Value v);
+bool is_int(Value v);
 void *as_type(ObjectType t, Value v);
 
 //----------------------------------------------------------------
@@ -1,19 +1,134 @@
 #include "primitives.h"
 
+#include "cons.h"
+#include "hash_table.h"
+#include "string_type.h"
+#include "symbol.h"
+
 //----------------------------------------------------------------
 
 Value plus_i(Value lhs, Value rhs)
 {
-	return mk_fixnum(as_fixnum(lhs) + as_fixnum(rhs));
+	int64_t r;
+
+	if (__builtin_add_overflow(as_int(lhs), as_int(rhs), &r))
+		error("integer overflow");
+
+	return mk_int(r);
 }
 
-void def_basic_primitives(StaticEnv *r)
+// Nil is false, anything else true.  Predicates return the symbol t.
+Value mk_bool(bool b)
+{
+	static Value t_;
+	static bool initialised = false;
+
+	if (!b)
+		return mk_nil();
+
+	if (!initialised) {
+		t_ = mk_ref(mk_symbol_cstr("t"));
+		mm_add_root(&t_);
+		initialised = true;
+	}
+
+	return t_;
+}
+
+static Value lt_(Value lhs, Value rhs)
+{
+	return mk_bool(as_int(lhs) < as_int(rhs));
+}
+
+static Value eq_(Value lhs, Value rhs)
+{
+	return mk_bool(as_int(lhs) == as_int(rhs));
+}
+
+//----------------------------------------------------------------
+// Lists
+
+static Value car_(Value cell)
+{
+	return ((Cons *) as_type(CONS, cell))->car;
+}
+
+static Value cdr_(Value cell)
+{
+	return ((Cons *) as_type(CONS, cell))->cdr;
+}
+
+//----------------------------------------------------------------
+// Strings
+
+static Value string_length_(Value str)
+{
+	return mk_fixnum(string_value_len(str));
+}
+
+static Value substring_(Value str, Value b, Value e)
+{
+	return mk_ref(string_slice(as_flat_string(str), as_fixnum(b), as_fixnum(e)));
+}
+
+static Value string_split_(Value str, Value seps)
+{
+	return string_split(as_flat_string(str), as_flat_string(seps));
+}
+
+//----------------------------------------------------------------
+
+static Primitive *new_prim_(const char *name, unsigned argc)
 {
 	Primitive *p = mm_alloc(PRIMITIVE, sizeof(*p));
-	p->name = "+";
-	p->argc = 2;
+	p->name = name;
+	p->argc = argc;
+	return p;
+}
+
+void def_basic_primitives(StaticEnv *r)
+{
+	Primitive *p;
+
+	r->primitives_r = ht_transient_begin(r->primitives_r);
+
+	p = new_prim_("+", 2);
 	p->prim2 = plus_i;
 	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("<", 2);
+	p->prim2 = lt_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("=", 2);
+	p->prim2 = eq_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("car", 1);
+	p->prim1 = car_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("cdr", 1);
+	p->prim1 = cdr_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("string-length", 1);
+	p->prim1 = string_length_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("string-append", 2);
+	p->prim2 = string_append;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("substring", 3);
+	p->prim3 = substring_;
+	r_add_prim(r, mk_ref(p));
+
+	p = new_prim_("string-split", 2);
+	p->prim2 = string_split_;
+	r_add_prim(r, mk_ref(p));
+
+	ht_transient_end(r->primitives_r);
 }
 
 //----------------------------------------------------------------
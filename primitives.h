@@ -8,6 +8,9 @@
 void add_primitive(StaticEnv *r, Value p);
 
 void def_basic_primitives(StaticEnv *r);
+
+// Nil is false, true is the symbol t.
+Value mk_bool(bool b);
 void def_dm_primitives(StaticEnv *r);
 
 /*----------------------------------------------------------------*/
@@ -1,115 +1,536 @@
+#include "print.h"
+
+#include "hash_table.h"
 #include "vm.h"
 
+#include <limits.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
 //----------------------------------------------------------------
-// Print
+// Output buffer
 
-static void print_string_unquoted(FILE *stream, String *str)
+void printer_init(Printer *p)
 {
-	const char *ptr;
-	for (ptr = str->b; ptr != str->e; ptr++)
-		fputc(*ptr, stream);
+	memset(p, 0, sizeof(*p));
+	p->touched_b = UINT_MAX;
 }
 
-void print_string(FILE *stream, String *str)
+void printer_exit(Printer *p)
 {
-	fputc('\"', stream);
-	print_string_unquoted(stream, str);
-	fputc('\"', stream);
+	free(p->b);
+	free(p->reached);
+	free(p->shared);
+	free(p->labels);
 }
 
-static void print_symbol(FILE *stream, String *sym)
+static void reserve_(Printer *p, size_t len)
 {
-	print_string_unquoted(stream, sym);
+	size_t used, size;
+	char *new;
+
+	if (p->e + len <= p->alloc_e)
+		return;
+
+	used = p->e - p->b;
+	size = MAX(4096, MAX(2 * (p->alloc_e - p->b), used + len));
+	new = realloc(p->b, size);
+	if (!new)
+		error("out of memory");
+
+	p->b = new;
+	p->e = new + used;
+	p->alloc_e = new + size;
 }
 
-static void print_list(FILE *stream, Value v);
+static inline void put_(Printer *p, char c)
+{
+	if (p->e == p->alloc_e)
+		reserve_(p, 1);
 
-void print(FILE *stream, Value v)
+	*p->e++ = c;
+}
+
+void printer_bytes(Printer *p, const char *b, const char *e)
 {
-	switch (get_tag(v)) {
-	case TAG_FIXNUM:
-		fprintf(stream, "%d", as_fixnum(v));
-		break;
+	reserve_(p, e - b);
+	memcpy(p->e, b, e - b);
+	p->e += e - b;
+}
 
-	case TAG_REF:
-		switch (get_type(v)) {
-		case PRIMITIVE:
-			fprintf(stream, "#<procedure %s>", ((Primitive *) as_ref(v))->name);
-			break;
+void printer_cstr(Printer *p, const char *str)
+{
+	printer_bytes(p, str, str + strlen(str));
+}
 
-		case STRING:
-			print_string(stream, v.ptr);
-			break;
+// Two digits at a time.
+static const char digit_pairs_[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
 
-		case CONS:
-			print_list(stream, v);
-			break;
+void printer_int(Printer *p, int64_t n)
+{
+	char buffer[24], *e = buffer + sizeof(buffer), *b = e;
+	uint64_t u = n < 0 ? -(uint64_t) n : n;
 
-		case SYMBOL:
-			print_symbol(stream, v.ptr);
-			break;
+	while (u >= 100) {
+		unsigned i = (u % 100) * 2;
+		u /= 100;
+		*--b = digit_pairs_[i + 1];
+		*--b = digit_pairs_[i];
+	}
 
-		case FIXNUM:
-			fprintf(stream, "~boxed fixnum?!~");
-			break;
+	if (u >= 10) {
+		*--b = digit_pairs_[u * 2 + 1];
+		*--b = digit_pairs_[u * 2];
+	} else
+		*--b = '0' + u;
 
-		case CLOSURE:
-			fprintf(stream, "~closure~");
-			break;
+	if (n < 0)
+		*--b = '-';
+
+	printer_bytes(p, b, e);
+}
+
+void printer_flush(Printer *p, int fd)
+{
+	const char *b = p->b;
+	ssize_t n;
+
+	while (b != p->e) {
+		n = write(fd, b, p->e - b);
+		if (n <= 0)
+			error("write failed");
+		b += n;
+	}
+
+	p->e = p->b;
+}
+
+//----------------------------------------------------------------
+// Shared structure
+//
+// A first pass marks every container reached in a bitmap covering the
+// heap, noting those reached twice.  Containers are small, so always live
+// in the chunk allocator's memory, and are at least 8 bytes apart.  Only
+// the shared ones get labels, which are kept in a small hash table, during
+// the second pass.
+
+static void bits_reset_(Printer *p)
+{
+	void *heap_b, *heap_e;
+	unsigned nr_words;
+
+	if (p->touched_b < p->touched_e) {
+		memset(p->reached + p->touched_b, 0,
+		       sizeof(uint32_t) * (p->touched_e - p->touched_b));
+		memset(p->shared + p->touched_b, 0,
+		       sizeof(uint32_t) * (p->touched_e - p->touched_b));
+	}
+	p->touched_b = UINT_MAX;
+	p->touched_e = 0;
+	p->nr_shared = 0;
+	p->nr_labels = 0;
+	if (p->labels)
+		memset(p->labels, 0, sizeof(*p->labels) * p->labels_size);
+
+	// the heap may have grown since last time
+	ca_used(&global_allocator_, &heap_b, &heap_e);
+	nr_words = ((heap_e - heap_b) / 8 + 31) / 32;
+	if (nr_words > p->nr_words) {
+		free(p->reached);
+		free(p->shared);
+		p->reached = calloc(nr_words, sizeof(uint32_t));
+		p->shared = calloc(nr_words, sizeof(uint32_t));
+		if (!p->reached || !p->shared)
+			error("out of memory");
+		p->nr_words = nr_words;
+	}
+	p->heap_b = heap_b;
+}
+
+static unsigned bit_index_(Printer *p, void *ptr)
+{
+	size_t index = ((char *) ptr - p->heap_b) / 8;
+
+	if ((char *) ptr < p->heap_b || index / 32 >= p->nr_words)
+		error("can't print an object that isn't on the heap");
+
+	return index;
+}
+
+// Returns true if this is the first time we've reached ptr.
+static bool reach_(Printer *p, void *ptr)
+{
+	unsigned index = bit_index_(p, ptr), w = index / 32;
+	uint32_t bit = 1u << (index & 31);
 
-		case NIL:
-			fprintf(stream, "()");
+	if (p->reached[w] & bit) {
+		if (!(p->shared[w] & bit)) {
+			p->shared[w] |= bit;
+			p->nr_shared++;
+		}
+		return false;
+	}
+
+	p->reached[w] |= bit;
+	p->touched_b = MIN(p->touched_b, w);
+	p->touched_e = MAX(p->touched_e, w + 1);
+	return true;
+}
+
+static void find_shared_(Printer *p, Value v);
+
+static void find_shared_entry_(void *context, Value k, Value v)
+{
+	find_shared_(context, k);
+	find_shared_(context, v);
+}
+
+static void find_shared_(Printer *p, Value v)
+{
+	unsigned i, size;
+
+	while (get_tag(v) == TAG_REF) {
+		switch (get_type(v)) {
+		case CONS:
+			if (!reach_(p, v.ptr))
+				return;
+
+			find_shared_(p, ((Cons *) v.ptr)->car);
+			v = ((Cons *) v.ptr)->cdr;
 			break;
 
 		case VECTOR:
-			fprintf(stream, "~vector~");
-			break;
+			if (!reach_(p, v.ptr))
+				return;
 
-		case VBLOCK:
-			fprintf(stream, "~vblock~");
-			break;
+			size = v_size(v.ptr);
+			for (i = 0; i < size; i++)
+				find_shared_(p, v_ref(v.ptr, i));
+			return;
 
 		case HTABLE:
-			fprintf(stream, "~htable~");
-			break;
+			if (reach_(p, v.ptr))
+				ht_walk(v.ptr, find_shared_entry_, p);
+			return;
 
-		case HBLOCK:
-			fprintf(stream, "~hblock~");
-			break;
+		default:
+			return;
+		}
+	}
+}
+
+static bool is_shared_(Printer *p, void *ptr)
+{
+	unsigned index;
+
+	if (!p->nr_shared)
+		return false;
+
+	index = ((char *) ptr - p->heap_b) / 8;
+	return (char *) ptr >= p->heap_b && index / 32 < p->nr_words &&
+		(p->shared[index / 32] & (1u << (index & 31)));
+}
+
+static PrintLabel *label_find_(Printer *p, void *ptr)
+{
+	unsigned mask = p->labels_size - 1;
+	unsigned i = (((uintptr_t) ptr >> 3) * 0x9e370001UL) & mask;
+
+	while (p->labels[i].ptr && p->labels[i].ptr != ptr)
+		i = (i + 1) & mask;
+
+	return p->labels + i;
+}
+
+static void labels_grow_(Printer *p)
+{
+	unsigned i, old_size = p->labels_size;
+	PrintLabel *old = p->labels;
+
+	p->labels_size = old_size ? old_size * 2 : 64;
+	p->labels = calloc(p->labels_size, sizeof(*p->labels));
+	if (!p->labels)
+		error("out of memory");
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].ptr)
+			*label_find_(p, old[i].ptr) = old[i];
+
+	free(old);
+}
+
+// Writes the label, returns true if the object has already been printed.
+static bool print_label_(Printer *p, void *ptr)
+{
+	PrintLabel *l;
+
+	if ((p->nr_labels + 1) * 2 > p->labels_size)
+		labels_grow_(p);
+
+	l = label_find_(p, ptr);
+	put_(p, '#');
+	if (l->ptr) {
+		printer_int(p, l->label);
+		put_(p, '#');
+		return true;
+	}
+
+	l->ptr = ptr;
+	l->label = p->nr_labels++;
+	printer_int(p, l->label);
+	put_(p, '=');
+	return false;
+}
+
+//----------------------------------------------------------------
+// Print
+
+// Escaped so the reader gets the same string back.
+static void print_string_escaped(Printer *p, String *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *b = str->b, *run = b;
+
+	for (; b != str->e; b++) {
+		uint8_t c = *b;
 
-		case STATIC_ENV:
-			fprintf(stream, "~static-env~");
+		if (c >= ' ' && c != '\"' && c != '\\')
+			continue;
+
+		printer_bytes(p, run, b);
+		run = b + 1;
+		put_(p, '\\');
+		switch (c) {
+		case '\"':
+		case '\\':
+			put_(p, c);
 			break;
 
-		case FRAME:
-			fprintf(stream, "~frame~");
+		case '\n':
+			put_(p, 'n');
 			break;
 
-		case THUNK:
-			fprintf(stream, "~thunk~");
+		case '\t':
+			put_(p, 't');
 			break;
 
-		case RAW:
-			fprintf(stream, "~raw~");
+		case '\r':
+			put_(p, 'r');
 			break;
+
+		default:
+			put_(p, 'x');
+			put_(p, hex[c >> 4]);
+			put_(p, hex[c & 0xf]);
 		}
-		break;
+	}
+	printer_bytes(p, run, b);
+}
+
+static void print_string_(Printer *p, String *str)
+{
+	put_(p, '\"');
+	print_string_escaped(p, str);
+	put_(p, '\"');
+}
+
+static void print_piece_(void *context, String *str)
+{
+	print_string_escaped(context, str);
+}
+
+static void print_rope(Printer *p, Value v)
+{
+	put_(p, '\"');
+	string_walk(v, print_piece_, p);
+	put_(p, '\"');
+}
+
+static void print_(Printer *p, Value v);
+
+static void print_list(Printer *p, Value v)
+{
+	put_(p, '(');
+	print_(p, ((Cons *) v.ptr)->car);
+	v = ((Cons *) v.ptr)->cdr;
+
+	// a shared tail is printed dotted, so it can be labelled
+	while (is_cons(v) && !is_shared_(p, v.ptr)) {
+		put_(p, ' ');
+		print_(p, ((Cons *) v.ptr)->car);
+		v = ((Cons *) v.ptr)->cdr;
+	}
+
+	if (!is_nil(v)) {
+		printer_cstr(p, " . ");
+		print_(p, v);
+	}
+	put_(p, ')');
+}
+
+static void print_vector(Printer *p, Vector *vec)
+{
+	unsigned i, size = v_size(vec);
+
+	printer_cstr(p, "#(");
+	for (i = 0; i < size; i++) {
+		if (i)
+			put_(p, ' ');
+		print_(p, v_ref(vec, i));
+	}
+	put_(p, ')');
+}
+
+static void print_entry_(void *context, Value k, Value v)
+{
+	Printer *p = context;
+
+	printer_cstr(p, " (");
+	print_(p, k);
+	printer_cstr(p, " . ");
+	print_(p, v);
+	put_(p, ')');
+}
+
+static void print_htable(Printer *p, HashTable *ht)
+{
+	printer_cstr(p, "#<htable");
+	ht_walk(ht, print_entry_, p);
+	put_(p, '>');
+}
+
+static void print_(Printer *p, Value v)
+{
+	switch (get_tag(v)) {
+	case TAG_FIXNUM:
+		printer_int(p, as_fixnum(v));
+		return;
 
 	case TAG_NIL:
-		fprintf(stream, "()");
+		printer_cstr(p, "()");
+		return;
+
+	case TAG_REF:
+		break;
+	}
+
+	if (is_shared_(p, v.ptr) && print_label_(p, v.ptr))
+		return;
+
+	switch (get_type(v)) {
+	case PRIMITIVE:
+		printer_cstr(p, "#<procedure ");
+		printer_cstr(p, ((Primitive *) v.ptr)->name);
+		put_(p, '>');
+		break;
+
+	case STRING:
+		print_string_(p, v.ptr);
+		break;
+
+	case ROPE:
+		print_rope(p, v);
+		break;
+
+	case SYMBOL: {
+		String *sym = v.ptr;
+		printer_bytes(p, sym->b, sym->e);
+		break;
+	}
+
+	case CONS:
+		print_list(p, v);
+		break;
+
+	case VECTOR:
+		print_vector(p, v.ptr);
+		break;
+
+	case HTABLE:
+		print_htable(p, v.ptr);
+		break;
+
+	case INT64:
+		printer_int(p, as_int(v));
+		break;
+
+	case FIXNUM:
+		printer_cstr(p, "~boxed fixnum?!~");
+		break;
+
+	case CLOSURE:
+		printer_cstr(p, "~closure~");
+		break;
+
+	case NIL:
+		printer_cstr(p, "()");
+		break;
+
+	case VBLOCK:
+		printer_cstr(p, "~vblock~");
+		break;
+
+	case HBLOCK:
+		printer_cstr(p, "~hblock~");
+		break;
+
+	case STATIC_ENV:
+		printer_cstr(p, "~static-env~");
+		break;
+
+	case FRAME:
+		printer_cstr(p, "~frame~");
+		break;
+
+	case THUNK:
+		printer_cstr(p, "~thunk~");
+		break;
+
+	case RAW:
+		printer_cstr(p, "~raw~");
 		break;
 	}
 }
 
-static void print_list(FILE *stream, Value v)
+void printer_value(Printer *p, Value v)
 {
-	fprintf(stream, "(");
-	while (is_cons(v)) {
-		print(stream, car(v));
-		v = cdr(v);
-		if (is_cons(v))
-			fprintf(stream, " ");
-	}
-	fprintf(stream, ")");
+	bits_reset_(p);
+	find_shared_(p, v);
+	print_(p, v);
+}
+
+//----------------------------------------------------------------
+// stdio
+
+// Anything already buffered in the stream goes first.
+static void flush_to_(Printer *p, FILE *stream)
+{
+	fflush(stream);
+	printer_flush(p, fileno(stream));
+}
+
+void print_string(FILE *stream, String *str)
+{
+	Printer p;
+
+	printer_init(&p);
+	print_string_(&p, str);
+	flush_to_(&p, stream);
+	printer_exit(&p);
 }
 
+void print(FILE *stream, Value v)
+{
+	Printer p;
+
+	printer_init(&p);
+	printer_value(&p, v);
+	flush_to_(&p, stream);
+	printer_exit(&p);
+}
+
+//----------------------------------------------------------------
@@ -0,0 +1,49 @@
+#ifndef DMEXEC_PRINT_H
+#define DMEXEC_PRINT_H
+
+#include "types.h"
+
+#include <stdio.h>
+
+//----------------------------------------------------------------
+// Printing goes into a growable buffer, which is written out in one go
+// with printer_flush().
+//
+// Containers that are reached more than once whilst printing a value are
+// labelled, as in srfi-38: the first occurrence is written #n=..., later
+// ones #n#.  So cycles terminate, and shared structure is visible.
+
+typedef struct {
+	void *ptr;
+	unsigned label;
+} PrintLabel;
+
+typedef struct {
+	char *b, *e, *alloc_e;
+
+	// A bit per 8 bytes of the heap, for the containers reached, and
+	// those reached more than once.
+	char *heap_b;
+	unsigned nr_words;
+	uint32_t *reached, *shared;
+	unsigned touched_b, touched_e;
+	unsigned nr_shared;
+
+	PrintLabel *labels;
+	unsigned nr_labels, labels_size;
+} Printer;
+
+void printer_init(Printer *p);
+void printer_exit(Printer *p);
+
+void printer_value(Printer *p, Value v);
+void printer_bytes(Printer *p, const char *b, const char *e);
+void printer_cstr(Printer *p, const char *str);
+void printer_int(Printer *p, int64_t n);
+
+// Writes everything buffered to fd, and empties the buffer.
+void printer_flush(Printer *p, int fd);
+
+//----------------------------------------------------------------
+
+#endif
@@ -0,0 +1,237 @@
+#include "hash_table.h"
+#include "print.h"
+#include "symbol.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------
+
+static Value read_one_(const char *txt)
+{
+	String input;
+	TokenStream ts;
+	Value v;
+
+	string_tmp(txt, &input);
+	stream_init(&input, &ts);
+	assert(read_sexp(&ts, &v));
+
+	return v;
+}
+
+static void check_prints_(Value v, const char *expected)
+{
+	Printer p;
+
+	printer_init(&p);
+	printer_value(&p, v);
+	if (p.e - p.b != strlen(expected) || memcmp(p.b, expected, p.e - p.b)) {
+		fprintf(stderr, "expected '%s', got '%.*s'\n",
+			expected, (int) (p.e - p.b), p.b);
+		assert(false);
+	}
+	printer_exit(&p);
+}
+
+// Printing what we read gives the same text back.
+static void check_round_trip_(const char *txt)
+{
+	check_prints_(read_one_(txt), txt);
+}
+
+static void t_atoms()
+{
+	check_round_trip_("0");
+	check_round_trip_("-123");
+	check_round_trip_("536870911");
+	check_round_trip_("-536870912");
+	check_round_trip_("9223372036854775807");
+	check_round_trip_("-9223372036854775808");
+	check_round_trip_("foo");
+	check_round_trip_("\"a string\"");
+	check_round_trip_("\"\\\"quoted\\\" \\\\ \\n\\t\\x01\"");
+	check_round_trip_("()");
+}
+
+static void t_lists()
+{
+	check_round_trip_("(a (b \"c\") () 1)");
+	check_round_trip_("(a . b)");
+	check_round_trip_("(a b . 3)");
+}
+
+static void t_vectors()
+{
+	Vector *v = v_empty();
+
+	check_prints_(mk_ref(v), "#()");
+	v = v_push(v, mk_fixnum(1));
+	v = v_push(v, mk_ref(mk_symbol_cstr("two")));
+	v = v_push(v, read_one_("(3)"));
+	check_prints_(mk_ref(v), "#(1 two (3))");
+}
+
+static void t_htables()
+{
+	HashTable *ht = ht_insert(ht_empty(), mk_fixnum(1), mk_fixnum(2));
+	check_prints_(mk_ref(ht), "#<htable (1 . 2)>");
+}
+
+static void t_shared()
+{
+	Value x = read_one_("(x)");
+	Value v = mk_ref(cons(x, mk_ref(cons(x, mk_nil()))));
+	Value tail = read_one_("(b c)");
+
+	check_prints_(v, "(#0=(x) #0#)");
+
+	// shared tails are dotted
+	v = mk_ref(cons(tail, mk_ref(cons(mk_fixnum(1), tail))));
+	check_prints_(v, "(#0=(b c) 1 . #0#)");
+
+	// the labels don't leak into the next value
+	check_prints_(x, "(x)");
+}
+
+static void t_cycles()
+{
+	Cons *a = cons(mk_fixnum(1), mk_nil());
+	Cons *b = cons(mk_fixnum(2), mk_ref(a));
+
+	a->cdr = mk_ref(b);
+	check_prints_(mk_ref(a), "#0=(1 2 . #0#)");
+
+	a->cdr = mk_nil();
+	a->car = mk_ref(a);
+	check_prints_(mk_ref(a), "#0=(#0#)");
+}
+
+//----------------------------------------------------------------
+// Print benchmark
+//
+// A 100k element list of the sort of thing a status dump contains,
+// against printing with a stdio call per character or number.
+
+#define NR_ELTS 100000
+
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void stdio_print_(FILE *fp, Value v)
+{
+	const char *ptr;
+	String *str;
+
+	switch (get_type(v)) {
+	case FIXNUM:
+		fprintf(fp, "%d", as_fixnum(v));
+		break;
+
+	case STRING:
+	case SYMBOL:
+		str = v.ptr;
+		for (ptr = str->b; ptr != str->e; ptr++)
+			fputc(*ptr, fp);
+		break;
+
+	case CONS:
+		fputc('(', fp);
+		while (is_cons(v)) {
+			stdio_print_(fp, car(v));
+			v = cdr(v);
+			if (is_cons(v))
+				fputc(' ', fp);
+		}
+		fputc(')', fp);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void bench_print()
+{
+	unsigned i;
+	char buffer[64];
+	ListBuilder lb;
+	Value v;
+	Printer p;
+	FILE *fp;
+	double before, after;
+	size_t len;
+
+	lb_init(&lb);
+	for (i = 0; i < NR_ELTS; i++) {
+		ListBuilder elt;
+
+		snprintf(buffer, sizeof(buffer), "vg%u-lvol%u", i % 37, i);
+		lb_init(&elt);
+		lb_append(&elt, mk_ref(mk_string_from_cstr(STRING, buffer)));
+		lb_append(&elt, mk_fixnum(i * 2048));
+		lb_append(&elt, mk_ref(mk_symbol_cstr("active")));
+		lb_append(&lb, lb_get(&elt));
+	}
+	v = lb_get(&lb);
+
+	fp = fopen("/dev/null", "w");
+	assert(fp);
+
+	before = now_();
+	stdio_print_(fp, v);
+	fflush(fp);
+	after = now_();
+	fprintf(stderr, "stdio print %u elements, %.1fms\n",
+		NR_ELTS, (after - before) * 1000);
+
+	before = now_();
+	printer_init(&p);
+	printer_value(&p, v);
+	len = p.e - p.b;
+	printer_flush(&p, fileno(fp));
+	printer_exit(&p);
+	after = now_();
+	fprintf(stderr, "buffered print %u elements, %.1fms, %.1f MB/s\n",
+		NR_ELTS, (after - before) * 1000,
+		len / (after - before) / (1024 * 1024));
+
+	fclose(fp);
+}
+
+//----------------------------------------------------------------
+
+static void run(const char *name, void (*fn)())
+{
+	fprintf(stderr, "%s", name);
+	fprintf(stderr, "%*s... ", (int) (24 - strlen(name)), "");
+	fn();
+	fprintf(stderr, "ok\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	mm_init(64 * 1024 * 1024);
+	run("atoms", t_atoms);
+	run("lists", t_lists);
+	run("vectors", t_vectors);
+	run("hash tables", t_htables);
+	run("shared structure", t_shared);
+	run("cycles", t_cycles);
+
+	bench_print();
+	mm_exit();
+
+	return 0;
+}
+
+//----------------------------------------------------------------
@@ -1,10 +1,63 @@
+#include "symbol.h"
 #include "vm.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/param.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 //----------------------------------------------------------------
 // Lexer
+//
+// Bytes are classified with a single table lookup.  Runs of whitespace and
+// symbol characters are skipped 16 bytes at a time if we have SSE2, and
+// comments with memchr().
+
+enum {
+	CC_SPACE = 1 << 0,
+	CC_SYM = 1 << 1,	// may appear in a symbol
+	CC_DIGIT = 1 << 2,
+	CC_HEX = 1 << 3,
+};
+
+static uint8_t char_class_[256];
+
+static void init_char_classes_(void)
+{
+	unsigned c;
+	static const char *special = "()';\\|";
+
+	if (char_class_['a'])
+		return;
+
+	for (c = 1; c < 256; c++) {
+		if (isspace(c))
+			char_class_[c] = CC_SPACE;
+
+		else if (!strchr(special, c))
+			char_class_[c] = CC_SYM;
+
+		if (isdigit(c))
+			char_class_[c] |= CC_DIGIT;
+
+		if (isxdigit(c))
+			char_class_[c] |= CC_HEX;
+	}
+}
+
+static inline bool is_class(char c, unsigned cc)
+{
+	return char_class_[(uint8_t) c] & cc;
+}
+
+static unsigned hex_value_(char c)
+{
+	return is_class(c, CC_DIGIT) ? c - '0' : (c | 0x20) - 'a' + 10;
+}
 
 static bool more_input(String *in)
 {
@@ -19,6 +72,64 @@ static void step_input(String *in)
 	in->b++;
 }
 
+#ifdef __SSE2__
+// These return the first byte that _might_ end the run; the caller
+// checks it with the table.
+static const char *simd_skip_space_(const char *b, const char *e)
+{
+	while (e - b >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) b);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+					 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		unsigned mask = ~_mm_movemask_epi8(m) & 0xffff;
+
+		if (mask)
+			return b + __builtin_ctz(mask);
+
+		b += 16;
+	}
+
+	return b;
+}
+
+static const char *simd_skip_sym_(const char *b, const char *e)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+
+	while (e - b >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) b);
+
+		// control characters and space, unsigned compare
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+
+		if (_mm_movemask_epi8(m))
+			return b + __builtin_ctz(_mm_movemask_epi8(m));
+
+		b += 16;
+	}
+
+	return b;
+}
+#endif
+
+static const char *skip_class_(const char *b, const char *e, unsigned cc)
+{
+#ifdef __SSE2__
+	b = (cc == CC_SPACE) ? simd_skip_space_(b, e) : simd_skip_sym_(b, e);
+#endif
+	while (b != e && is_class(*b, cc))
+		b++;
+
+	return b;
+}
+
 /*
  * space = whitespace | comment
  * whitespace = (' ' | <tab>)+
@@ -26,94 +137,220 @@ static void step_input(String *in)
  */
 static void consume_space(String *in)
 {
-	while (more_input(in)) {
-		if (*in->b == ';') {
-			do {
-				step_input(in);
-			} while (more_input(in) && *in->b != '\n');
-
-		} else if (isspace(*in->b)) {
-			do {
-				step_input(in);
-			} while (more_input(in) && isspace(*in->b));
-		} else
+	const char *b = in->b, *e = in->e;
+
+	while (b != e) {
+		if (*b == ';') {
+			b = memchr(b, '\n', e - b);
+			if (!b)
+				b = e;
+
+		} else if (is_class(*b, CC_SPACE))
+			b = skip_class_(b, e, CC_SPACE);
+		else
 			break;
 	}
-}
 
-static bool is_sym_char(char c)
-{
-	static const char *special = "()';\\|";
-	return !isspace(c) && !strchr(special, c);
+	in->b = b;
 }
 
 static Token scan_sym(String *in)
 {
 	Token tok;
 
-	if (!is_sym_char(*in->b))
+	if (!is_class(*in->b, CC_SYM))
 		error("this isn't a symbol");
 
 	tok.type = TOK_SYM;
 	tok.str.b = in->b;
-
-	while (more_input(in) && is_sym_char(*in->b))
-		step_input(in);
-
+	in->b = skip_class_(in->b, in->e, CC_SYM);
 	tok.str.e = in->b;
 	return tok;
 }
 
-// This may return a symbol
-static Token scan_fixnum(String *in)
+static bool starts_number(const char *b, const char *e)
+{
+	return is_class(*b, CC_DIGIT) ||
+		(*b == '-' && e - b > 1 && is_class(b[1], CC_DIGIT));
+}
+
+// Sizes may have a binary suffix, or 's' for 512 byte sectors.
+static unsigned size_shift(char c)
+{
+	switch (c | 0x20) {
+	case 's':
+		return 9;
+
+	case 'k':
+		return 10;
+
+	case 'm':
+		return 20;
+
+	case 'g':
+		return 30;
+
+	case 't':
+		return 40;
+
+	case 'p':
+		return 50;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * number = '-'? ('0x' hex+ | digit+ suffix?)
+ *
+ * This may return a symbol, if there are symbol characters after the number.
+ */
+static Token scan_number(String *in)
 {
-	int n = 0;
 	Token tok;
+	uint64_t n = 0;
+	unsigned digit, base = 10, shift = 0, cc = CC_DIGIT;
+	bool negative = false, overflow = false;
+	const char *b = in->b, *e = in->e;
 
 	tok.type = TOK_FIXNUM;
+	tok.str.b = b;
 
-	tok.str.b = in->b;
-	while (more_input(in) && isdigit(*in->b)) {
-		n *= 10;
-		n += *in->b - '0';
-		step_input(in);
+	if (*b == '-') {
+		negative = true;
+		b++;
 	}
-	tok.str.e = in->b;
-	tok.fixnum = n;
 
-	if (more_input(in) && is_sym_char(*in->b)) {
-		// Symbols may begin with digits.
-		while (more_input(in) && is_sym_char(*in->b))
-			step_input(in);
+	if (e - b > 2 && b[0] == '0' && (b[1] | 0x20) == 'x' && is_class(b[2], CC_HEX)) {
+		base = 16;
+		cc = CC_HEX;
+		b += 2;
+	}
 
-		tok.str.e = in->b;
+	while (b != e && is_class(*b, cc)) {
+		digit = hex_value_(*b++);
+		overflow |= __builtin_mul_overflow(n, base, &n);
+		overflow |= __builtin_add_overflow(n, digit, &n);
+	}
+
+	if (base == 10 && b != e && (b + 1 == e || !is_class(b[1], CC_SYM))) {
+		shift = size_shift(*b);
+		if (shift)
+			b++;
+	}
+
+	if (b != e && is_class(*b, CC_SYM)) {
+		// Symbols may begin with digits.
+		b = skip_class_(b, e, CC_SYM);
 		tok.type = TOK_SYM;
+		tok.str.e = in->b = b;
+		return tok;
 	}
 
+	if (n > (UINT64_MAX >> shift))
+		overflow = true;
+	n <<= shift;
+
+	if (overflow || n > (uint64_t) INT64_MAX + negative)
+		error("integer out of range: %.*s", (int) (b - tok.str.b), tok.str.b);
+
+	tok.fixnum = negative ? -n : n;
+	tok.str.e = in->b = b;
 	return tok;
 }
 
+/*
+ * string = '"' (char | '\\' escape)* '"'
+ *
+ * The token is the raw bytes, escapes are decoded by read_sexp(), straight
+ * into the new string.
+ */
 static Token scan_string(String *in)
 {
 	Token tok;
+	const char *b = in->b + 1, *e = in->e, *quote, *bs;
 
 	tok.type = TOK_STRING;
-	step_input(in);
-	tok.str.b = in->b;
+	tok.escaped = false;
+	tok.str.b = b;
 
-	// FIXME: support escapes
-	while (more_input(in) && *in->b != '\"')
-		step_input(in);
+	quote = memchr(b, '\"', e - b);
+	if (!quote)
+		error("bad string");
 
-	tok.str.e = in->b;
+	while ((bs = memchr(b, '\\', quote - b))) {
+		tok.escaped = true;
+		b = bs + 2;
 
-	if (!more_input(in))
-		error("bad string");
+		// the quote was escaped
+		if (b > quote) {
+			quote = memchr(b, '\"', e - b);
+			if (!quote)
+				error("bad string");
+		}
+	}
 
-	step_input(in);
+	tok.str.e = quote;
+	in->b = quote + 1;
 	return tok;
 }
 
+// The scanner has checked a backslash is never the last byte.
+static char *decode_escapes(const char *b, const char *e, char *out)
+{
+	const char *bs;
+
+	while (b != e) {
+		bs = memchr(b, '\\', e - b);
+		if (!bs)
+			bs = e;
+
+		memcpy(out, b, bs - b);
+		out += bs - b;
+		b = bs;
+		if (b == e)
+			break;
+
+		b++;
+		switch (*b++) {
+		case 'n':
+			*out++ = '\n';
+			break;
+
+		case 't':
+			*out++ = '\t';
+			break;
+
+		case 'r':
+			*out++ = '\r';
+			break;
+
+		case '0':
+			*out++ = '\0';
+			break;
+
+		case '\\':
+		case '\"':
+			*out++ = b[-1];
+			break;
+
+		case 'x':
+			if (e - b < 2 || !is_class(b[0], CC_HEX) || !is_class(b[1], CC_HEX))
+				error("bad \\x escape in string");
+
+			*out++ = (hex_value_(b[0]) << 4) | hex_value_(b[1]);
+			b += 2;
+			break;
+
+		default:
+			error("unknown escape in string: \\%c", b[-1]);
+		}
+	}
+
+	return out;
+}
+
 static bool is_punc(char c, TokenType *result)
 {
 	switch (c) {
@@ -129,10 +366,6 @@ static bool is_punc(char c, TokenType *result)
 		*result = TOK_QUOTE;
 		return true;
 
-	case '.':
-		*result = TOK_DOT;
-		return true;
-
 	default:
 		return false;
 	}
@@ -153,13 +386,21 @@ static Token scan(String *in)
 	if (!more_input(in))
 		return (Token) {TOK_EOF};
 
-	if (isdigit(*in->b))
-		return scan_fixnum(in);
+	if (starts_number(in->b, in->e))
+		return scan_number(in);
 
 	else if (*in->b == '\"')
 		return scan_string(in);
 
-	else if (is_punc(*in->b, &tt)) {
+	// a dot that isn't part of a symbol
+	else if (*in->b == '.' && (in->b + 1 == in->e || !is_class(in->b[1], CC_SYM))) {
+		r.type = TOK_DOT;
+		r.str.b = in->b;
+		step_input(in);
+		r.str.e = in->b;
+		return r;
+
+	} else if (is_punc(*in->b, &tt)) {
 		r.type = tt;
 		r.str.b = in->b;
 		step_input(in);
@@ -172,10 +413,18 @@ static Token scan(String *in)
 
 void stream_init(String *in, TokenStream *ts)
 {
+	init_char_classes_();
 	ts->in = in;
+	ts->src = NULL;
 	ts->tok = scan(in);
 }
 
+void stream_init_shared(String *src, String *in, TokenStream *ts)
+{
+	stream_init(in, ts);
+	ts->src = src;
+}
+
 static Token *peek(TokenStream *ts)
 {
 	return &ts->tok;
@@ -203,17 +452,27 @@ bool read_sexp(TokenStream *ts, Value *result)
 
 	switch (tok->type) {
 	case TOK_FIXNUM:
-		*result = mk_fixnum(tok->fixnum);
+		*result = mk_int(tok->fixnum);
 		shift(ts);
 		break;
 
 	case TOK_STRING:
-		*result = mk_ref(mk_string(STRING, tok->str.b, tok->str.e));
+		if (tok->escaped) {
+			String *str = mk_string_uninit(STRING, string_len(&tok->str));
+			string_end(str, decode_escapes(tok->str.b, tok->str.e,
+						       (char *) str->b));
+			*result = mk_ref(str);
+
+		} else if (ts->src)
+			*result = mk_ref(string_slice(ts->src, tok->str.b - ts->src->b,
+						      tok->str.e - ts->src->b));
+		else
+			*result = mk_ref(mk_string(STRING, tok->str.b, tok->str.e));
 		shift(ts);
 		break;
 
 	case TOK_SYM:
-		*result = mk_ref(mk_string(SYMBOL, tok->str.b, tok->str.e));
+		*result = mk_ref(mk_symbol(tok->str.b, tok->str.e));
 		shift(ts);
 		break;
 
@@ -241,8 +500,22 @@ static bool read_list(TokenStream *ts, Value *result)
 
 	for (;;) {
 		if (tok->type == TOK_DOT) {
-			// FIXME: finish
-			error("lazy programmer; no dotted lists");
+			Value tail;
+
+			if (!lb.head)
+				error("malformed list; nothing before the dot");
+
+			shift(ts);
+			if (!read_sexp(ts, &tail))
+				error("malformed list; unexpected eof");
+
+			if (tok->type != TOK_CLOSE)
+				error("malformed list; more than one value after the dot");
+
+			shift(ts);
+			lb.tail->cdr = tail;
+			*result = lb_get(&lb);
+			return true;
 
 		} else if (tok->type == TOK_CLOSE) {
 			shift(ts);
@@ -267,7 +540,7 @@ static bool read_quote(TokenStream *ts, Value *result)
 	ListBuilder lb;
 
 	lb_init(&lb);
-	lb_append(&lb, mk_ref(mk_string_from_cstr(SYMBOL, "quote")));
+	lb_append(&lb, mk_ref(mk_symbol_cstr("quote")));
 
 	if (!read_sexp(ts, &result2))
 		error("malformed quote; unexpected eof");
@@ -277,3 +550,193 @@ static bool read_quote(TokenStream *ts, Value *result)
 	return true;
 }
 
+
+//----------------------------------------------------------------
+// Push reader
+//
+// Scripts coming from a pipe or socket arrive in arbitrary chunks.  The
+// push reader tracks just enough lexical state (nesting depth, and whether
+// we're in a comment, string or atom) to spot where each top level datum
+// ends, at which point it's handed to read_sexp().  Only the bytes of an
+// incomplete datum are buffered, data that lie within a single chunk are
+// read in place.
+
+void pr_init(PushReader *pr)
+{
+	init_char_classes_();
+	pr->b = pr->e = pr->alloc_e = NULL;
+	pr->state = PR_SPACE;
+	pr->depth = 0;
+	pr->active = false;
+}
+
+void pr_exit(PushReader *pr)
+{
+	free(pr->b);
+}
+
+static void pr_buffer_(PushReader *pr, const char *b, const char *e)
+{
+	size_t len = e - b, used = pr->e - pr->b;
+
+	if (pr->e + len > pr->alloc_e) {
+		size_t size = MAX(256, MAX(2 * (pr->alloc_e - pr->b), used + len));
+		char *new = realloc(pr->b, size);
+		if (!new)
+			error("out of memory");
+
+		pr->b = new;
+		pr->e = new + used;
+		pr->alloc_e = new + size;
+	}
+
+	memcpy(pr->e, b, len);
+	pr->e += len;
+}
+
+// The datum is whatever's buffered, followed by [b, e).
+static void pr_complete_(PushReader *pr, const char *b, const char *e,
+			 PushFn fn, void *context)
+{
+	String input;
+	TokenStream ts;
+	Value v;
+
+	if (pr->e != pr->b) {
+		pr_buffer_(pr, b, e);
+		b = pr->b;
+		e = pr->e;
+	}
+
+	input.b = b;
+	input.e = e;
+	input.hash = 0;
+	input.owner = NULL;
+	stream_init(&input, &ts);
+	if (!read_sexp(&ts, &v))
+		error("push reader lost a datum");
+
+	pr->e = pr->b;
+	pr->active = false;
+	fn(context, v);
+}
+
+void pr_feed(PushReader *pr, const char *b, const char *e,
+	     PushFn fn, void *context)
+{
+	const char *p = b, *start = b;
+
+	while (p != e) {
+		switch (pr->state) {
+		case PR_COMMENT:
+			p = memchr(p, '\n', e - p);
+			if (!p)
+				p = e;
+			else
+				pr->state = PR_SPACE;
+			break;
+
+		case PR_STRING: {
+			const char *quote = memchr(p, '\"', e - p);
+			const char *bs = memchr(p, '\\', (quote ? quote : e) - p);
+
+			if (bs) {
+				p = bs + 1;
+				pr->state = PR_ESCAPE;
+				break;
+			}
+
+			if (!quote) {
+				p = e;
+				break;
+			}
+
+			p = quote + 1;
+			pr->state = PR_SPACE;
+			if (!pr->depth) {
+				pr_complete_(pr, start, p, fn, context);
+				start = p;
+			}
+			break;
+		}
+
+		case PR_ESCAPE:
+			// the escaped character can't end the string
+			p++;
+			pr->state = PR_STRING;
+			break;
+
+		case PR_ATOM:
+			p = skip_class_(p, e, CC_SYM);
+			if (p != e) {
+				pr->state = PR_SPACE;
+				if (!pr->depth) {
+					pr_complete_(pr, start, p, fn, context);
+					start = p;
+				}
+			}
+			break;
+
+		case PR_SPACE:
+			if (is_class(*p, CC_SPACE)) {
+				p++;
+				break;
+			}
+
+			if (*p == ';') {
+				pr->state = PR_COMMENT;
+				break;
+			}
+
+			if (!pr->active) {
+				pr->active = true;
+				start = p;
+			}
+
+			switch (*p++) {
+			case '(':
+				pr->depth++;
+				break;
+
+			case ')':
+				if (!pr->depth)
+					error("unexpected ')'");
+
+				if (!--pr->depth) {
+					pr_complete_(pr, start, p, fn, context);
+					start = p;
+				}
+				break;
+
+			case '\'':
+				break;
+
+			case '\"':
+				pr->state = PR_STRING;
+				break;
+
+			default:
+				pr->state = PR_ATOM;
+				break;
+			}
+			break;
+		}
+	}
+
+	if (pr->active)
+		pr_buffer_(pr, start, e);
+}
+
+void pr_finish(PushReader *pr, PushFn fn, void *context)
+{
+	if (pr->state == PR_ATOM && !pr->depth) {
+		pr->state = PR_SPACE;
+		pr_complete_(pr, pr->e, pr->e, fn, context);
+
+	} else if (pr->active)
+		error("unexpected end of input");
+
+	pr->state = PR_SPACE;
+}
+
+//----------------------------------------------------------------
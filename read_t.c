@@ -0,0 +1,354 @@
+#include "equality.h"
+#include "symbol.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+
+//----------------------------------------------------------------
+
+static Value read_one_(const char *txt)
+{
+	String input;
+	TokenStream ts;
+	Value v;
+
+	string_tmp(txt, &input);
+	stream_init(&input, &ts);
+	assert(read_sexp(&ts, &v));
+	assert(!read_sexp(&ts, &v));
+
+	return v;
+}
+
+static Value sym_(const char *name)
+{
+	return mk_ref(mk_symbol_cstr(name));
+}
+
+static Value str_(const char *txt)
+{
+	return mk_ref(mk_string_from_cstr(STRING, txt));
+}
+
+static Value list3_(Value a, Value b, Value c)
+{
+	return mk_ref(cons(a, mk_ref(cons(b, mk_ref(cons(c, mk_nil()))))));
+}
+
+static void t_atoms()
+{
+	assert(equalp(read_one_("123"), mk_fixnum(123)));
+	assert(equalp(read_one_("  foo  "), sym_("foo")));
+	assert(equalp(read_one_("\"foo bar\""), str_("foo bar")));
+
+	// symbols may begin with digits
+	assert(equalp(read_one_("1+"), sym_("1+")));
+	assert(equalp(read_one_("thin-pool"), sym_("thin-pool")));
+	assert(equalp(read_one_("/dev/mapper/vg0-lvol0"), sym_("/dev/mapper/vg0-lvol0")));
+	assert(equalp(read_one_("a\"b"), sym_("a\"b")));
+}
+
+static void t_lists()
+{
+	assert(is_nil(read_one_("()")));
+	assert(equalp(read_one_("(a 2 \"c\")"),
+		      list3_(sym_("a"), mk_fixnum(2), str_("c"))));
+	assert(equalp(read_one_("(a(b)c)"),
+		      list3_(sym_("a"),
+			     mk_ref(cons(sym_("b"), mk_nil())),
+			     sym_("c"))));
+}
+
+static void t_space_and_comments()
+{
+	assert(equalp(read_one_("; comment\n\t(a ; more\n  2\r\n \"c\") ; trailing"),
+		      list3_(sym_("a"), mk_fixnum(2), str_("c"))));
+	assert(equalp(read_one_("(a;comment\nb c)"),
+		      list3_(sym_("a"), sym_("b"), sym_("c"))));
+}
+
+static void t_long_runs()
+{
+	unsigned i;
+	char buffer[256];
+	String *sym;
+
+	// runs that cross 16 byte boundaries, terminated in different ways
+	for (i = 1; i < 100; i++) {
+		memset(buffer, (i & 1) ? ' ' : '\n', i);
+		memset(buffer + i, 'x', i);
+		strcpy(buffer + 2 * i, (i & 1) ? "\t" : ";comment");
+
+		sym = read_one_(buffer).ptr;
+		assert(obj_is_type(SYMBOL, sym));
+		assert(string_len(sym) == i);
+	}
+}
+
+static void t_numbers()
+{
+	assert(equalp(read_one_("-17"), mk_fixnum(-17)));
+	assert(equalp(read_one_("0x1F"), mk_fixnum(31)));
+	assert(equalp(read_one_("512s"), mk_fixnum(512 * 512)));
+	assert(equalp(read_one_("4k"), mk_fixnum(4096)));
+	assert(equalp(read_one_("10G"), mk_int(10LL << 30)));
+	assert(as_int(read_one_("9223372036854775807")) == INT64_MAX);
+	assert(as_int(read_one_("-9223372036854775808")) == INT64_MIN);
+	assert(as_int(read_one_("0x7fffffffffffffff")) == INT64_MAX);
+	assert(as_int(read_one_("-16t")) == -(16LL << 40));
+
+	// these are symbols
+	assert(equalp(read_one_("-"), sym_("-")));
+	assert(equalp(read_one_("-x"), sym_("-x")));
+	assert(equalp(read_one_("10Gb"), sym_("10Gb")));
+	assert(equalp(read_one_("0x"), sym_("0x")));
+	assert(equalp(read_one_("0xfg"), sym_("0xfg")));
+	assert(equalp(read_one_("12q"), sym_("12q")));
+}
+
+static void t_escapes()
+{
+	String *str = read_one_("\"a\\\"b\\\\c\\n\\t\\x41\\0\"").ptr;
+
+	assert(obj_is_type(STRING, str));
+	assert(string_len(str) == 9);
+	assert(!memcmp(str->b, "a\"b\\c\n\tA\0", 9));
+	assert(!str->e[0]);
+
+	assert(equalp(read_one_("\"\\\"\""), str_("\"")));
+	assert(equalp(read_one_("(\"x\\\\\" y)"),
+		      mk_ref(cons(str_("x\\"), mk_ref(cons(sym_("y"), mk_nil()))))));
+}
+
+static void t_dotted()
+{
+	Value v = read_one_("(a . b)");
+	assert(equalp(car(v), sym_("a")));
+	assert(equalp(cdr(v), sym_("b")));
+
+	v = read_one_("(1 2 . (3))");
+	assert(equalp(v, list3_(mk_fixnum(1), mk_fixnum(2), mk_fixnum(3))));
+
+	// dots within symbols
+	assert(equalp(read_one_("(a.b ...)"),
+		      mk_ref(cons(sym_("a.b"), mk_ref(cons(sym_("..."), mk_nil()))))));
+}
+
+static void t_quote()
+{
+	Value v = read_one_("'foo");
+	assert(equalp(car(v), sym_("quote")));
+	assert(equalp(car(cdr(v)), sym_("foo")));
+}
+
+//----------------------------------------------------------------
+// Push reader
+
+typedef struct {
+	unsigned nr;
+	Value vs[16];
+} Collector;
+
+static void collect_(void *context, Value v)
+{
+	Collector *c = context;
+	assert(c->nr < 16);
+	c->vs[c->nr++] = v;
+}
+
+static void push_in_chunks_(const char *txt, size_t chunk_len, Collector *c)
+{
+	const char *b = txt, *e = txt + strlen(txt);
+	PushReader pr;
+
+	c->nr = 0;
+	pr_init(&pr);
+	while (b != e) {
+		size_t len = MIN(chunk_len, e - b);
+		pr_feed(&pr, b, b + len, collect_, c);
+		b += len;
+	}
+	pr_finish(&pr, collect_, c);
+	pr_exit(&pr);
+}
+
+static void t_push_reader()
+{
+	unsigned i, chunk_len;
+	static const char *script =
+		"; set up the pool\n"
+		"(define-table \"pool\" '((0 2097152 thin-pool \"/dev/sdb\" 128)))\n"
+		"123 foo \"a string\"'bar(a (b ;) comment\n c) \"d\")'(1 2)\n"
+		"\"esc\\\"aped (\\\\\"(x . \"\\\\\")last";
+
+	Collector whole, chunked;
+	String input;
+	TokenStream ts;
+
+	// the ordinary reader agrees
+	string_tmp(script, &input);
+	stream_init(&input, &ts);
+	for (whole.nr = 0; read_sexp(&ts, whole.vs + whole.nr); whole.nr++)
+		;
+	assert(whole.nr == 10);
+
+	for (chunk_len = 1; chunk_len <= strlen(script); chunk_len++) {
+		push_in_chunks_(script, chunk_len, &chunked);
+		assert(chunked.nr == whole.nr);
+		for (i = 0; i < whole.nr; i++)
+			assert(equalp(chunked.vs[i], whole.vs[i]));
+	}
+}
+
+static void t_push_reader_emits_early()
+{
+	Collector c = {0};
+	PushReader pr;
+	static const char *txt = "(a b) (c", *rest = ") d";
+
+	pr_init(&pr);
+	pr_feed(&pr, txt, txt + strlen(txt), collect_, &c);
+	assert(c.nr == 1);
+
+	// atoms aren't complete until we see what follows them
+	pr_feed(&pr, rest, rest + strlen(rest), collect_, &c);
+	assert(c.nr == 2);
+	pr_finish(&pr, collect_, &c);
+	assert(c.nr == 3);
+	assert(equalp(c.vs[2], sym_("d")));
+	pr_exit(&pr);
+}
+
+//----------------------------------------------------------------
+// Parse benchmark
+//
+// A synthetic corpus, in the style of the table scripts we generate.
+
+#define CORPUS_SIZE (100 * 1024 * 1024)
+
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static size_t gen_form_(char *buffer, size_t len, unsigned i)
+{
+	switch (i % 4) {
+	case 0:
+		return snprintf(buffer, len, ";; vg%u, generated, do not edit\n", i % 37);
+
+	case 1:
+		return snprintf(buffer, len,
+				"(define-table \"vg%u-lvol%u\"\n"
+				"  '((0 %u linear \"/dev/sd%c\" %u)\n"
+				"    (%u %u striped 2 128 \"/dev/sdb\" 0 \"/dev/sdc\" 0)))\n",
+				i % 37, i, 2048 + i, 'a' + (i % 26), i * 8,
+				2048 + i, 4096 + i);
+
+	case 2:
+		return snprintf(buffer, len,
+				"(set! thin-%u (make-thin pool-%u %u)) ; dev id\n",
+				i, i % 11, i);
+
+	default:
+		return snprintf(buffer, len,
+				"(if (thin-pool-needs-check? pool-%u)\n"
+				"    (begin (thin-check pool-%u) (activate-pool pool-%u))\n"
+				"    (activate-pool pool-%u))\n",
+				i % 11, i % 11, i % 11, i % 11);
+	}
+}
+
+static char *gen_corpus_(size_t *len)
+{
+	unsigned i;
+	char *b = malloc(CORPUS_SIZE), *e = b;
+
+	assert(b);
+	for (i = 0; e + 1024 < b + CORPUS_SIZE; i++)
+		e += gen_form_(e, 1024, i);
+
+	*len = e - b;
+	return b;
+}
+
+static void count_form_(void *context, Value v)
+{
+	unsigned *nr_forms = context;
+	if (!(++*nr_forms % 4096))
+		mm_garbage_collect(NULL, 0);
+}
+
+static void bench_read()
+{
+	unsigned nr_forms = 0;
+	size_t len;
+	char *corpus = gen_corpus_(&len), *b;
+	double before, after;
+	String input;
+	TokenStream ts;
+	PushReader pr;
+	Value v;
+
+	before = now_();
+	input.b = corpus;
+	input.e = corpus + len;
+	stream_init(&input, &ts);
+	while (read_sexp(&ts, &v))
+		count_form_(&nr_forms, v);
+	after = now_();
+
+	fprintf(stderr, "read %u forms, %.1f MB/s\n", nr_forms,
+		len / (after - before) / (1024 * 1024));
+
+	nr_forms = 0;
+	before = now_();
+	pr_init(&pr);
+	for (b = corpus; b < corpus + len; b += 4096)
+		pr_feed(&pr, b, MIN(b + 4096, corpus + len), count_form_, &nr_forms);
+	pr_finish(&pr, count_form_, &nr_forms);
+	pr_exit(&pr);
+	after = now_();
+
+	fprintf(stderr, "push read %u forms, 4k chunks, %.1f MB/s\n", nr_forms,
+		len / (after - before) / (1024 * 1024));
+	free(corpus);
+}
+
+//----------------------------------------------------------------
+
+static void run(const char *name, void (*fn)())
+{
+	fprintf(stderr, "%s", name);
+	fprintf(stderr, "%*s... ", (int) (24 - strlen(name)), "");
+	fn();
+	fprintf(stderr, "ok\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	mm_init(64 * 1024 * 1024);
+	run("atoms", t_atoms);
+	run("lists", t_lists);
+	run("space and comments", t_space_and_comments);
+	run("long runs", t_long_runs);
+	run("numbers", t_numbers);
+	run("escapes", t_escapes);
+	run("dotted lists", t_dotted);
+	run("quote", t_quote);
+	run("push reader", t_push_reader);
+	run("push reader emits early", t_push_reader_emits_early);
+
+	bench_read();
+	mm_exit();
+
+	return 0;
+}
+
+//----------------------------------------------------------------
@@ -62,9 +62,23 @@ static void *mem_align(void *ptr, size_t align)
 // Chunk allocator
 //----------------------------------------------------------------
 
+// Chunks that have never been used are handed out from fresh onwards, so
+// we don't touch memory until it's needed.  Freed chunks go on the free
+// list.
+//
+// The memory is mapped at a fixed hint address, so that heap snapshots can
+// be mapped back in without relocating them (see mm_restore()).
+
+#if UINTPTR_MAX > 0xffffffff
+#define HEAP_HINT ((void *) 0x200000000000)
+#else
+#define HEAP_HINT ((void *) 0x50000000)
+#endif
+
 struct chunk_allocator__ {
 	size_t chunk_size;
 	void *mem_begin, *mem_end;
+	void *fresh;
 	struct list_head free;
 
 	// this is the total nr of times alloc has been called, frees are not
@@ -74,23 +88,19 @@ struct chunk_allocator__ {
 
 void ca_init(ChunkAllocator *ca, size_t chunk_size, size_t mem_size)
 {
-	void *ptr;
-
 	// Adjust mem_size to be a multiple of the chunk size
 	mem_size = chunk_size * (mem_size / chunk_size);
 
 	ca->chunk_size = chunk_size;
-	ca->mem_begin = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ca->mem_begin = mmap(HEAP_HINT, mem_size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 	if (ca->mem_begin == MAP_FAILED)
 		fail_("mmap failed, can't do anything without memory\n");
 	ca->mem_end = ca->mem_begin + mem_size;
 	ca->mem_begin = mem_align(ca->mem_begin, chunk_size);
+	ca->fresh = ca->mem_begin;
 
 	INIT_LIST_HEAD(&ca->free);
-	for (ptr = ca->mem_begin; (ptr + chunk_size) <= ca->mem_end; ptr += chunk_size)
-		list_add((struct list_head *) ptr, &ca->free);
-
 	ca->nr_allocs = 0;
 }
 
@@ -103,12 +113,18 @@ void *ca_alloc(ChunkAllocator *ca)
 {
 	void *ptr;
 
-	if (list_empty(&ca->free))
+	if (!list_empty(&ca->free)) {
+		ptr = ca->free.next;
+		list_del(ptr);
+
+	} else if (ca->fresh + ca->chunk_size <= ca->mem_end) {
+		ptr = ca->fresh;
+		ca->fresh += ca->chunk_size;
+
+	} else
 		fail_("out of memory");
 
 	ca->nr_allocs++;
-	ptr = ca->free.next;
-	list_del(ptr);
 
 	memset(ptr, 0xba, ca->chunk_size);
 	return ptr;
@@ -121,6 +137,34 @@ void ca_free(ChunkAllocator *ca, void *ptr)
 	list_add(tmp, &ca->free);
 }
 
+void ca_used(ChunkAllocator *ca, void **b, void **e)
+{
+	*b = ca->mem_begin;
+	*e = ca->fresh;
+}
+
+bool ca_map(ChunkAllocator *ca, void *b, void *e, int fd, off_t offset,
+	    const uint8_t *in_use)
+{
+	unsigned i;
+	void *ptr;
+
+	if (b != ca->mem_begin || e > ca->mem_end || ca->fresh != ca->mem_begin)
+		return false;
+
+	if (b != e &&
+	    mmap(b, e - b, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		 fd, offset) == MAP_FAILED)
+		fail_("couldn't map heap snapshot\n");
+
+	ca->fresh = e;
+	for (ptr = b, i = 0; ptr < e; ptr += ca->chunk_size, i++)
+		if (!in_use[i])
+			list_add((struct list_head *) ptr, &ca->free);
+
+	return true;
+}
+
 ChunkAllocator global_allocator_;
 
 //----------------------------------------------------------------
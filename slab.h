@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
 
 #include "list.h"
 
@@ -18,6 +19,15 @@ void ca_exit(ChunkAllocator *ca);
 void *ca_alloc(ChunkAllocator *ca);
 void ca_free(ChunkAllocator *ca, void *ptr);
 
+// [b, e) covers every chunk that's been handed out.
+void ca_used(ChunkAllocator *ca, void **b, void **e);
+
+// Maps a saved copy of the used chunks back in, from fd.  Only possible if
+// nothing's been allocated yet, and the memory is at the same address.
+// in_use has a byte per chunk, the others go on the free list.
+bool ca_map(ChunkAllocator *ca, void *b, void *e, int fd, off_t offset,
+	    const uint8_t *in_use);
+
 extern ChunkAllocator global_allocator_;
 
 //----------------------------------------------------------------
@@ -0,0 +1,544 @@
+#include "equality.h"
+#include "hash_table.h"
+#include "mm.h"
+#include "string_type.h"
+#include "symbol.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------
+
+static void t_hash_tmp_matches_clone()
+{
+	unsigned len;
+	static const char *txt = "0123456789abcdef0123456789abcdef0123456789";
+
+	for (len = 0; len <= strlen(txt); len++) {
+		String tmp = {txt, txt + len, 0};
+		String *s = mk_string(STRING, txt, txt + len);
+		assert(string_hash(&tmp) == string_hash(s));
+	}
+}
+
+static void t_hash_len_matters()
+{
+	static const char txt[] = "ab\0\0";
+	String *s1 = mk_string(STRING, txt, txt + 2);
+	String *s2 = mk_string(STRING, txt, txt + 3);
+	String *s3 = mk_string(STRING, txt, txt + 4);
+
+	assert(string_hash(s1) != string_hash(s2));
+	assert(string_hash(s2) != string_hash(s3));
+}
+
+static void t_hash_cached()
+{
+	String *s = mk_string_from_cstr(STRING, "vg0-lvol0");
+	uint32_t h = string_hash(s);
+
+	assert(s->hash == h);
+	assert(string_hash(s) == h);
+}
+
+static int sign(int n)
+{
+	return (n > 0) - (n < 0);
+}
+
+static void t_cmp()
+{
+	unsigned len, i;
+	char lhs[80], rhs[80];
+
+	for (len = 0; len < sizeof(lhs); len++) {
+		memset(lhs, 'a', len);
+		memset(rhs, 'a', len);
+
+		String l = {lhs, lhs + len, 0};
+		String r = {rhs, rhs + len, 0};
+		assert(string_eq(&l, &r));
+		assert(!string_cmp(&l, &r));
+
+		for (i = 0; i < len; i++) {
+			rhs[i] = (i & 1) ? 'b' : (char) 0xf0;
+			assert(!string_eq(&l, &r));
+			assert(sign(string_cmp(&l, &r)) == sign(memcmp(lhs, rhs, len)));
+			assert(sign(string_cmp(&r, &l)) == sign(memcmp(rhs, lhs, len)));
+			rhs[i] = 'a';
+		}
+
+		if (len) {
+			String shorter = {rhs, rhs + len - 1, 0};
+			assert(!string_eq(&l, &shorter));
+			assert(string_cmp(&l, &shorter) > 0);
+			assert(string_cmp(&shorter, &l) < 0);
+		}
+	}
+}
+
+static void t_symbols_interned()
+{
+	static const char *txt = "foobar";
+	String *foo = mk_symbol_cstr("foo");
+
+	assert(mk_symbol_cstr("foo") == foo);
+	assert(mk_symbol(txt, txt + 3) == foo);
+	assert(mk_symbol_cstr("bar") != foo);
+	assert(mk_symbol_cstr("bar") == mk_symbol(txt + 3, txt + 6));
+	assert(symbol_hash(foo) == string_hash(foo));
+}
+
+static void t_symbols_weak()
+{
+	unsigned i;
+	char buffer[32];
+	Value kept = mk_ref(mk_symbol_cstr("kept"));
+
+	for (i = 0; i < 10000; i++) {
+		snprintf(buffer, sizeof(buffer), "sym-%u", i);
+		mk_symbol_cstr(buffer);
+	}
+
+	mm_garbage_collect(&kept, 1);
+	assert(mk_symbol_cstr("kept") == kept.ptr);
+
+	// the dropped symbols should get recreated, with the right names
+	for (i = 0; i < 10000; i++) {
+		snprintf(buffer, sizeof(buffer), "sym-%u", i);
+		assert(!string_cmp_cstr(mk_symbol_cstr(buffer), buffer));
+	}
+	assert(mk_symbol_cstr("kept") == kept.ptr);
+}
+
+// A dm-status style line, long enough that slices aren't copied.
+static String *status_line_()
+{
+	return mk_string_from_cstr(STRING,
+		"0 2097152 thin-pool 1 1024/65536 18432/262144 - rw "
+		"discard_passdown queue_if_no_space - 1024");
+}
+
+static bool shares_(String *slice, String *parent)
+{
+	return slice->b >= parent->b && slice->e <= parent->e;
+}
+
+static void t_slice()
+{
+	String *line = status_line_();
+	String *s = string_slice(line, 10, 40);
+
+	assert(shares_(s, line));
+	assert(s->owner == line);
+	assert(string_len(s) == 30);
+	assert(!memcmp(s->b, line->b + 10, 30));
+
+	// slices of slices point at the original
+	s = string_slice(s, 5, 25);
+	assert(s->owner == line);
+	assert(!memcmp(s->b, line->b + 15, 20));
+
+	// short ones get copied
+	s = string_slice(line, 0, 4);
+	assert(!s->owner);
+	assert(!string_cmp_cstr(s, "0 20"));
+}
+
+static void t_slice_keeps_parent()
+{
+	unsigned i;
+	char buffer[4096];
+	Value slice;
+
+	for (i = 0; i < sizeof(buffer) - 1; i++)
+		buffer[i] = 'a' + (i % 26);
+	buffer[i] = '\0';
+
+	// the parent is a large object, so it'd get unmapped if it were freed
+	slice = mk_ref(string_slice(mk_string_from_cstr(STRING, buffer), 2000, 3000));
+	mm_garbage_collect(&slice, 1);
+	assert(!memcmp(((String *) slice.ptr)->b, buffer + 2000, 1000));
+}
+
+static void t_large_strings()
+{
+	unsigned i;
+	static char buffer[256 * 1024];
+	Value keep = mk_nil();
+
+	memset(buffer, 'x', sizeof(buffer) - 1);
+	for (i = 0; i < 1000; i++) {
+		String *s = mk_string_from_cstr(STRING, buffer);
+		assert(string_len(s) == sizeof(buffer) - 1);
+		if (i == 500)
+			keep = mk_ref(s);
+
+		if (!(i % 100))
+			mm_garbage_collect(&keep, 1);
+	}
+
+	mm_garbage_collect(&keep, 1);
+	assert(!string_cmp_cstr(keep.ptr, buffer));
+}
+
+static void t_split()
+{
+	String *line = status_line_();
+	String *space = mk_string_from_cstr(STRING, " ");
+	String *seps = mk_string_from_cstr(STRING, " /");
+	Value fields = string_split(line, space);
+
+	assert(list_len(fields) == 12);
+	assert(!string_cmp_cstr(car(fields).ptr, "0"));
+	assert(!string_cmp_cstr(car(cdr(cdr(fields))).ptr, "thin-pool"));
+
+	fields = string_split(line, seps);
+	assert(list_len(fields) == 14);
+	assert(!string_cmp_cstr(car(cdr(cdr(cdr(cdr(fields))))).ptr, "1024"));
+
+	assert(is_nil(string_split(mk_string_from_cstr(STRING, "   "), space)));
+}
+
+static void t_rope()
+{
+	unsigned i;
+	char buffer[32];
+	String *flat;
+	Value r = mk_ref(mk_string_from_cstr(STRING, ""));
+	size_t len = 0;
+
+	for (i = 0; i < 1000; i++) {
+		len += snprintf(buffer, sizeof(buffer), "field-%u ", i);
+		r = string_append(r, mk_ref(mk_string_from_cstr(STRING, buffer)));
+		assert(string_value_len(r) == len);
+	}
+
+	assert(get_type(r) == ROPE);
+	assert(((Rope *) r.ptr)->depth <= 32);
+
+	flat = as_flat_string(r);
+	assert(string_len(flat) == len);
+	assert(!memcmp(flat->b, "field-0 field-1 ", 16));
+	assert(!memcmp(flat->e - 10, "field-999 ", 10));
+	assert(as_flat_string(r) == flat);
+
+	// ropes are equal to, and hash like, the strings they spell
+	flat = mk_string(STRING, flat->b, flat->e);
+	assert(equalp(r, mk_ref(flat)));
+	assert(equalp(mk_ref(flat), r));
+	assert(!equalp(r, mk_ref(string_slice(flat, 0, 100))));
+	assert(ht_lookup(ht_insert(ht_empty(), r, mk_fixnum(1)), mk_ref(flat),
+			 &r));
+}
+
+// Returns the bytes allocated building a string of n x's a byte at a time.
+static size_t build_by_bytes_(unsigned n)
+{
+	unsigned i;
+	size_t before = memory_stats_.total_allocated;
+	Value x = mk_ref(mk_string_from_cstr(STRING, "x"));
+	Value r = mk_ref(mk_string_from_cstr(STRING, ""));
+	String *flat;
+
+	for (i = 0; i < n; i++)
+		r = string_append(r, x);
+
+	assert(string_value_len(r) == n);
+	assert(((Rope *) r.ptr)->depth <= 32);
+	flat = as_flat_string(r);
+	for (i = 0; i < n; i++)
+		assert(flat->b[i] == 'x');
+
+	return memory_stats_.total_allocated - before;
+}
+
+// Four times the bytes shouldn't cost much more than four times the
+// memory; copying the string every so often would cost sixteen.
+static void t_rope_appends()
+{
+	size_t small = build_by_bytes_(20000), big = build_by_bytes_(80000);
+	char buffer[80];
+	unsigned i;
+	Value r = mk_ref(mk_string_from_cstr(STRING, ""));
+	String *flat;
+
+	assert(big < 5 * small);
+
+	// prepending long pieces stays balanced too
+	for (i = 0; i < 2000; i++) {
+		snprintf(buffer, sizeof(buffer), "%070u", 1999 - i);
+		r = string_append(mk_ref(mk_string_from_cstr(STRING, buffer)), r);
+	}
+
+	assert(((Rope *) r.ptr)->depth <= 32);
+	flat = as_flat_string(r);
+	for (i = 0; i < 2000; i++) {
+		snprintf(buffer, sizeof(buffer), "%070u", i);
+		assert(!memcmp(flat->b + 70 * i, buffer, 70));
+	}
+}
+
+static void t_read_from_file()
+{
+	FILE *fp;
+	char path[] = "/tmp/string_t.XXXXXX";
+	int fd = mkstemp(path);
+	Value file, v, kept;
+	String input;
+	TokenStream ts;
+
+	assert(fd >= 0);
+	fp = fdopen(fd, "w");
+	fprintf(fp, "(define-table \"0 2097152 thin-pool /dev/sdb 128\") 'foo\n");
+	fclose(fp);
+
+	file = mk_ref(mk_string_from_file(path));
+	unlink(path);
+
+	input = *((String *) file.ptr);
+	stream_init_shared(file.ptr, &input, &ts);
+	assert(read_sexp(&ts, &v));
+
+	// the string shares the file's bytes
+	kept = car(cdr(v));
+	assert(get_type(kept) == STRING);
+	assert(((String *) kept.ptr)->owner == file.ptr);
+	assert(!string_cmp_cstr(kept.ptr, "0 2097152 thin-pool /dev/sdb 128"));
+
+	assert(read_sexp(&ts, &v));
+	assert(!read_sexp(&ts, &v));
+
+	// and keeps the mapping alive
+	mm_garbage_collect(&kept, 1);
+	assert(!string_cmp_cstr(kept.ptr, "0 2097152 thin-pool /dev/sdb 128"));
+}
+
+//----------------------------------------------------------------
+// Hash benchmarks
+//
+// Data sets are generated from a fixed seed, so runs are comparable.
+
+#define NR_KEYS (64 * 1024)
+#define NR_PASSES 64
+
+static uint32_t seed_;
+
+static uint32_t rand_()
+{
+	// xorshift32
+	seed_ ^= seed_ << 13;
+	seed_ ^= seed_ >> 17;
+	seed_ ^= seed_ << 5;
+	return seed_;
+}
+
+static void rand_hex_(char *buffer, unsigned n)
+{
+	static const char *hex = "0123456789abcdef";
+
+	while (n--)
+		*buffer++ = hex[rand_() & 0xf];
+	*buffer = '\0';
+}
+
+static void gen_dev_name(char *buffer, size_t len, unsigned i)
+{
+	snprintf(buffer, len, "vg%u-lvol%u", i % 37, i);
+}
+
+static void gen_mapper_path(char *buffer, size_t len, unsigned i)
+{
+	snprintf(buffer, len, "/dev/mapper/pool%u-thin%u-tdata", i % 11, i);
+}
+
+// RFC 4122 style
+static void gen_uuid(char *buffer, size_t len, unsigned i)
+{
+	char hex[33];
+	rand_hex_(hex, 32);
+	snprintf(buffer, len, "%.8s-%.4s-%.4s-%.4s-%.12s",
+		 hex, hex + 8, hex + 12, hex + 16, hex + 20);
+}
+
+// LVM style; vg uuid followed by lv uuid, the vg uuid is shared.
+static void gen_lvm_uuid(char *buffer, size_t len, unsigned i)
+{
+	char hex[33];
+	rand_hex_(hex, 32);
+	snprintf(buffer, len, "LVM-8Hdzh0dUHkdvRSMdFXUYwTSWxj6ObmE1%s", hex);
+}
+
+// The hash this replaced, kept for comparison.
+static uint32_t old_hash_(String *s)
+{
+	const char *ptr = s->b;
+	uint32_t h = 0, a = 31415, b = 27183;
+
+	while (ptr != s->e) {
+		h = a * h + *ptr;
+
+		a = (a * b) % (UINT32_MAX - 1);
+		ptr++;
+	}
+
+	return h;
+}
+
+static uint32_t new_hash_(String *s)
+{
+	s->hash = 0;
+	return string_hash(s);
+}
+
+static int cmp_u32(const void *l, const void *r)
+{
+	uint32_t lhs = *((const uint32_t *) l), rhs = *((const uint32_t *) r);
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+static unsigned count_collisions_(uint32_t *hs, unsigned n)
+{
+	unsigned i, r = 0;
+
+	qsort(hs, n, sizeof(*hs), cmp_u32);
+	for (i = 1; i < n; i++)
+		if (hs[i] == hs[i - 1])
+			r++;
+
+	return r;
+}
+
+// Chi-squared of the bucket counts for the given bit field, divided by the
+// degrees of freedom; ~1.0 is what you'd expect from a random function.
+static double chi2_(uint32_t *hs, unsigned n, unsigned shift, unsigned bits)
+{
+	unsigned i, nr_buckets = 1u << bits;
+	unsigned counts[nr_buckets];
+	double expected = ((double) n) / nr_buckets, total = 0.0;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++)
+		counts[(hs[i] >> shift) & (nr_buckets - 1)]++;
+
+	for (i = 0; i < nr_buckets; i++) {
+		double d = counts[i] - expected;
+		total += d * d / expected;
+	}
+
+	return total / (nr_buckets - 1);
+}
+
+static double now_()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void bench_hash(const char *name, String **keys,
+		       uint32_t (*fn)(String *))
+{
+	unsigned i, pass;
+	size_t bytes = 0;
+	double before, after;
+	static uint32_t hs[NR_KEYS];
+	volatile uint32_t sink = 0;
+
+	for (i = 0; i < NR_KEYS; i++) {
+		hs[i] = fn(keys[i]);
+		bytes += string_len(keys[i]);
+	}
+
+	before = now_();
+	for (pass = 0; pass < NR_PASSES; pass++)
+		for (i = 0; i < NR_KEYS; i++)
+			sink += fn(keys[i]);
+	after = now_();
+
+	fprintf(stderr, "    %-4s %8.1f MB/s, nibble0 chi2 %5.2f, "
+		"low12 chi2 %5.2f, high12 chi2 %5.2f, collisions %u\n",
+		name, (bytes * NR_PASSES) / (after - before) / (1024 * 1024),
+		chi2_(hs, NR_KEYS, 0, 4), chi2_(hs, NR_KEYS, 0, 12),
+		chi2_(hs, NR_KEYS, 20, 12), count_collisions_(hs, NR_KEYS));
+}
+
+static void bench_data_set(const char *name,
+			   void (*gen)(char *, size_t, unsigned))
+{
+	unsigned i;
+	char buffer[128];
+	static String *keys[NR_KEYS];
+
+	seed_ = 0x12345678;
+	for (i = 0; i < NR_KEYS; i++) {
+		gen(buffer, sizeof(buffer), i);
+		keys[i] = mk_string_from_cstr(STRING, buffer);
+	}
+
+	fprintf(stderr, "%s (eg, '%s')\n", name, buffer);
+	bench_hash("old", keys, old_hash_);
+	bench_hash("new", keys, new_hash_);
+
+	mm_garbage_collect(NULL, 0);
+}
+
+//----------------------------------------------------------------
+
+static size_t total_allocated_()
+{
+	return memory_stats_.total_allocated;
+}
+
+static void indent(unsigned n)
+{
+	while (n--)
+		fputc(' ', stderr);
+}
+
+static void run(const char *name, void (*fn)())
+{
+	size_t before, after;
+
+	fprintf(stderr, "%s", name);
+	indent(24 - strlen(name));
+	fprintf(stderr, "... ");
+	before = total_allocated_();
+
+	fn();
+
+	after = total_allocated_();
+	fprintf(stderr, "%llu\n", (unsigned long long) (after - before));
+}
+
+int main(int argc, const char *argv[])
+{
+	mm_init(64 * 1024 * 1024);
+	run("hash tmp matches clone", t_hash_tmp_matches_clone);
+	run("hash length matters", t_hash_len_matters);
+	run("hash cached", t_hash_cached);
+	run("cmp", t_cmp);
+	run("symbols interned", t_symbols_interned);
+	run("symbols weak", t_symbols_weak);
+	run("slice", t_slice);
+	run("slice keeps parent", t_slice_keeps_parent);
+	run("large strings", t_large_strings);
+	run("split", t_split);
+	run("rope", t_rope);
+	run("rope appends", t_rope_appends);
+	run("read from file", t_read_from_file);
+
+	bench_data_set("device names", gen_dev_name);
+	bench_data_set("mapper paths", gen_mapper_path);
+	bench_data_set("uuids", gen_uuid);
+	bench_data_set("lvm uuids", gen_lvm_uuid);
+	mm_exit();
+
+	return 0;
+}
+
+//----------------------------------------------------------------
@@ -1,10 +1,20 @@
 #include "string_type.h"
 
+#include "cons.h"
+#include "error.h"
 #include "mm.h"
 
+#include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 //----------------------------------------------------------------
 
@@ -12,6 +22,8 @@ void string_tmp(const char *cstr, String *str)
 {
 	str->b = cstr;
 	str->e = cstr + strlen(cstr);
+	str->hash = 0;
+	str->owner = NULL;
 }
 
 static size_t p4(size_t len)
@@ -19,17 +31,27 @@ static size_t p4(size_t len)
 	return 4 - (len & 3);
 }
 
-// We pad the string up to a 4-byte boundary so we can calculate the hash in
-// word sized chunks.
-static String *string_clone_(ObjectType t, String *str)
+// We pad the string with zeroes up to a 4-byte boundary.  There's always at
+// least one byte of padding, so the contents are nul terminated.  Slices
+// aren't padded, so don't rely on this unless you made the string.
+static String *alloc_string_(ObjectType t, size_t len)
 {
-	size_t len = str->e - str->b;
 	size_t padding = p4(len);
-	String *copy = mm_alloc(t, sizeof(*copy) + len + padding);
-	copy->b = (const char *) (copy + 1);
-	copy->e = copy->b + len;
-	memcpy((char *) copy->b, str->b, len);
-	memset((char *) copy->e, 0, padding);
+	String *str = mm_alloc(t, sizeof(*str) + len + padding);
+	str->b = (const char *) (str + 1);
+	str->e = str->b + len;
+	str->hash = 0;
+	str->owner = NULL;
+	memset((char *) str->e, 0, padding);
+
+	return str;
+}
+
+static String *string_clone_(ObjectType t, String *str)
+{
+	String *copy = alloc_string_(t, string_len(str));
+	copy->hash = str->hash;
+	memcpy((char *) copy->b, str->b, string_len(str));
 
 	return copy;
 }
@@ -39,9 +61,22 @@ String *mk_string(ObjectType t, const char *b, const char *e)
 	String tmp;
 	tmp.b = b;
 	tmp.e = e;
+	tmp.hash = 0;
 	return string_clone_(t, &tmp);
 }
 
+String *mk_string_uninit(ObjectType t, size_t len)
+{
+	return alloc_string_(t, len);
+}
+
+void string_end(String *str, char *e)
+{
+	assert(e >= str->b && e <= str->e);
+	*e = '\0';
+	str->e = e;
+}
+
 String *mk_string_from_cstr(ObjectType t, const char *str)
 {
 	String tmp;
@@ -49,14 +84,121 @@ String *mk_string_from_cstr(ObjectType t, const char *str)
 	return string_clone_(t, &tmp);
 }
 
+String *mk_string_from_file(const char *path)
+{
+	int fd;
+	struct stat info;
+	String *str;
+	const void *data;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		error("couldn't open '%s'", path);
+
+	if (fstat(fd, &info) < 0)
+		error("couldn't stat '%s'", path);
+
+	// mmap() won't do empty files
+	if (!info.st_size) {
+		close(fd);
+		return mk_string_from_cstr(STRING, "");
+	}
+
+	str = mm_alloc_file(STRING, sizeof(*str), fd, info.st_size, &data);
+	if (!str)
+		error("couldn't mmap '%s'", path);
+
+	// the mapping holds a reference to the file
+	close(fd);
+
+	str->b = data;
+	str->e = str->b + info.st_size;
+	str->hash = 0;
+	str->owner = NULL;
+
+	return str;
+}
+
+//----------------------------------------------------------------
+// Comparison
+//
+// Most of the strings we compare are short; symbols, device names, uuids.
+// For these the overhead of calling memcmp() dominates, so we have our own
+// kernel.  It works in 32 or 16 byte chunks if AVX2 or SSE2 are available,
+// then a word at a time, and never reads past len.
+
+static inline uint32_t load32(const char *ptr)
+{
+	uint32_t w;
+	memcpy(&w, ptr, sizeof(w));
+	return w;
+}
+
+// Returns the index of the first byte that differs, or len.
+static inline size_t mismatch_(const char *l, const char *r, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (l + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (r + i));
+		uint32_t diff = ~((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+#endif
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (l + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (r + i));
+		unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+#endif
+
+	for (; i + 4 <= len; i += 4)
+		if (load32(l + i) != load32(r + i))
+			break;
+
+	for (; i < len; i++)
+		if (l[i] != r[i])
+			break;
+
+	return i;
+}
+
+bool string_eq(String *lhs, String *rhs)
+{
+	size_t len = string_len(lhs);
+
+	if (lhs == rhs)
+		return true;
+
+	if (len != string_len(rhs))
+		return false;
+
+	// Only use the hashes if they've already been calculated.
+	if (lhs->hash && rhs->hash && lhs->hash != rhs->hash)
+		return false;
+
+	return mismatch_(lhs->b, rhs->b, len) == len;
+}
+
 int string_cmp(String *lhs, String *rhs)
 {
 	size_t lhs_len = string_len(lhs);
 	size_t rhs_len = string_len(rhs);
-	int cmp = memcmp(lhs->b, rhs->b, MIN(lhs_len, rhs_len));
+	size_t len = MIN(lhs_len, rhs_len);
+	size_t i = mismatch_(lhs->b, rhs->b, len);
 
-	if (cmp)
-		return cmp;
+	// memcmp() semantics; bytes are compared as unsigned.
+	if (i != len)
+		return ((unsigned char) lhs->b[i]) - ((unsigned char) rhs->b[i]);
 
 	if (lhs_len < rhs_len)
 		return -1;
@@ -74,23 +216,373 @@ int string_cmp_cstr(String *lhs, const char *rhs)
 	return string_cmp(lhs, &tmp);
 }
 
-// FIXME: it's really important this hash is good and runs quickly:
-// - statically generate the sequence a
-// - consume the string a word at a time (pad with zeroes on allocation)
-// - draw some graphs with some representative datasets
-uint32_t string_hash(String *s)
+//----------------------------------------------------------------
+// Hashing
+//
+// This is xxHash32 (without the seed), which is cheap on 32 bit targets;
+// it only needs 32 bit multiplies.  Strings longer than 16 bytes are
+// consumed in 16 byte stripes by four independent accumulators, so there's
+// plenty of instruction level parallelism and the compiler is free to
+// vectorise.  The tail is consumed a word at a time, with the final partial
+// word zero padded, rather than a byte at a time like the reference
+// implementation.
+
+#define PRIME1 0x9E3779B1u
+#define PRIME2 0x85EBCA77u
+#define PRIME3 0xC2B2AE3Du
+#define PRIME4 0x27D4EB2Fu
+#define PRIME5 0x165667B1u
+
+static inline uint32_t rotl32(uint32_t x, unsigned r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t round_(uint32_t acc, uint32_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl32(acc, 13);
+	return acc * PRIME1;
+}
+
+static uint32_t hash_bytes_(const char *b, const char *e)
 {
-	const char *ptr = s->b;
-	uint32_t h = 0, a = 31415, b = 27183;
+	size_t len = e - b;
+	uint32_t h, w;
+
+	if (len >= 16) {
+		const char *limit = e - 16;
+		uint32_t v1 = PRIME1 + PRIME2;
+		uint32_t v2 = PRIME2;
+		uint32_t v3 = 0;
+		uint32_t v4 = -PRIME1;
 
-	while (ptr != s->e) {
-		h = a * h + *ptr;
+		do {
+			v1 = round_(v1, load32(b));
+			v2 = round_(v2, load32(b + 4));
+			v3 = round_(v3, load32(b + 8));
+			v4 = round_(v4, load32(b + 12));
+			b += 16;
+		} while (b <= limit);
 
-		a = (a * b) % (UINT32_MAX - 1);
-		ptr++;
+		h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+	} else
+		h = PRIME5;
+
+	h += (uint32_t) len;
+
+	while (b + 4 <= e) {
+		h += load32(b) * PRIME3;
+		h = rotl32(h, 17) * PRIME4;
+		b += 4;
+	}
+
+	if (b != e) {
+		w = 0;
+		memcpy(&w, b, e - b);
+		h += w * PRIME3;
+		h = rotl32(h, 17) * PRIME4;
 	}
 
+	// avalanche
+	h ^= h >> 15;
+	h *= PRIME2;
+	h ^= h >> 13;
+	h *= PRIME3;
+	h ^= h >> 16;
+
 	return h;
 }
 
+// Strings are immutable, so the hash is calculated on first use and cached.
+// Zero means 'not calculated yet', so a hash of zero gets nudged.
+uint32_t string_hash(String *s)
+{
+	if (!s->hash) {
+		uint32_t h = hash_bytes_(s->b, s->e);
+		s->hash = h ? h : 1;
+	}
+
+	return s->hash;
+}
+
+//----------------------------------------------------------------
+// Slices
+//
+// Very short slices are copied; the String header is as big as they are,
+// and we don't want a few bytes pinning a large parent.
+
+#define MIN_SLICE 16
+
+String *string_slice(String *str, unsigned b, unsigned e)
+{
+	String *slice;
+
+	if (b > e || e > string_len(str))
+		error("substring out of range");
+
+	if (e - b < MIN_SLICE)
+		return mk_string(STRING, str->b + b, str->b + e);
+
+	slice = mm_alloc(STRING, sizeof(*slice));
+	slice->b = str->b + b;
+	slice->e = str->b + e;
+	slice->hash = 0;
+	slice->owner = str->owner ? str->owner : str;
+
+	return slice;
+}
+
+static bool is_sep_(String *seps, char c)
+{
+	return memchr(seps->b, c, string_len(seps)) != NULL;
+}
+
+Value string_split(String *str, String *seps)
+{
+	ListBuilder lb;
+	const char *b = str->b, *e;
+
+	lb_init(&lb);
+	for (;;) {
+		while (b != str->e && is_sep_(seps, *b))
+			b++;
+
+		if (b == str->e)
+			break;
+
+		for (e = b; e != str->e && !is_sep_(seps, *e); e++)
+			;
+
+		lb_append(&lb, mk_ref(string_slice(str, b - str->b, e - str->b)));
+		b = e;
+	}
+
+	return lb_get(&lb);
+}
+
+//----------------------------------------------------------------
+// Ropes
+//
+// Appending builds a tree rather than copying.  Short results are copied
+// since a rope node is bigger than the bytes, and short strings appended
+// to a rope are gathered into a short last leaf, so building a string a
+// byte at a time costs a node and a short copy per byte.  Trees are joined
+// as AVL trees, so depth is logarithmic in the number of leaves and the
+// recursive walks below can't blow the stack.
+
+#define MIN_ROPE 64
+
+static unsigned rope_depth_(Value v)
+{
+	return get_type(v) == ROPE ? ((Rope *) v.ptr)->depth : 0;
+}
+
+unsigned string_value_len(Value v)
+{
+	switch (get_type(v)) {
+	case STRING:
+		return string_len(v.ptr);
+
+	case ROPE:
+		return ((Rope *) v.ptr)->len;
+
+	default:
+		error("type error: expected a string");
+	}
+
+	return 0;
+}
+
+static char *copy_leaves_(Value v, char *dest)
+{
+	String *str;
+	Rope *rope;
+
+	if (get_type(v) == STRING) {
+		str = v.ptr;
+		memcpy(dest, str->b, string_len(str));
+		return dest + string_len(str);
+	}
+
+	rope = v.ptr;
+	if (rope->flat)
+		return copy_leaves_(mk_ref(rope->flat), dest);
+
+	dest = copy_leaves_(rope->left, dest);
+	return copy_leaves_(rope->right, dest);
+}
+
+static String *flatten_(Value v)
+{
+	String *str = alloc_string_(STRING, string_value_len(v));
+	copy_leaves_(v, (char *) str->b);
+	return str;
+}
+
+String *as_flat_string(Value v)
+{
+	Rope *rope;
+
+	if (get_type(v) == STRING)
+		return v.ptr;
+
+	string_value_len(v);	// type check
+	rope = v.ptr;
+	if (!rope->flat)
+		rope->flat = flatten_(v);
+
+	return rope->flat;
+}
+
+static Value rope_(Value lhs, Value rhs)
+{
+	Rope *rope = mm_alloc(ROPE, sizeof(*rope));
+
+	rope->left = lhs;
+	rope->right = rhs;
+	rope->len = string_value_len(lhs) + string_value_len(rhs);
+	rope->depth = MAX(rope_depth_(lhs), rope_depth_(rhs)) + 1;
+	rope->flat = NULL;
+
+	return mk_ref(rope);
+}
+
+static inline Value left_(Value v)
+{
+	return ((Rope *) v.ptr)->left;
+}
+
+static inline Value right_(Value v)
+{
+	return ((Rope *) v.ptr)->right;
+}
+
+static Value flat_append_(Value lhs, Value rhs)
+{
+	String *str = alloc_string_(STRING, string_value_len(lhs) + string_value_len(rhs));
+
+	copy_leaves_(rhs, copy_leaves_(lhs, (char *) str->b));
+	return mk_ref(str);
+}
+
+// (a (b c)) -> ((a b) c)
+static Value rotate_left_(Value v)
+{
+	Value r = right_(v);
+	return rope_(rope_(left_(v), left_(r)), right_(r));
+}
+
+// ((a b) c) -> (a (b c))
+static Value rotate_right_(Value v)
+{
+	Value l = left_(v);
+	return rope_(left_(l), rope_(right_(l), right_(v)));
+}
+
+// lhs is more than one deeper than rhs, so rhs goes down lhs's right spine.
+static Value join_right_(Value lhs, Value rhs)
+{
+	Value a = left_(lhs), c = right_(lhs), t;
+
+	if (rope_depth_(c) <= rope_depth_(rhs) + 1) {
+		t = rope_(c, rhs);
+		if (rope_depth_(t) <= rope_depth_(a) + 1)
+			return rope_(a, t);
+
+		return rotate_left_(rope_(a, rotate_right_(t)));
+	}
+
+	t = join_right_(c, rhs);
+	if (rope_depth_(t) <= rope_depth_(a) + 1)
+		return rope_(a, t);
+
+	return rotate_left_(rope_(a, t));
+}
+
+static Value join_left_(Value lhs, Value rhs)
+{
+	Value c = left_(rhs), a = right_(rhs), t;
+
+	if (rope_depth_(c) <= rope_depth_(lhs) + 1) {
+		t = rope_(lhs, c);
+		if (rope_depth_(t) <= rope_depth_(a) + 1)
+			return rope_(t, a);
+
+		return rotate_right_(rope_(rotate_left_(t), a));
+	}
+
+	t = join_left_(lhs, c);
+	if (rope_depth_(t) <= rope_depth_(a) + 1)
+		return rope_(t, a);
+
+	return rotate_right_(rope_(t, a));
+}
+
+static Value join_(Value lhs, Value rhs)
+{
+	if (rope_depth_(lhs) > rope_depth_(rhs) + 1)
+		return join_right_(lhs, rhs);
+
+	if (rope_depth_(rhs) > rope_depth_(lhs) + 1)
+		return join_left_(lhs, rhs);
+
+	return rope_(lhs, rhs);
+}
+
+// rhs is a short string, and v a rope.  The leaf being appended to is kept
+// at the top, so it can be replaced without copying a path; it joins the
+// balanced tree on its left once it's full.
+static Value append_short_(Value v, Value rhs)
+{
+	Value last = right_(v);
+
+	if (get_type(last) != STRING)
+		return rope_(v, rhs);
+
+	if (string_len(last.ptr) + string_value_len(rhs) < MIN_ROPE)
+		return rope_(left_(v), flat_append_(last, rhs));
+
+	return rope_(join_(left_(v), last), rhs);
+}
+
+Value string_append(Value lhs, Value rhs)
+{
+	unsigned len = string_value_len(lhs) + string_value_len(rhs);
+
+	if (!string_value_len(lhs))
+		return rhs;
+
+	if (!string_value_len(rhs))
+		return lhs;
+
+	if (len < MIN_ROPE)
+		return flat_append_(lhs, rhs);
+
+	if (get_type(lhs) == ROPE && get_type(rhs) == STRING &&
+	    string_value_len(rhs) < MIN_ROPE)
+		return append_short_(lhs, rhs);
+
+	return join_(lhs, rhs);
+}
+
+void string_walk(Value v, void (*fn)(void *, String *), void *context)
+{
+	Rope *rope;
+
+	if (get_type(v) == STRING) {
+		fn(context, v.ptr);
+		return;
+	}
+
+	rope = v.ptr;
+	if (rope->flat)
+		fn(context, rope->flat);
+
+	else {
+		string_walk(rope->left, fn, context);
+		string_walk(rope->right, fn, context);
+	}
+}
+
 //----------------------------------------------------------------
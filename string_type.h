@@ -15,11 +15,37 @@ static inline unsigned string_len(String *str)
 String *mk_string(ObjectType t, const char *b, const char *e);
 String *mk_string_from_cstr(ObjectType t, const char *str);
 
+// For strings that are built in place: there's room for len bytes, which the
+// caller fills in, before marking the real end with string_end().
+String *mk_string_uninit(ObjectType t, size_t len);
+void string_end(String *str, char *e);
+
+// The contents are the mmap'd file, so aren't nul terminated.  Slices of it
+// keep it mapped.
+String *mk_string_from_file(const char *path);
+
+// Quicker than string_cmp() if you only need to know about equality.
+bool string_eq(String *lhs, String *rhs);
 int string_cmp(String *lhs, String *rhs);
 int string_cmp_cstr(String *lhs, const char *rhs);
 
 uint32_t string_hash(String *s);
 
+// Returns a STRING that shares str's bytes; str must be on the heap.
+String *string_slice(String *str, unsigned b, unsigned e);
+
+// Splits on runs of any of the characters in seps, returning a list of
+// slices.
+Value string_split(String *str, String *seps);
+
+// These accept either STRINGs or ROPEs.
+unsigned string_value_len(Value v);
+Value string_append(Value lhs, Value rhs);
+String *as_flat_string(Value v);
+
+// Calls fn on each of the pieces of v in turn, without flattening.
+void string_walk(Value v, void (*fn)(void *, String *), void *context);
+
 //----------------------------------------------------------------
 
 #endif
@@ -0,0 +1,166 @@
+#include "symbol.h"
+
+#include "error.h"
+#include "mm.h"
+#include "string_type.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//----------------------------------------------------------------
+// The symbol table is an open addressed hash table with linear probing.
+// It's allocated with malloc rather than on the managed heap since it gets
+// updated part way through a garbage collection, and since it must not keep
+// the symbols alive.
+
+#define TOMBSTONE ((String *) 1)
+#define INITIAL_BUCKETS 1024
+
+typedef struct {
+	unsigned nr_buckets;	// always a power of 2
+	unsigned nr_live;
+	unsigned nr_used;	// live entries + tombstones
+	String **buckets;
+} SymbolTable;
+
+static SymbolTable table_;
+
+static void st_alloc_(SymbolTable *st, unsigned nr_buckets)
+{
+	st->nr_buckets = nr_buckets;
+	st->nr_live = 0;
+	st->nr_used = 0;
+	st->buckets = calloc(nr_buckets, sizeof(*st->buckets));
+	if (!st->buckets)
+		error("out of memory");
+}
+
+static bool is_live_(String *sym)
+{
+	return sym && sym != TOMBSTONE;
+}
+
+static bool sym_matches_(String *sym, uint32_t h, const char *b, size_t len)
+{
+	return sym->hash == h &&
+		string_len(sym) == len &&
+		!memcmp(sym->b, b, len);
+}
+
+// Returns the bucket holding the symbol, or the bucket it should be
+// inserted into.
+static String **st_find_(SymbolTable *st, uint32_t h, const char *b, size_t len)
+{
+	unsigned mask = st->nr_buckets - 1;
+	unsigned i = h & mask;
+	String **tombstone = NULL;
+
+	for (;; i = (i + 1) & mask) {
+		String **bucket = st->buckets + i;
+
+		if (!*bucket)
+			return tombstone ? tombstone : bucket;
+
+		if (*bucket == TOMBSTONE) {
+			if (!tombstone)
+				tombstone = bucket;
+
+		} else if (sym_matches_(*bucket, h, b, len))
+			return bucket;
+	}
+}
+
+// Rebuilds the table, dropping any tombstones.
+static void st_rehash_(SymbolTable *st, unsigned nr_buckets)
+{
+	unsigned i;
+	SymbolTable new;
+
+	st_alloc_(&new, nr_buckets);
+	for (i = 0; i < st->nr_buckets; i++) {
+		String *sym = st->buckets[i];
+
+		if (is_live_(sym)) {
+			*st_find_(&new, sym->hash, sym->b, string_len(sym)) = sym;
+			new.nr_live++;
+			new.nr_used++;
+		}
+	}
+
+	free(st->buckets);
+	*st = new;
+}
+
+// Makes room for another entry.
+static void st_reserve_(SymbolTable *st)
+{
+	if (!st->buckets)
+		st_alloc_(st, INITIAL_BUCKETS);
+
+	// Keep the load factor below 3/4.  If it's mainly tombstones we can
+	// just clear them out.
+	if ((st->nr_used + 1) * 4 > st->nr_buckets * 3)
+		st_rehash_(st, st->nr_live * 2 > st->nr_buckets ?
+			   st->nr_buckets * 2 : st->nr_buckets);
+}
+
+String *mk_symbol(const char *b, const char *e)
+{
+	String tmp, **bucket;
+	uint32_t h;
+
+	st_reserve_(&table_);
+
+	tmp.b = b;
+	tmp.e = e;
+	tmp.hash = 0;
+	h = string_hash(&tmp);
+
+	bucket = st_find_(&table_, h, b, e - b);
+	if (!is_live_(*bucket)) {
+		if (!*bucket)
+			table_.nr_used++;
+
+		table_.nr_live++;
+		*bucket = mk_string(SYMBOL, b, e);
+		(*bucket)->hash = h;
+	}
+
+	return *bucket;
+}
+
+String *mk_symbol_cstr(const char *str)
+{
+	return mk_symbol(str, str + strlen(str));
+}
+
+void symbol_table_add(String *sym)
+{
+	String **bucket;
+
+	st_reserve_(&table_);
+	bucket = st_find_(&table_, sym->hash, sym->b, string_len(sym));
+	if (!is_live_(*bucket)) {
+		if (!*bucket)
+			table_.nr_used++;
+
+		table_.nr_live++;
+		*bucket = sym;
+	}
+}
+
+void symbol_table_sweep(void)
+{
+	unsigned i;
+
+	for (i = 0; i < table_.nr_buckets; i++) {
+		String *sym = table_.buckets[i];
+
+		if (is_live_(sym) && !ca_marked(ca_address(sym))) {
+			table_.buckets[i] = TOMBSTONE;
+			table_.nr_live--;
+		}
+	}
+}
+
+//----------------------------------------------------------------
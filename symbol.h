@@ -0,0 +1,29 @@
+#ifndef DMEXEC_SYMBOL_H
+#define DMEXEC_SYMBOL_H
+
+#include "types.h"
+
+//----------------------------------------------------------------
+
+// Symbols are interned, so there is only ever one symbol object with a
+// given name.  This means they can be compared by pointer, and they carry
+// a precalculated hash.
+String *mk_symbol(const char *b, const char *e);
+String *mk_symbol_cstr(const char *str);
+
+static inline uint32_t symbol_hash(String *sym)
+{
+	return sym->hash;
+}
+
+// For symbols that are already on the heap, eg, after restoring a snapshot.
+// sym->hash must be set.
+void symbol_table_add(String *sym);
+
+// The symbol table holds weak references.  Called by the garbage collector
+// once marking is complete, to drop the symbols that weren't reached.
+void symbol_table_sweep(void);
+
+//----------------------------------------------------------------
+
+#endif
@@ -24,9 +24,10 @@ typedef enum {
 	STATIC_ENV,
 	THUNK,
 	RAW,
+	ROPE,
+	INT64,		// integers too big for a fixnum, see mk_int()
 
 	/* these are always tagged immediate values */
-	// FIXME we need 64 bit integers for device sizes
 	FIXNUM,
 } ObjectType;
 
@@ -51,24 +52,45 @@ typedef enum {
 	TOK_EOF
 } TokenType;
 
-// FIXME: Use another of Phil Bagwell's immutable structures
-typedef struct {
+// Strings are immutable, so substrings can share their parent's bytes.  A
+// slice has owner pointing at the string that holds the bytes, which keeps
+// it alive; owner is NULL if the bytes follow the String itself.
+typedef struct string {
        const char *b;
        const char *e;
+       uint32_t hash; // cached by string_hash(), 0 if not calculated yet
+       struct string *owner;
 } String;
 
+// A concatenation of two STRINGs or ROPEs, see string_append().  Flattened
+// lazily, the result is cached in flat.
+typedef struct {
+	Value left;
+	Value right;
+	unsigned len;
+	unsigned depth;
+	String *flat;
+} Rope;
+
 typedef struct {
 	TokenType type;
 	String str;
-	int fixnum;
+	int64_t fixnum;
+	bool escaped; // the string contains escapes, str is still raw
 } Token;
 
-// FIXME: remove this limit, use a Vector instead.
-#define MAX_STACK 4096
+// The value stack is a list of fixed size chunks, so it only takes the
+// memory a computation needs.  Chunks are allocated as it grows, see
+// eval.c.
+typedef struct _stack_chunk {
+	struct _stack_chunk *prev, *next;
+	Value values[0];
+} StackChunk;
 
 typedef struct {
-	unsigned current;
-	Value sp[MAX_STACK];
+	Value *sp, *b, *e; // within the current chunk
+	StackChunk *chunk;
+	unsigned nr_chunks;
 } Stack;
 
 typedef struct _frame {
@@ -105,6 +127,9 @@ typedef struct __vector {
 #define ENTRIES_PER_HBLOCK 16
 
 typedef struct {
+	// The full hash of key, cached so we never have to recalculate it.
+	uint32_t hash;
+
 	union {
 		uint32_t map;
 		Value key;
@@ -115,10 +140,16 @@ typedef struct {
 	Value val;
 } HashEntry;
 
-typedef HashEntry *HBlock;
+// edit is non-zero if the block was created by a transient table, and may
+// be updated in place by that table.
+typedef struct {
+	uint32_t edit;
+	HashEntry entries[0];
+} HBlock;
 
 typedef struct {
 	unsigned nr_entries;
+	uint32_t edit; // non-zero whilst transient
 	HashEntry root;
 } HashTable;
 
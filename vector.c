@@ -1,4 +1,7 @@
 #include "vector.h"
+
+#include "equality.h"
+#include "utils.h"
 #include "vm.h"
 
 #include <assert.h>
@@ -34,9 +37,7 @@ Vector *v_empty()
 
 Value list_to_vector(Value xs)
 {
-	Vector *v = v_empty();
-
-	v_transient_begin(v);
+	Vector *v = v_transient_begin(v_empty());
 
 	while (!is_nil(xs)) {
 		v_push(v, car(xs));
@@ -191,7 +192,10 @@ static Vector *shrink_(Vector *v, unsigned new_size)
 	v->size = new_size;
 
 	// Drop entries beyond new_size so they can be GCd.
-	v->root = trim_(v->root, v->size, size_to_levels_(v->size));
+	if (new_size)
+		v->root = trim_(v->root, v->size, size_to_levels_(v->size));
+	else
+		v->root = NULL;
 	v->cursor = NULL;
 	v->cursor_dirty = false;
 
@@ -328,4 +332,51 @@ void v_transient_end(Vector *v)
 }
 
 //----------------------------------------------------------------
+// Equality
+
+// Vectors of the same size have trees of the same shape, so we can walk
+// them together, skipping any subtrees they share.  count is the number of
+// entries within this subtree that are actually in use.
+static bool vb_equalp_(VBlock l, VBlock r, unsigned level, unsigned count)
+{
+	unsigned i, n;
+
+	if (l == r)
+		return true;
+
+	if (!level) {
+		for (i = 0; i < count; i++)
+			if (!equalp(l[i], r[i]))
+				return false;
+
+		return true;
+	}
+
+	for (i = 0; count; i++) {
+		n = min(count, full_tree(level));
+		if (!vb_equalp_(l[i].ptr, r[i].ptr, level - 1, n))
+			return false;
+		count -= n;
+	}
 
+	return true;
+}
+
+bool v_equalp(Vector *lhs, Vector *rhs)
+{
+	if (lhs == rhs)
+		return true;
+
+	if (lhs->size != rhs->size)
+		return false;
+
+	if (!lhs->size)
+		return true;
+
+	commit_cursor_(lhs);
+	commit_cursor_(rhs);
+	return vb_equalp_(lhs->root, rhs->root, size_to_levels_(lhs->size) - 1,
+			  lhs->size);
+}
+
+//----------------------------------------------------------------
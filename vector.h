@@ -27,6 +27,9 @@ Vector *v_pop(Vector *v);
 Vector *v_transient_begin(Vector *v);
 void v_transient_end(Vector *v);
 
+// Structural equality, shared subtrees aren't compared.
+bool v_equalp(Vector *lhs, Vector *rhs);
+
 //----------------------------------------------------------------
 
 #endif
@@ -23,6 +23,49 @@ static void t_append_once()
 	assert(equalp(v_ref(v2, 0), mk_fixnum(123)));
 }
 
+static void t_pop_to_empty()
+{
+	Vector *v = v_push(v_empty(), mk_fixnum(123));
+	Vector *v2 = v_pop(v);
+	assert(v_size(v2) == 0);
+	assert(v_size(v) == 1);
+
+	v2 = v_push(v2, mk_fixnum(234));
+	assert(equalp(v_ref(v2, 0), mk_fixnum(234)));
+	assert(equalp(v_ref(v, 0), mk_fixnum(123)));
+}
+
+static void t_list_to_vector()
+{
+	Value xs = mk_ref(cons(mk_fixnum(1), mk_ref(cons(mk_fixnum(2), mk_nil()))));
+	Vector *v = list_to_vector(xs).ptr;
+
+	assert(v_size(v) == 2);
+	assert(equalp(v_ref(v, 0), mk_fixnum(1)));
+	assert(equalp(v_ref(v, 1), mk_fixnum(2)));
+}
+
+static void t_equal()
+{
+	unsigned i, count = 1000;
+	Vector *v = v_empty(), *v2, *v3;
+
+	for (i = 0; i < count; i++)
+		v = v_push(v, mk_ref(mk_string_from_cstr(STRING, "foo")));
+
+	v2 = v_set(v, 500, mk_fixnum(1));
+	v3 = v_set(v2, 500, mk_ref(mk_string_from_cstr(STRING, "foo")));
+
+	assert(equalp(mk_ref(v), mk_ref(v)));
+	assert(!equalp(mk_ref(v), mk_ref(v2)));
+	assert(equalp(mk_ref(v), mk_ref(v3)));
+	assert(!equalp(mk_ref(v), mk_ref(v_pop(v3))));
+
+	// only the tail of a block beyond the size should be ignored
+	assert(equalp(mk_ref(v_resize(v_empty(), 3, mk_fixnum(0))),
+		      mk_ref(v_resize(v_resize(v_empty(), 5, mk_fixnum(0)), 3, mk_fixnum(0)))));
+}
+
 static void t_append32()
 {
 	unsigned count = 32;
@@ -130,6 +173,9 @@ int main(int argc, const char *argv[])
 	mm_init(32 * 1024 * 1024);
 	run("empty_vector", t_empty_vector);
 	run("append_once", t_append_once);
+	run("pop_to_empty", t_pop_to_empty);
+	run("list_to_vector", t_list_to_vector);
+	run("equal", t_equal);
 	run("append32", t_append32);
 	run("square", t_square);
 	run("append_million", t_append_million);
@@ -16,17 +16,48 @@
 
 /*----------------------------------------------------------------*/
 
+// Each call site remembers the last function it called, and where to
+// enter it, so a call to the same function again skips the type dispatch
+// and arity check.  Entries are only trusted within the eval that filled
+// them, since nothing keeps fun alive.
+typedef struct {
+	void *fun;
+	unsigned char *entry;	// NULL for a primitive
+	unsigned nr;		// the number of arguments
+	unsigned epoch;
+} CallCache;
+
 typedef struct vm {
-	Thunk *code;
+	// b is the program counter, e the end of the code being run.
+	Thunk code;
 
 	Value val;
 	Frame *env;
+	Value *closed;	// the captured values of the running closure
 	Value fun;
 	Value arg1;
 	Value arg2;
 	Stack stack;
-	Vector *constants;
-	Vector *globals;
+
+	// Frames that don't escape are allocated here, rather than on the
+	// heap, and popped when their call returns.
+	char *frames_b, *frames_top, *frames_e;
+
+	// A flat copy of the environment's constants, which are only ever
+	// appended to, so it's brought up to date by copying the new ones.
+	Value *constants;
+	unsigned nr_constants;
+	const void *constants_owner; // the StaticEnv they came from
+
+	// Indexed by global, unbound globals are NULL.  vm_globals() gives a
+	// persistent snapshot of these.
+	Value *globals;
+	unsigned nr_globals;
+
+	CallCache *call_caches;
+	unsigned nr_call_caches;
+	unsigned epoch;
+
 	Vector *global_syms; // for debug
 } VM;
 
@@ -50,11 +81,43 @@ void print_string(FILE *stream, String *str);
 
 typedef struct {
 	String *in;
+	String *src; // strings are sliced from this, rather than copied
 	Token tok;
 } TokenStream;
 
 void stream_init(String *in, TokenStream *ts);
+
+// in is a cursor over src, which must be on the heap.  Strings that are read
+// share src's bytes.
+void stream_init_shared(String *src, String *in, TokenStream *ts);
 bool read_sexp(TokenStream *ts, Value *result);
+
+// A reader that input can be pushed into a chunk at a time.  fn is called
+// with each top level datum as soon as it's complete.
+typedef enum {
+	PR_SPACE,
+	PR_COMMENT,
+	PR_STRING,
+	PR_ESCAPE,	// the byte after a backslash in a string
+	PR_ATOM,
+} PushState;
+
+typedef struct {
+	char *b, *e, *alloc_e; // the incomplete datum
+	PushState state;
+	unsigned depth;
+	bool active; // we're part way through a datum
+} PushReader;
+
+typedef void (*PushFn)(void *context, Value v);
+
+void pr_init(PushReader *pr);
+void pr_exit(PushReader *pr);
+void pr_feed(PushReader *pr, const char *b, const char *e,
+	     PushFn fn, void *context);
+
+// Call at the end of input, it completes a trailing atom.
+void pr_finish(PushReader *pr, PushFn fn, void *context);
 void print(FILE *stream, Value v);
 
 /*----------------------------------------------------------------*/